@@ -63,17 +63,13 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 /*****************************************************************************/
 // state - array holding the intermediate results during decryption.
 typedef uint8_t state_t[4][4];
-static state_t* state;
 
-// The array that stores the round keys.
-static uint8_t RoundKey[176];
-
-// The Key input to the AES Program
-static const uint8_t* Key;
+// Round keys of the non-reentrant API, which keeps its key between calls
+static struct AES128_ctx default_ctx;
 
 #if defined(CBC) && CBC
-  // Initial Vector used only for CBC mode
-  static uint8_t* Iv;
+  // Initial Vector used only for CBC mode, kept between calls of the non-reentrant API
+  static uint8_t default_iv[KEYLEN];
 #endif
 
 // The lookup-tables are marked const so they can be placed in read-only storage instead of RAM
@@ -153,7 +149,7 @@ static uint8_t getSBoxInvert(uint8_t num)
 }
 
 // This function produces Nb(Nr+1) round keys. The round keys are used in each round to decrypt the states. 
-static void KeyExpansion(void)
+static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key)
 {
   uint32_t i, j, k;
   uint8_t tempa[4]; // Used for the column/row operations
@@ -220,7 +216,7 @@ static void KeyExpansion(void)
 
 // This function adds the round key to state.
 // The round key is added to the state by an XOR function.
-static void AddRoundKey(uint8_t round)
+static void AddRoundKey(uint8_t round, state_t* state, const uint8_t* RoundKey)
 {
   uint8_t i,j;
   for(i=0;i<4;++i)
@@ -234,7 +230,7 @@ static void AddRoundKey(uint8_t round)
 
 // The SubBytes Function Substitutes the values in the
 // state matrix with values in an S-box.
-static void SubBytes(void)
+static void SubBytes(state_t* state)
 {
   uint8_t i, j;
   for(i = 0; i < 4; ++i)
@@ -249,7 +245,7 @@ static void SubBytes(void)
 // The ShiftRows() function shifts the rows in the state to the left.
 // Each row is shifted with different offset.
 // Offset = Row number. So the first row is not shifted.
-static void ShiftRows(void)
+static void ShiftRows(state_t* state)
 {
   uint8_t temp;
 
@@ -283,7 +279,7 @@ static uint8_t xtime(uint8_t x)
 }
 
 // MixColumns function mixes the columns of the state matrix
-static void MixColumns(void)
+static void MixColumns(state_t* state)
 {
   uint8_t i;
   uint8_t Tmp,Tm,t;
@@ -321,7 +317,7 @@ static uint8_t Multiply(uint8_t x, uint8_t y)
 // MixColumns function mixes the columns of the state matrix.
 // The method used to multiply may be difficult to understand for the inexperienced.
 // Please use the references to gain more information.
-static void InvMixColumns(void)
+static void InvMixColumns(state_t* state)
 {
   int i;
   uint8_t a,b,c,d;
@@ -342,7 +338,7 @@ static void InvMixColumns(void)
 
 // The SubBytes Function Substitutes the values in the
 // state matrix with values in an S-box.
-static void InvSubBytes(void)
+static void InvSubBytes(state_t* state)
 {
   uint8_t i,j;
   for(i=0;i<4;++i)
@@ -354,7 +350,7 @@ static void InvSubBytes(void)
   }
 }
 
-static void InvShiftRows(void)
+static void InvShiftRows(state_t* state)
 {
   uint8_t temp;
 
@@ -384,54 +380,54 @@ static void InvShiftRows(void)
 
 
 // Cipher is the main function that encrypts the PlainText.
-static void Cipher(void)
+static void Cipher(state_t* state, const uint8_t* RoundKey)
 {
   uint8_t round = 0;
 
   // Add the First round key to the state before starting the rounds.
-  AddRoundKey(0); 
+  AddRoundKey(0, state, RoundKey); 
   
   // There will be Nr rounds.
   // The first Nr-1 rounds are identical.
   // These Nr-1 rounds are executed in the loop below.
   for(round = 1; round < Nr; ++round)
   {
-    SubBytes();
-    ShiftRows();
-    MixColumns();
-    AddRoundKey(round);
+    SubBytes(state);
+    ShiftRows(state);
+    MixColumns(state);
+    AddRoundKey(round, state, RoundKey);
   }
   
   // The last round is given below.
   // The MixColumns function is not here in the last round.
-  SubBytes();
-  ShiftRows();
-  AddRoundKey(Nr);
+  SubBytes(state);
+  ShiftRows(state);
+  AddRoundKey(Nr, state, RoundKey);
 }
 
-static void InvCipher(void)
+static void InvCipher(state_t* state, const uint8_t* RoundKey)
 {
   uint8_t round=0;
 
   // Add the First round key to the state before starting the rounds.
-  AddRoundKey(Nr); 
+  AddRoundKey(Nr, state, RoundKey); 
 
   // There will be Nr rounds.
   // The first Nr-1 rounds are identical.
   // These Nr-1 rounds are executed in the loop below.
   for(round=Nr-1;round>0;round--)
   {
-    InvShiftRows();
-    InvSubBytes();
-    AddRoundKey(round);
-    InvMixColumns();
+    InvShiftRows(state);
+    InvSubBytes(state);
+    AddRoundKey(round, state, RoundKey);
+    InvMixColumns(state);
   }
   
   // The last round is given below.
   // The MixColumns function is not here in the last round.
-  InvShiftRows();
-  InvSubBytes();
-  AddRoundKey(0);
+  InvShiftRows(state);
+  InvSubBytes(state);
+  AddRoundKey(0, state, RoundKey);
 }
 
 static void BlockCopy(uint8_t* output, uint8_t* input)
@@ -448,6 +444,12 @@ static void BlockCopy(uint8_t* output, uint8_t* input)
 /*****************************************************************************/
 /* Public functions:                                                         */
 /*****************************************************************************/
+void AES128_init_ctx(struct AES128_ctx* ctx, const uint8_t* key)
+{
+  KeyExpansion(ctx->RoundKey, key);
+}
+
+
 #if defined(ECB) && ECB
 
 
@@ -455,26 +457,22 @@ void AES128_ECB_encrypt(uint8_t* input, const uint8_t* key, uint8_t* output)
 {
   // Copy input to output, and work in-memory on output
   BlockCopy(output, input);
-  state = (state_t*)output;
 
-  Key = key;
-  KeyExpansion();
+  KeyExpansion(default_ctx.RoundKey, key);
 
   // The next function call encrypts the PlainText with the Key using AES algorithm.
-  Cipher();
+  Cipher((state_t*)output, default_ctx.RoundKey);
 }
 
 void AES128_ECB_decrypt(uint8_t* input, const uint8_t* key, uint8_t *output)
 {
   // Copy input to output, and work in-memory on output
   BlockCopy(output, input);
-  state = (state_t*)output;
 
   // The KeyExpansion routine must be called before encryption.
-  Key = key;
-  KeyExpansion();
+  KeyExpansion(default_ctx.RoundKey, key);
 
-  InvCipher();
+  InvCipher((state_t*)output, default_ctx.RoundKey);
 }
 
 
@@ -487,7 +485,7 @@ void AES128_ECB_decrypt(uint8_t* input, const uint8_t* key, uint8_t *output)
 #if defined(CBC) && CBC
 
 
-static void XorWithIv(uint8_t* buf)
+static void XorWithIv(uint8_t* buf, const uint8_t* Iv)
 {
   uint8_t i;
   for(i = 0; i < KEYLEN; ++i)
@@ -496,74 +494,106 @@ static void XorWithIv(uint8_t* buf)
   }
 }
 
-void AES128_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv)
+// Encrypts with the round keys of ctx, chaining from iv; the last cipher block is left in next_iv if given
+static void CBC_encrypt(const struct AES128_ctx* ctx, uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* iv, uint8_t* next_iv)
 {
   uintptr_t i;
   uint8_t remainders = length % KEYLEN; /* Remaining bytes in the last non-full block */
+  const uint8_t* Iv = iv;
 
-  // Skip the key expansion if key is passed as 0
-  if(0 != key)
+  for(i = KEYLEN; i <= length; i += KEYLEN)
   {
-    Key = key;
-    KeyExpansion();
+    BlockCopy(output, input);
+    XorWithIv(output, Iv);
+    Cipher((state_t*)output, ctx->RoundKey);
+    Iv = output;
+    input += KEYLEN;
+    output += KEYLEN;
   }
 
-  if(iv != 0)
+  if(remainders)
   {
-    Iv = (uint8_t*)iv;
+    BlockCopy(output, input);
+    memset(output + remainders, 0, KEYLEN - remainders); /* add 0-padding */
+    XorWithIv(output, Iv);
+    Cipher((state_t*)output, ctx->RoundKey);
+    Iv = output;
   }
 
+  if(next_iv != 0 && Iv != next_iv)
+  {
+    memmove(next_iv, Iv, KEYLEN);
+  }
+}
+
+// Decrypts with the round keys of ctx; a copy of each cipher block is kept, so output may equal input
+static void CBC_decrypt(const struct AES128_ctx* ctx, uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* iv, uint8_t* next_iv)
+{
+  uintptr_t i;
+  uint8_t Iv[KEYLEN];
+  uint8_t next[KEYLEN];
+
+  memcpy(Iv, iv, KEYLEN);
   for(i = KEYLEN; i <= length; i += KEYLEN)
   {
+    BlockCopy(next, input);
     BlockCopy(output, input);
-    XorWithIv(output);
-    state = (state_t*)output;
-    Cipher();
-    Iv = output;
+    InvCipher((state_t*)output, ctx->RoundKey);
+    XorWithIv(output, Iv);
+    BlockCopy(Iv, next);
     input += KEYLEN;
     output += KEYLEN;
   }
 
-  if(remainders)
+  if(next_iv != 0)
   {
-    BlockCopy(output, input);
-    memset(output + remainders, 0, KEYLEN - remainders); /* add 0-padding */
-    XorWithIv(output);
-    state = (state_t*)output;
-    Cipher();
+    memcpy(next_iv, Iv, KEYLEN);
   }
 }
 
-void AES128_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv)
+void AES128_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv)
 {
-  uintptr_t i;
-  
   // Skip the key expansion if key is passed as 0
   if(0 != key)
   {
-    Key = key;
-    KeyExpansion();
+    KeyExpansion(default_ctx.RoundKey, key);
   }
 
   // If iv is passed as 0, we continue to encrypt without re-setting the Iv
   if(iv != 0)
   {
-    Iv = (uint8_t*)iv;
+    memmove(default_iv, iv, KEYLEN);
   }
 
-  for(i = KEYLEN; i <= length; i += KEYLEN)
+  CBC_encrypt(&default_ctx, output, input, length, default_iv, default_iv);
+}
+
+void AES128_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv)
+{
+  // Skip the key expansion if key is passed as 0
+  if(0 != key)
   {
-    BlockCopy(output, input);
-    state = (state_t*)output;
-    InvCipher();
-    XorWithIv(output);
-    Iv = input;
-    input += KEYLEN;
-    output += KEYLEN;
+    KeyExpansion(default_ctx.RoundKey, key);
   }
+
+  // If iv is passed as 0, we continue to decrypt without re-setting the Iv
+  if(iv != 0)
+  {
+    memmove(default_iv, iv, KEYLEN);
+  }
+
+  CBC_decrypt(&default_ctx, output, input, length, default_iv, default_iv);
 }
 
+void AES128_CBC_encrypt_buffer_ctx(const struct AES128_ctx* ctx, uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* iv)
+{
+  CBC_encrypt(ctx, output, input, length, iv, 0);
+}
 
-#endif // #if defined(CBC) && CBC
+void AES128_CBC_decrypt_buffer_ctx(const struct AES128_ctx* ctx, uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* iv)
+{
+  CBC_decrypt(ctx, output, input, length, iv, 0);
+}
 
 
+#endif // #if defined(CBC) && CBC
@@ -20,6 +20,16 @@
 
 
 
+// Expanded round keys of one key. Unlike the functions below that take a raw key,
+// the _ctx variants keep no state between calls and are safe to use from several threads.
+struct AES128_ctx
+{
+  uint8_t RoundKey[176];
+};
+
+void AES128_init_ctx(struct AES128_ctx* ctx, const uint8_t* key);
+
+
 #if defined(ECB) && ECB
 
 void AES128_ECB_encrypt(uint8_t* input, const uint8_t* key, uint8_t *output);
@@ -33,6 +43,9 @@ void AES128_ECB_decrypt(uint8_t* input, const uint8_t* key, uint8_t *output);
 void AES128_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv);
 void AES128_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv);
 
+void AES128_CBC_encrypt_buffer_ctx(const struct AES128_ctx* ctx, uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* iv);
+void AES128_CBC_decrypt_buffer_ctx(const struct AES128_ctx* ctx, uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* iv);
+
 #endif // #if defined(CBC) && CBC
 
 
@@ -0,0 +1,382 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "functions.h"
+#include "aes.h"
+#include "sha1.h"
+#include "gen.h"
+#include "progress.h"
+#include "wudecrypt.h"
+
+// Bumped whenever a field of the JSON output changes meaning
+#define BENCH_FORMAT 1
+
+struct bench_image {
+    const char* name;
+    uint32_t file_count;
+    uint64_t min_size;
+    uint64_t max_size;
+    uint32_t unhashed_percent;
+
+    char path[1024];
+    char commonkey_path[1024];
+    char disckey_path[1024];
+    uint8_t* commonkey;
+    uint8_t* disckey;
+};
+
+// The synthetic images of the end-to-end runs, -s multiplies the file counts
+static struct bench_image images[] = {
+    { "small_files", 8000, 256, 0x10000, 25 },
+    { "huge_files", 2, 0x3000000, 0x6000000, 0 },
+    { "mixed", 200, 1024, 0x800000, 50 },
+};
+#define BENCH_IMAGE_COUNT (sizeof(images) / sizeof(images[0]))
+
+struct bench_state {
+    uint8_t* input;
+    uint8_t* output;
+    uint8_t key[16];
+    uint8_t iv[16];
+    uint32_t size;
+
+    struct bench_image* image;
+    struct image_source* source;
+    struct partition* partitions;
+    uint32_t partition_count;
+    wud_context* context;
+};
+
+// One benchmark, run() is a single timed iteration moving bytes and items
+struct bench {
+    const char* name;
+    const char* group;
+    int (*setup)(struct bench* bench, struct bench_state* state);
+    int (*run)(struct bench_state* state);
+    void (*teardown)(struct bench_state* state);
+    uint32_t size;
+    int image;
+    uint64_t bytes;
+    uint64_t items;
+};
+
+static int setup_buffers(struct bench* bench, struct bench_state* state) {
+    uint32_t i;
+
+    state->size = bench->size;
+    state->input = (uint8_t*)malloc(bench->size);
+    state->output = (uint8_t*)malloc(bench->size);
+    if (state->input == NULL || state->output == NULL) {
+        return -1;
+    }
+    for (i = 0; i < bench->size; i++) {
+        state->input[i] = (uint8_t)(i * 131 + 7);
+    }
+    for (i = 0; i < 16; i++) {
+        state->key[i] = (uint8_t)(i * 17 + 1);
+        state->iv[i] = (uint8_t)(i * 29 + 3);
+    }
+    bench->bytes = bench->size;
+    bench->items = 1;
+    return 0;
+}
+
+static void teardown_buffers(struct bench_state* state) {
+    free(state->input);
+    free(state->output);
+}
+
+static int run_aes(struct bench_state* state) {
+    AES128_CBC_decrypt_buffer(state->output, state->input, state->size, state->key, state->iv);
+    return 0;
+}
+
+static int run_sha1(struct bench_state* state) {
+    mbedtls_sha1(state->input, state->size, state->output);
+    return 0;
+}
+
+// The small_files image, opened without parsing anything yet
+static int setup_source(struct bench* bench, struct bench_state* state) {
+    uint32_t i;
+
+    state->image = &images[bench->image];
+    state->source = image_open(state->image->path);
+    if (state->source == NULL) {
+        return -1;
+    }
+    state->partitions = read_partitions(state->source, state->image->commonkey, state->image->disckey, &(state->partition_count));
+    if (state->partitions == NULL) {
+        image_close(state->source);
+        return -1;
+    }
+    bench->bytes = 0;
+    bench->items = 0;
+    for (i = 0; i < state->partition_count; i++) {
+        if (state->partitions[i].has_key) {
+            bench->items += utarray_len(state->partitions[i].entries);
+        }
+    }
+    return 0;
+}
+
+static void teardown_source(struct bench_state* state) {
+    free_partitions(state->partitions, state->partition_count);
+    image_close(state->source);
+}
+
+static int run_fst_parse(struct bench_state* state) {
+    uint32_t count;
+    struct partition* partitions = read_partitions(state->source, state->image->commonkey, state->image->disckey, &count);
+
+    if (partitions == NULL) {
+        return -1;
+    }
+    free_partitions(partitions, count);
+    return 0;
+}
+
+static int run_create_directory(struct bench_state* state) {
+    uint32_t i, index;
+
+    for (i = 0; i < state->partition_count; i++) {
+        if (state->partitions[i].has_key) {
+            index = 0;
+            free_directory(create_directory(&(state->partitions[i]), &index, ""));
+        }
+    }
+    return 0;
+}
+
+static int setup_context(struct bench* bench, struct bench_state* state) {
+    uint32_t p, f;
+
+    state->image = &images[bench->image];
+    state->context = wud_open(state->image->path, state->image->commonkey, state->image->disckey);
+    if (state->context == NULL) {
+        return -1;
+    }
+    bench->bytes = 0;
+    bench->items = 0;
+    for (p = 0; p < wud_partition_count(state->context); p++) {
+        for (f = 0; f < wud_file_count(state->context, p); f++) {
+            bench->bytes += wud_file_size(wud_file(state->context, p, f));
+            bench->items++;
+        }
+    }
+    return 0;
+}
+
+static void teardown_context(struct bench_state* state) {
+    wud_close(state->context);
+}
+
+// Every file of every partition, decrypted and thrown away so the disk under the output doesn't count
+static int run_extract(struct bench_state* state) {
+    struct output_sink* sink = sink_create_null();
+    uint64_t total_bytes;
+    uint32_t p, f, file_count;
+    int result = 0;
+
+    if (sink == NULL) {
+        return -1;
+    }
+    for (p = 0; p < wud_partition_count(state->context) && result == 0; p++) {
+        if (wud_partition_root(state->context, p) == NULL) {
+            continue;
+        }
+        total_bytes = 0;
+        file_count = wud_file_count(state->context, p);
+        for (f = 0; f < file_count; f++) {
+            total_bytes += wud_file_size(wud_file(state->context, p, f));
+        }
+        // Keeps the file listing off the output, the summary line goes to stderr
+        progress_start(state->image->name, total_bytes, file_count, stderr);
+        result = wud_extract_partition(state->context, p, "bench", sink);
+        progress_stop();
+    }
+    if (sink_finish(sink) != 0) {
+        result = -1;
+    }
+    sink_free(sink);
+    return result;
+}
+
+static struct bench benches[] = {
+    { "aes_cbc_decrypt_0x400", "micro", setup_buffers, run_aes, teardown_buffers, 0x400 },
+    { "aes_cbc_decrypt_0x8000", "micro", setup_buffers, run_aes, teardown_buffers, 0x8000 },
+    { "aes_cbc_decrypt_0xfc00", "micro", setup_buffers, run_aes, teardown_buffers, 0xFC00 },
+    { "sha1_0xfc00", "micro", setup_buffers, run_sha1, teardown_buffers, 0xFC00 },
+    { "fst_parse", "micro", setup_source, run_fst_parse, teardown_source, 0, 0 },
+    { "create_directory", "micro", setup_source, run_create_directory, teardown_source, 0, 0 },
+    { "extract_small_files", "end_to_end", setup_context, run_extract, teardown_context, 0, 0 },
+    { "extract_huge_files", "end_to_end", setup_context, run_extract, teardown_context, 0, 1 },
+    { "extract_mixed", "end_to_end", setup_context, run_extract, teardown_context, 0, 2 },
+};
+#define BENCH_COUNT (sizeof(benches) / sizeof(benches[0]))
+
+// Writes an image unless an earlier run left one with the same parameters, and loads its keys
+static int prepare_image(struct bench_image* image, const char* datadir, uint32_t scale) {
+    struct gen_options options;
+    FILE* file;
+
+    snprintf(image->path, sizeof(image->path), "%s/%s-%u.wud", datadir, image->name, scale);
+    snprintf(image->commonkey_path, sizeof(image->commonkey_path), "%s/%s-%u.commonkey.bin", datadir, image->name, scale);
+    snprintf(image->disckey_path, sizeof(image->disckey_path), "%s/%s-%u.disckey.bin", datadir, image->name, scale);
+
+    file = fopen(image->disckey_path, "rb");
+    if (file != NULL) {
+        fclose(file);
+    } else {
+        gen_default_options(&options);
+        options.file_count = image->file_count * scale;
+        options.min_size = image->min_size;
+        options.max_size = image->max_size;
+        options.unhashed_percent = image->unhashed_percent;
+        fprintf(stderr, "Generating %s\n", image->path);
+        // The disc key is written last, its presence marks a complete image
+        if (gen_write_image(&options, image->path, image->commonkey_path, image->disckey_path, NULL) < 0) {
+            remove(image->disckey_path);
+            return -1;
+        }
+    }
+
+    image->commonkey = loadKey(image->commonkey_path);
+    image->disckey = loadKey(image->disckey_path);
+    return (image->commonkey != NULL && image->disckey != NULL) ? 0 : -1;
+}
+
+static int compare_durations(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// One warm-up, then iterations until min_seconds have passed, at least min_iterations of them
+static int run_bench(struct bench* bench, double min_seconds, uint32_t min_iterations, FILE* output, int first) {
+    struct bench_state state;
+    uint64_t* durations = NULL;
+    uint64_t* grown;
+    uint64_t count = 0, capacity = 0, total = 0, start;
+    double median, mean;
+    int result = 0;
+
+    memset(&state, 0, sizeof(state));
+    if (bench->setup(bench, &state) != 0) {
+        fprintf(stderr, "Error: Could not set up benchmark %s\n", bench->name);
+        return -1;
+    }
+    if (bench->run(&state) != 0) {
+        result = -1;
+    }
+    while (result == 0 && (count < min_iterations || total < (uint64_t)(min_seconds * 1e9))) {
+        if (count == capacity) {
+            capacity = (capacity > 0) ? capacity * 2 : 1024;
+            grown = (uint64_t*)realloc(durations, capacity * sizeof(uint64_t));
+            if (grown == NULL) {
+                result = -1;
+                break;
+            }
+            durations = grown;
+        }
+        start = monotonic_nanoseconds();
+        if (bench->run(&state) != 0) {
+            result = -1;
+            break;
+        }
+        durations[count] = monotonic_nanoseconds() - start;
+        total += durations[count++];
+    }
+    bench->teardown(&state);
+    if (result != 0) {
+        fprintf(stderr, "Error: Benchmark %s failed\n", bench->name);
+        free(durations);
+        return -1;
+    }
+
+    qsort(durations, (size_t)count, sizeof(uint64_t), compare_durations);
+    median = ((count % 2) ? durations[count / 2] : (durations[count / 2 - 1] + durations[count / 2]) / 2) / 1e9;
+    mean = total / 1e9 / count;
+    fprintf(output, "%s\n    {\"name\":\"%s\",\"group\":\"%s\",\"iterations\":%llu,\"bytes\":%llu,\"items\":%llu,"
+        "\"min_seconds\":%.9f,\"median_seconds\":%.9f,\"mean_seconds\":%.9f,\"max_seconds\":%.9f,\"mib_per_second\":%.3f,\"items_per_second\":%.3f}",
+        first ? "" : ",", bench->name, bench->group, (unsigned long long int)count, (unsigned long long int)bench->bytes, (unsigned long long int)bench->items,
+        durations[0] / 1e9, median, mean, durations[count - 1] / 1e9,
+        (median > 0) ? bench->bytes / median / (1024 * 1024) : 0.0, (median > 0) ? bench->items / median : 0.0);
+    fprintf(stderr, "%-24s %10.1f MiB/s %12.1f items/s over %llu iterations\n", bench->name, (median > 0) ? bench->bytes / median / (1024 * 1024) : 0.0,
+        (median > 0) ? bench->items / median : 0.0, (unsigned long long int)count);
+    free(durations);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    const char* datadir = "bench-data";
+    const char* filter = NULL;
+    const char* outputpath = NULL;
+    double seconds = 1.0;
+    uint32_t runs = 3, scale = 1, i;
+    int first = 1, failed = 0, needs_images = 0, a;
+    FILE* output = stdout;
+
+    for (a = 1; a + 1 < argc; a += 2) {
+        if (strcmp(argv[a], "-d") == 0) datadir = argv[a + 1];
+        else if (strcmp(argv[a], "-f") == 0) filter = argv[a + 1];
+        else if (strcmp(argv[a], "-o") == 0) outputpath = argv[a + 1];
+        else if (strcmp(argv[a], "-t") == 0) seconds = atof(argv[a + 1]);
+        else if (strcmp(argv[a], "-r") == 0) runs = (uint32_t)strtoul(argv[a + 1], NULL, 0);
+        else if (strcmp(argv[a], "-s") == 0) scale = (uint32_t)strtoul(argv[a + 1], NULL, 0);
+        else break;
+    }
+    if (a < argc || scale == 0) {
+        printf("Usage: %s [-d <data dir>] [-f <name filter>] [-o <output.json>] [-t <seconds per micro benchmark>] [-r <end-to-end runs>] [-s <image scale>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < BENCH_COUNT; i++) {
+        if ((filter == NULL || strstr(benches[i].name, filter) != NULL) && benches[i].setup != setup_buffers) {
+            needs_images = 1;
+        }
+    }
+    if (needs_images) {
+        if (makedir(datadir) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: Could not create %s\n", datadir);
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < BENCH_IMAGE_COUNT; i++) {
+            if (prepare_image(&images[i], datadir, scale) != 0) {
+                fprintf(stderr, "Error: Could not prepare image %s\n", images[i].name);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    if (outputpath != NULL && strcmp(outputpath, "-") != 0) {
+        output = fopen(outputpath, "w");
+        if (output == NULL) {
+            fprintf(stderr, "Error: Could not open %s for writing\n", outputpath);
+            exit(EXIT_FAILURE);
+        }
+    }
+    fprintf(output, "{\n  \"format\":%d,\n  \"scale\":%u,\n  \"results\":[", BENCH_FORMAT, scale);
+    for (i = 0; i < BENCH_COUNT; i++) {
+        if (filter != NULL && strstr(benches[i].name, filter) == NULL) {
+            continue;
+        }
+        if (run_bench(&benches[i], (strcmp(benches[i].group, "micro") == 0) ? seconds : 0, (strcmp(benches[i].group, "micro") == 0) ? 5 : runs, output, first) == 0) {
+            first = 0;
+        } else {
+            failed = 1;
+        }
+    }
+    fprintf(output, "\n  ]\n}\n");
+    if (output != stdout) {
+        fclose(output);
+    }
+
+    for (i = 0; i < BENCH_IMAGE_COUNT; i++) {
+        free(images[i].commonkey);
+        free(images[i].disckey);
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+
+static uint32_t bucket_of(struct block_cache* cache, uint64_t offset) {
+    return (uint32_t)((offset >> 15) % cache->bucket_count);
+}
+
+static int32_t find_slot(struct block_cache* cache, uint64_t offset) {
+    int32_t slot;
+    for (slot = cache->buckets[bucket_of(cache, offset)]; slot >= 0; slot = cache->next[slot]) {
+        if (cache->offsets[slot] == offset) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+static void unlink_slot(struct block_cache* cache, int32_t slot) {
+    int32_t* link = &(cache->buckets[bucket_of(cache, cache->offsets[slot])]);
+    while (*link >= 0) {
+        if (*link == slot) {
+            *link = cache->next[slot];
+            return;
+        }
+        link = &(cache->next[*link]);
+    }
+}
+
+struct block_cache* block_cache_create(uint32_t slot_count, uint32_t readahead) {
+    struct block_cache* cache = (struct block_cache*)calloc(1, sizeof(struct block_cache));
+    uint32_t i;
+
+    if (cache == NULL || slot_count == 0) {
+        free(cache);
+        return NULL;
+    }
+
+    cache->slot_count = slot_count;
+    cache->bucket_count = slot_count * 2;
+    cache->readahead = (readahead > 0) ? readahead : 1;
+    cache->next_offset = UINT64_MAX;
+    cache->offsets = (uint64_t*)malloc(slot_count * sizeof(uint64_t));
+    cache->sizes = (uint32_t*)calloc(slot_count, sizeof(uint32_t));
+    cache->last_used = (uint64_t*)calloc(slot_count, sizeof(uint64_t));
+    cache->next = (int32_t*)malloc(slot_count * sizeof(int32_t));
+    cache->buckets = (int32_t*)malloc(cache->bucket_count * sizeof(int32_t));
+    cache->data = (uint8_t*)malloc((size_t)slot_count * CACHE_BLOCK_SIZE);
+    if (cache->offsets == NULL || cache->sizes == NULL || cache->last_used == NULL
+        || cache->next == NULL || cache->buckets == NULL || cache->data == NULL) {
+        fprintf(stderr, "Could not allocate enough memory for the block cache\n");
+        block_cache_free(cache);
+        return NULL;
+    }
+
+    // An empty slot has size 0 and is in no hash chain
+    for (i = 0; i < slot_count; i++) {
+        cache->offsets[i] = UINT64_MAX;
+        cache->next[i] = -1;
+    }
+    for (i = 0; i < cache->bucket_count; i++) {
+        cache->buckets[i] = -1;
+    }
+
+    pthread_mutex_init(&(cache->lock), NULL);
+    return cache;
+}
+
+void block_cache_free(struct block_cache* cache) {
+    if (cache == NULL) {
+        return;
+    }
+    if (cache->data != NULL) {
+        pthread_mutex_destroy(&(cache->lock));
+    }
+    free(cache->offsets);
+    free(cache->sizes);
+    free(cache->last_used);
+    free(cache->next);
+    free(cache->buckets);
+    free(cache->data);
+    free(cache);
+}
+
+// Copies a cached block to output, returns 1 on a hit and 0 on a miss
+int block_cache_get(struct block_cache* cache, uint64_t offset, uint8_t* output, uint32_t* size) {
+    int32_t slot;
+
+    pthread_mutex_lock(&(cache->lock));
+    slot = find_slot(cache, offset);
+    if (slot < 0) {
+        cache->misses++;
+        pthread_mutex_unlock(&(cache->lock));
+        return 0;
+    }
+    cache->hits++;
+    cache->last_used[slot] = ++(cache->tick);
+    memcpy(output, cache->data + (size_t)slot * CACHE_BLOCK_SIZE, cache->sizes[slot]);
+    *size = cache->sizes[slot];
+    pthread_mutex_unlock(&(cache->lock));
+    return 1;
+}
+
+// Stores a decrypted block, evicting the least recently used one if the cache is full
+void block_cache_put(struct block_cache* cache, uint64_t offset, uint8_t* data, uint32_t size) {
+    int32_t slot;
+    uint32_t i;
+
+    if (size > CACHE_BLOCK_SIZE) {
+        return;
+    }
+
+    pthread_mutex_lock(&(cache->lock));
+    slot = find_slot(cache, offset);
+    if (slot < 0) {
+        slot = 0;
+        for (i = 1; i < cache->slot_count; i++) {
+            if (cache->last_used[i] < cache->last_used[slot]) {
+                slot = (int32_t)i;
+            }
+        }
+        if (cache->sizes[slot] != 0) {
+            unlink_slot(cache, slot);
+        }
+        cache->offsets[slot] = offset;
+        cache->next[slot] = cache->buckets[bucket_of(cache, offset)];
+        cache->buckets[bucket_of(cache, offset)] = slot;
+    }
+    memcpy(cache->data + (size_t)slot * CACHE_BLOCK_SIZE, data, size);
+    cache->sizes[slot] = size;
+    cache->last_used[slot] = ++(cache->tick);
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+// Number of blocks to decrypt for a miss at offset: the readahead window when reads are sequential, else one
+uint32_t block_cache_readahead(struct block_cache* cache, uint64_t offset, uint64_t block_size) {
+    uint32_t count;
+
+    pthread_mutex_lock(&(cache->lock));
+    count = (offset == cache->next_offset) ? cache->readahead : 1;
+    cache->next_offset = offset + (count * block_size);
+    pthread_mutex_unlock(&(cache->lock));
+    return count;
+}
@@ -0,0 +1,39 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Largest decrypted block the cache has to hold (one hashed cluster block)
+#define CACHE_BLOCK_SIZE 0x10000
+
+struct block_cache {
+    pthread_mutex_t lock;
+
+    uint32_t slot_count;
+    uint32_t bucket_count;
+    uint64_t tick;
+
+    // Per slot: image offset of the encrypted block, decrypted size, last use and hash chain
+    uint64_t* offsets;
+    uint32_t* sizes;
+    uint64_t* last_used;
+    int32_t* next;
+    int32_t* buckets;
+    uint8_t* data;
+
+    // Image offset directly behind the last missed block, used to detect sequential reads
+    uint64_t next_offset;
+    uint32_t readahead;
+
+    uint64_t hits;
+    uint64_t misses;
+};
+
+struct block_cache* block_cache_create(uint32_t slot_count, uint32_t readahead);
+void block_cache_free(struct block_cache* cache);
+
+int block_cache_get(struct block_cache* cache, uint64_t offset, uint8_t* output, uint32_t* size);
+void block_cache_put(struct block_cache* cache, uint64_t offset, uint8_t* data, uint32_t size);
+uint32_t block_cache_readahead(struct block_cache* cache, uint64_t offset, uint64_t block_size);
+#endif // _CACHE_H_
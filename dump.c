@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "functions.h"
+#include "aes.h"
+#include "dump.h"
+#include "probes.h"
+
+static int write_layout(struct output_sink* sink, struct partition* partition, const uint16_t* order, uint64_t image_size, int64_t bad_blocks, const char* path) {
+    struct partition_cluster* cluster;
+    uint8_t buffer[0x10000];
+    FILE* layout;
+    void* output;
+    long length;
+    uint64_t written = 0;
+    size_t got;
+    uint32_t c;
+    int result = 0;
+
+    // Printed to a temporary file first, the sink has to know the size when opening the output
+    layout = tmpfile();
+    if (layout == NULL) {
+        return -1;
+    }
+    fprintf(layout, "{\"partition\":");
+    fprint_json_string(layout, partition->name);
+    fprintf(layout, ",\"image_offset\":%llu,\"size\":%llu,\"bad_blocks\":%lld,\"clusters\":[\n",
+        (unsigned long long int)(WIIU_DECRYPTED_AREA_OFFSET + partition->offset), (unsigned long long int)image_size, (long long int)bad_blocks);
+    for (c = 0; c < partition->cluster_count; c++) {
+        cluster = &(partition->clusters[order[c]]);
+        fprintf(layout, "{\"index\":%u,\"offset\":%llu,\"size\":%llu,\"hashed\":%s}%s\n", (unsigned int)order[c],
+            (unsigned long long int)cluster->offset, (unsigned long long int)cluster->size,
+            cluster_is_hashed(partition, order[c]) ? "true" : "false", (c + 1 < partition->cluster_count) ? "," : "");
+    }
+    fprintf(layout, "]}\n");
+    length = ftell(layout);
+    if (ferror(layout) || length < 0 || fseek(layout, 0, SEEK_SET) != 0) {
+        fclose(layout);
+        return -1;
+    }
+
+    output = sink->open(sink, path, (uint64_t)length);
+    if (output == NULL) {
+        fclose(layout);
+        return -1;
+    }
+    while (result == 0 && (got = fread(buffer, 1, sizeof(buffer), layout)) > 0) {
+        result = sink->write_at(sink, output, buffer, got, written);
+        written += got;
+    }
+    if (written != (uint64_t)length) {
+        result = -1;
+    }
+    if (sink->close(sink, output) != 0) {
+        result = -1;
+    }
+    fclose(layout);
+    return result;
+}
+
+int64_t dump_partition(struct image_source* infile, struct output_sink* sink, struct partition* partition, const char* outputdir) {
+    char path[1024];
+    struct partition_cluster* cluster;
+    struct AES128_ctx ctx;
+    uint8_t decrypted_header[0x400];
+    uint8_t iv[16];
+    uint8_t* chunk;
+    uint16_t* order;
+    void* output;
+    uint64_t image_size = 0;
+    uint64_t position, read_offset, read_size, got, block_size, k;
+    int64_t bad_blocks = 0;
+    uint32_t c;
+    int hashed, failed = 0;
+
+    if (sink->make_directory(sink, outputdir) != 0) {
+        fprintf(stderr, "Error: Could not create the output directory %s\n", outputdir);
+        return -1;
+    }
+    order = sort_clusters_by_offset(partition);
+    chunk = (uint8_t*)malloc(DUMP_CHUNK_SIZE);
+    if (order == NULL || chunk == NULL) {
+        fprintf(stderr, "Could not allocate enough memory to dump partition %s\n", partition->name);
+        free(order);
+        free(chunk);
+        return -1;
+    }
+    for (c = 0; c < partition->cluster_count; c++) {
+        if (partition->clusters[c].offset + partition->clusters[c].size > image_size) {
+            image_size = partition->clusters[c].offset + partition->clusters[c].size;
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/%s%s", outputdir, partition->name, DUMP_IMAGE_SUFFIX);
+    output = sink->open(sink, path, image_size);
+    if (output == NULL) {
+        fprintf(stderr, "Error: Could not open %s for writing\n", path);
+        free(order);
+        free(chunk);
+        return -1;
+    }
+
+    AES128_init_ctx(&ctx, partition->key);
+    image_hint(infile, IMAGE_HINT_SEQUENTIAL, WIIU_DECRYPTED_AREA_OFFSET + partition->offset, 0);
+    for (c = 0; c < partition->cluster_count && !failed; c++) {
+        cluster = &(partition->clusters[order[c]]);
+        hashed = cluster_is_hashed(partition, order[c]);
+        block_size = hashed ? 0x10000 : 0x8000;
+        // The IV of a cluster starts with its big endian cluster index
+        memset(iv, 0, 16);
+        iv[0] = (uint8_t)(order[c] >> 8);
+        iv[1] = (uint8_t)(order[c] & 0xFF);
+
+        for (position = 0; position < cluster->size && !failed; position += read_size) {
+            read_size = (cluster->size - position > DUMP_CHUNK_SIZE) ? DUMP_CHUNK_SIZE : cluster->size - position;
+            read_offset = WIIU_DECRYPTED_AREA_OFFSET + partition->offset + cluster->offset + position;
+            image_release(infile, read_offset);
+            got = readFileOffsetBuffer(read_offset, chunk, (size_t)read_size, infile);
+            got -= got % block_size;
+
+            for (k = 0; k < got; k += block_size) {
+                if (hashed) {
+                    // The header goes back in front of its data, decrypted as well
+                    if (decrypt_hashed_block(&ctx, chunk + k, iv, order[c], (int64_t)((position + k) / 0x10000), decrypted_header, chunk + k + 0x400) != 0) {
+                        bad_blocks++;
+                    }
+                    memcpy(chunk + k, decrypted_header, 0x400);
+                } else {
+                    // Every block starts over with the first IV
+                    AES128_CBC_decrypt_buffer_ctx(&ctx, chunk + k, chunk + k, 0x8000, iv);
+                    PROBE_BLOCK_DECRYPT(order[c], (position + k) / 0x8000, 0x8000);
+                }
+            }
+            if (got > 0 && sink->write_at(sink, output, chunk, (size_t)got, cluster->offset + position) != 0) {
+                fprintf(stderr, "Error: Couldn't write expected output for %s\n", path);
+                failed = 1;
+            }
+            if (got < read_size) {
+                fprintf(stderr, "Error: Couldn't read expected input for cluster %u of %s\n", (unsigned int)order[c], partition->name);
+                failed = 1;
+            }
+        }
+    }
+    free(chunk);
+    if (sink->close(sink, output) != 0) {
+        failed = 1;
+    }
+
+    if (bad_blocks > 0) {
+        fprintf(stderr, "Warning: %lld blocks of %s failed SHA1 checksum verification\n", (long long int)bad_blocks, partition->name);
+    }
+    snprintf(path, sizeof(path), "%s/%s%s", outputdir, partition->name, DUMP_LAYOUT_SUFFIX);
+    if (!failed && write_layout(sink, partition, order, image_size, bad_blocks, path) != 0) {
+        fprintf(stderr, "Error: Could not write %s\n", path);
+        failed = 1;
+    }
+    free(order);
+    return failed ? -1 : bad_blocks;
+}
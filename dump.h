@@ -0,0 +1,21 @@
+#ifndef _DUMP_H_
+#define _DUMP_H_
+#include <stdint.h>
+#include "struct.h"
+#include "image.h"
+#include "sink.h"
+
+// Bytes read and decrypted at once, a multiple of both block sizes
+#define DUMP_CHUNK_SIZE (4 * 1024 * 1024)
+
+// Names of the outputs next to each other in the output directory, after the partition name
+#define DUMP_IMAGE_SUFFIX ".img"
+#define DUMP_LAYOUT_SUFFIX ".layout.json"
+
+// Writes the whole decrypted partition to <outputdir>/<partition name>.img through sink, walking the image
+// front to back. Every cluster lands at its offset within the partition: hashed ones as 0x10000 byte blocks
+// of decrypted hash header and data, unhashed ones as 0x8000 byte blocks. Gaps between clusters are never
+// written, so with a sparse sink they stay holes. Where each cluster lies and how it is laid out goes to
+// <partition name>.layout.json. Returns the number of hashed blocks that failed their H0 check, or -1 on error.
+int64_t dump_partition(struct image_source* infile, struct output_sink* sink, struct partition* partition, const char* outputdir);
+#endif // _DUMP_H_
@@ -3,11 +3,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
 #include "config.h"
 #include "struct.h"
 #include "functions.h"
 #include "aes.h"
 #include "sha1.h"
+#include "store.h"
+#include "stats.h"
+#include "progress.h"
+#include "trace.h"
+#include "probes.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Blocks fetched with one vectored read while extracting a file, up to 1 MiB of hashed blocks
+#define EXTRACT_BATCH_BLOCKS 16
 
 uint8_t* loadKeyFile(FILE* file) {
     uint8_t* key;
@@ -48,18 +65,25 @@ uint8_t* loadKey(char* filename) {
     return key;
 }
 
-void* readFileOffset(uint64_t offset, size_t size, size_t count, FILE* file) {
+size_t readFileOffsetBuffer(uint64_t offset, void* buffer, size_t size, struct image_source* file) {
+    uint64_t start = stats_start();
+    size_t read;
+
+    PROBE_READ_START(offset, size);
+    read = file->read_at(file, offset, buffer, size);
+    PROBE_READ_DONE(offset, size, read);
+    stats_stop(STATS_READ, start, read, 0);
+    return read;
+}
+
+void* readFileOffset(uint64_t offset, size_t size, size_t count, struct image_source* file) {
     void* output;
-    if (fseek(file, offset, SEEK_SET) != 0) {
-        fprintf(stderr, "Error while seeking in file\n");
-        return NULL;
-    }
     output = malloc(size * count);
     if (output == NULL) {
         fprintf(stderr, "Could not allocate enough bytes to read into memory\n");
         return NULL;
     }
-    if (fread(output, size, count, file) != count) {
+    if (readFileOffsetBuffer(offset, output, size * count, file) != size * count) {
         fprintf(stderr, "WARNING: Could not read as many bytes as requested from file\n");
     }
     return output;
@@ -78,7 +102,7 @@ void* readFile(size_t size, size_t count, FILE* file) {
     return output;
 }
 
-uint8_t* readEncryptedOffset(uint8_t* key, uint64_t offset, size_t count, FILE* file) {
+uint8_t* readEncryptedOffset(uint8_t* key, uint64_t offset, size_t count, struct image_source* file) {
     uint8_t iv[16];
     uint8_t* encrypted_chunk = (uint8_t*)readFileOffset(offset, sizeof(uint8_t), count, file);
     uint8_t* decrypted_chunk;
@@ -100,7 +124,7 @@ uint8_t* readEncryptedOffset(uint8_t* key, uint64_t offset, size_t count, FILE*
     return decrypted_chunk;
 }
 
-uint8_t* readVolumeEncryptedOffset(uint8_t* key, int64_t volume_offset, int64_t cluster_offset, int64_t file_offset, size_t size, FILE* file) {
+uint8_t* readVolumeEncryptedOffset(uint8_t* key, int64_t volume_offset, int64_t cluster_offset, int64_t file_offset, size_t size, struct image_source* file) {
     uint8_t iv[16];
     uint8_t* encrypted_chunk;
     uint8_t* decrypted_chunk;
@@ -147,6 +171,211 @@ uint8_t* readVolumeEncryptedOffset(uint8_t* key, int64_t volume_offset, int64_t
     return output;
 }
 
+struct partition* read_partition_table(struct image_source* infile, uint8_t* disckey, uint32_t* partition_count) {
+    int i;
+    uint8_t* partition_toc;
+    struct partition* partitions;
+
+    partition_toc = readEncryptedOffset(disckey, WIIU_DECRYPTED_AREA_OFFSET, 0x8000, infile);
+    if (partition_toc == NULL || memcmp(partition_toc, DECRYPTED_AREA_SIGNATURE, 4) != 0) {
+        fprintf(stderr, "Couldn't decrypt partition table\n");
+        free(partition_toc);
+        return NULL;
+    }
+
+    *partition_count = bytesToUIntBE(partition_toc + 0x1C);
+    partitions = (struct partition*)calloc(*partition_count, sizeof(struct partition));
+    if (partitions == NULL) {
+        fprintf(stderr, "Could not allocate enough memory for the partition table\n");
+        free(partition_toc);
+        return NULL;
+    }
+
+    for (i = 0; i < *partition_count; i++) {
+        memcpy(partitions[i].identifier, partition_toc + PARTITION_TOC_OFFSET + (i * PARTITION_TOC_ENTRY_SIZE), 0x19);
+        memcpy(partitions[i].name, partition_toc + PARTITION_TOC_OFFSET + (i * PARTITION_TOC_ENTRY_SIZE), PARTITION_TOC_ENTRY_SIZE);
+        partitions[i].name[PARTITION_TOC_ENTRY_SIZE - 1] = '\0';
+        partitions[i].offset = (uint64_t)bytesToUIntBE(partition_toc + PARTITION_TOC_OFFSET + (i * PARTITION_TOC_ENTRY_SIZE) + 0x20);
+        partitions[i].offset *= 0x8000;
+        partitions[i].offset -= 0x10000;
+    }
+
+    free(partition_toc);
+    return partitions;
+}
+
+// Parses the file table of one partition. Title keys found in SI/GI tickets are added to titlekeys
+// and unlock the GM partitions following them. Returns 0 on success, also if there is no key.
+int read_partition(struct image_source* infile, struct partition* partition, uint8_t* commonkey, uint8_t* disckey, UT_array* titlekeys) {
+    int j, c;
+    uint32_t current_ft_size;
+    uint64_t cluster_start, entries_offset, total_entries, name_table_offset, current_entry_offset, current_name_offset;
+    char partition_hash_name[19];
+    char calculated_name[19];
+    uint8_t* partition_block;
+    uint8_t* decrypted_data;
+    uint8_t* decrypted_data2;
+    uint8_t* titleid;
+    uint8_t raw_entry[16];
+    struct partition_entry* entry;
+    struct titlekey* titlekey;
+    struct titlekey* newtitlekey;
+
+    strncpy(partition_hash_name, partition->name, 18);
+    partition_hash_name[18] = '\0';
+    for (titlekey = (struct titlekey*)utarray_front(titlekeys); titlekey != NULL; titlekey = (struct titlekey*)utarray_next(titlekeys, titlekey)) {
+        if (strncmp(titlekey->name, partition_hash_name, 18) == 0) {
+            break;
+        }
+    }
+    if (strncmp((char*)partition->name, "SI", 2) != 0
+        && strncmp((char*)partition->name, "UP", 2) != 0
+        && strncmp((char*)partition->name, "GI", 2) != 0
+        && titlekey == NULL) {
+        return 0;
+    }
+
+    partition->has_key = 1;
+    if (titlekey == NULL) {
+        memcpy(partition->key, disckey, 16);
+        memset(partition->iv, 0, 16);
+    } else {
+        memcpy(partition->key, titlekey->decryptedKey, 16);
+        memcpy(partition->iv, titlekey->iv, 16);
+    }
+
+    current_ft_size = 0x8000;
+
+    partition_block = readEncryptedOffset(partition->key, WIIU_DECRYPTED_AREA_OFFSET + partition->offset, current_ft_size, infile);
+
+    if (partition_block == NULL || memcmp(partition_block, PARTITION_FILE_TABLE_SIGNATURE, 4) != 0) {
+        fprintf(stderr, "Decrypted partition %s has no valid file table signature\n", partition->name);
+        free(partition_block);
+        return -1;
+    }
+
+    partition->cluster_count = bytesToUIntBE(partition_block + 8);
+    partition->clusters = (struct partition_cluster*)malloc(partition->cluster_count * sizeof(struct partition_cluster));
+    for (c = 0; c < partition->cluster_count; c++) {
+        cluster_start = (uint64_t)(bytesToUIntBE(partition_block + 0x20 + (0x20 * c))) * 0x8000;
+        partition->clusters[c].unknown1 = bytesToUIntBE(partition_block + 0x20 + (0x20 * c) + 0x10);
+        partition->clusters[c].unknown2 = bytesToUIntBE(partition_block + 0x20 + (0x20 * c) + 0x14);
+
+        if (cluster_start > 0) {
+            partition->clusters[c].offset = cluster_start - 0x8000;
+        } else {
+            partition->clusters[c].offset = 0;
+        }
+
+        partition->clusters[c].size = (uint64_t)(bytesToUIntBE(partition_block + 0x20 + (0x20 * c) + 4)) * 0x8000;
+    }
+
+    entries_offset = ((uint64_t)bytesToUIntBE(partition_block + 4) * bytesToUIntBE(partition_block + 8)) + 0x20;
+
+    memcpy(raw_entry, partition_block + entries_offset, 16);
+    entry = create_partition_entry(raw_entry);
+
+    total_entries = entry->last_row_in_dir;
+    name_table_offset = entries_offset + (total_entries * 0x10);
+
+    strncpy(entry->entry_name, (char*)(partition_block + name_table_offset + entry->name_offset), 0x200);
+
+    utarray_new(partition->entries, &partition_entry_icd);
+    utarray_push_back(partition->entries, entry);
+    free(entry);
+
+    for(j = 1; j < total_entries; j++) {
+        current_entry_offset = entries_offset + (j * 0x10);
+
+        while((current_entry_offset + 0x10) > current_ft_size) {
+            current_ft_size += 0x8000;
+            free(partition_block);
+            partition_block = readEncryptedOffset(partition->key, WIIU_DECRYPTED_AREA_OFFSET + partition->offset, current_ft_size, infile);
+        }
+
+        memcpy(raw_entry, partition_block + current_entry_offset, 16);
+        entry = create_partition_entry(raw_entry);
+
+        current_name_offset = name_table_offset + entry->name_offset;
+
+        while((current_name_offset + 0x200) > current_ft_size) {
+            current_ft_size += 0x8000;
+            free(partition_block);
+            partition_block = readEncryptedOffset(partition->key, WIIU_DECRYPTED_AREA_OFFSET + partition->offset, current_ft_size, infile);
+        }
+
+        strncpy(entry->entry_name, (char*)(partition_block + current_name_offset), 0x200);
+
+        utarray_push_back(partition->entries, entry);
+        free(entry);
+    }
+    free(partition_block);
+
+    if (strncmp((char*)partition->name, "SI", 2) == 0
+        || strncmp((char*)partition->name, "GI", 2) == 0) {
+        for (entry = (struct partition_entry*)utarray_front(partition->entries); entry != NULL; entry = (struct partition_entry*)utarray_next(partition->entries, entry)) {
+            if (entry->is_directory != 1 && strincmp(entry->entry_name, TITLE_TICKET_FILE, strlen(TITLE_TICKET_FILE)) == 0) {
+                decrypted_data = readVolumeEncryptedOffset(partition->key, partition->offset, partition->clusters[entry->starting_cluster].offset, entry->offset_in_cluster + 0x1BF, 0x10, infile);
+                titleid = readVolumeEncryptedOffset(partition->key, partition->offset, partition->clusters[entry->starting_cluster].offset, entry->offset_in_cluster + 0x1DC, 8, infile);
+                if (decrypted_data == NULL || titleid == NULL) {
+                    free(decrypted_data);
+                    free(titleid);
+                    continue;
+                }
+
+                // Using raw_entry as iv here because its size is suitable
+                memset(raw_entry, 0, 16);
+                memcpy(raw_entry, titleid, 8);
+                decrypted_data2 = (uint8_t*)malloc(0x10 * sizeof(uint8_t));
+                AES128_CBC_decrypt_buffer(decrypted_data2, decrypted_data, 0x10, commonkey, raw_entry);
+
+                sprintf(calculated_name, "GM%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX", titleid[0], titleid[1], titleid[2], titleid[3], titleid[4], titleid[5], titleid[6], titleid[7]);
+                newtitlekey = (struct titlekey*)malloc(sizeof(struct titlekey));
+                memcpy(newtitlekey->encryptedKey, decrypted_data, 0x10);
+                memcpy(newtitlekey->decryptedKey, decrypted_data2, 0x10);
+                memcpy(newtitlekey->iv, raw_entry, 0x10);
+                strncpy(newtitlekey->name, calculated_name, 0x12);
+                newtitlekey->name[18] = '\0';
+
+                utarray_sort(titlekeys, titlekeycmp);
+                if(utarray_find(titlekeys, newtitlekey, titlekeycmp) == NULL) {
+                    utarray_push_back(titlekeys, newtitlekey);
+                }
+
+                free(newtitlekey);
+                free(decrypted_data);
+                free(decrypted_data2);
+                free(titleid);
+            }
+        }
+    }
+
+    return 0;
+}
+
+struct partition* read_partitions(struct image_source* infile, uint8_t* commonkey, uint8_t* disckey, uint32_t* partition_count) {
+    uint32_t i;
+    struct partition* partitions;
+    UT_array* titlekeys;
+
+    partitions = read_partition_table(infile, disckey, partition_count);
+    if (partitions == NULL) {
+        return NULL;
+    }
+
+    utarray_new(titlekeys, &titlekey_icd);
+    for (i = 0; i < *partition_count; i++) {
+        if (read_partition(infile, &partitions[i], commonkey, disckey, titlekeys) != 0) {
+            free_partitions(partitions, *partition_count);
+            utarray_free(titlekeys);
+            return NULL;
+        }
+    }
+
+    utarray_free(titlekeys);
+    return partitions;
+}
+
 struct partition_entry* create_partition_entry(uint8_t* raw_entry) {
     struct partition_entry* entry = (struct partition_entry*)malloc(sizeof(struct partition_entry));
 
@@ -230,181 +459,603 @@ struct directory* create_directory(struct partition* source_partition, uint32_t*
     return dir;
 }
 
-void extract_all(FILE* infile, struct directory* root_directory, char* outputdir) {
-    if (makedir(outputdir) != 0) {
-        if (errno != EEXIST) {
-            fprintf(stderr, "Error: Output directory does not exist, cannot continue\n");
-            return;
+void init_volume(struct volume* volume, struct partition* source_partition) {
+    uint32_t current_dir_index = 0;
+
+    volume->source = source_partition;
+    volume->volume_base_offset = source_partition->offset;
+    strncpy(volume->identifier, source_partition->name, PARTITION_TOC_ENTRY_SIZE - 1);
+    volume->identifier[PARTITION_TOC_ENTRY_SIZE - 1] = '\0';
+    volume->root_directory = create_directory(source_partition, &current_dir_index, "");
+
+    utarray_new(volume->files, &file_ptr_icd);
+    collect_files(volume->root_directory, volume->files);
+}
+
+void collect_files(struct directory* dir, UT_array* files) {
+    struct directory* subdir;
+    struct file* file;
+
+    for (file = (struct file*)utarray_front(dir->files); file != NULL; file = (struct file*)utarray_next(dir->files, file)) {
+        utarray_push_back(files, &file);
+    }
+    for (subdir = (struct directory*)utarray_front(dir->subdirs); subdir != NULL; subdir = (struct directory*)utarray_next(dir->subdirs, subdir)) {
+        collect_files(subdir, files);
+    }
+}
+
+static void free_directory_contents(struct directory* dir) {
+    struct directory* subdir;
+
+    for (subdir = (struct directory*)utarray_front(dir->subdirs); subdir != NULL; subdir = (struct directory*)utarray_next(dir->subdirs, subdir)) {
+        free_directory_contents(subdir);
+    }
+    utarray_free(dir->subdirs);
+    utarray_free(dir->files);
+}
+
+void free_directory(struct directory* dir) {
+    if (dir != NULL) {
+        free_directory_contents(dir);
+        free(dir);
+    }
+}
+
+void free_volume(struct volume* volume) {
+    free_directory(volume->root_directory);
+    volume->root_directory = NULL;
+    if (volume->files != NULL) {
+        utarray_free(volume->files);
+        volume->files = NULL;
+    }
+}
+
+void free_partitions(struct partition* partitions, uint32_t partition_count) {
+    uint32_t i;
+
+    if (partitions == NULL) {
+        return;
+    }
+    for (i = 0; i < partition_count; i++) {
+        free(partitions[i].clusters);
+        if (partitions[i].entries != NULL) {
+            utarray_free(partitions[i].entries);
         }
     }
+    free(partitions);
+}
 
-    extract_dir(infile, root_directory, outputdir);
+void extract_all(struct image_source* infile, struct output_sink* sink, struct content_store* store, struct volume* volume, char* outputdir, uint64_t range_start, uint64_t range_end) {
+    UT_array* files;
+    struct file** file;
+    uint64_t start = stats_start();
+
+    if (sink->make_directory(sink, outputdir) != 0) {
+        fprintf(stderr, "Error: Output directory does not exist, cannot continue\n");
+        return;
+    }
+    if (make_directories(sink, volume->root_directory, outputdir) != 0) {
+        return;
+    }
+    stats_stop(STATS_METADATA, start, 0, 0);
+    if (store != NULL) {
+        store_begin(store, outputdir);
+    }
+
+    // Files are extracted in the order they are stored on disc, so the image is read front to back
+    image_hint(infile, IMAGE_HINT_SEQUENTIAL, WIIU_DECRYPTED_AREA_OFFSET + volume->volume_base_offset, 0);
+    utarray_new(files, &file_ptr_icd);
+    utarray_concat(files, volume->files);
+    sort_files_by_offset(files);
+    for (file = (struct file**)utarray_front(files); file != NULL; file = (struct file**)utarray_next(files, file)) {
+        if ((uint64_t)file_physical_offset(*file) >= range_start && (uint64_t)file_physical_offset(*file) < range_end) {
+            extract_file(infile, sink, store, *file, outputdir);
+        }
+    }
+    utarray_free(files);
+    if (store != NULL) {
+        start = stats_start();
+        store_flush(store, sink);
+        stats_stop(STATS_METADATA, start, 0, 0);
+    }
 }
 
-void extract_dir(FILE* infile, struct directory* dir, char* outputdir) {
+int make_directories(struct output_sink* sink, struct directory* dir, char* outputdir) {
     char fullout[1024];
     struct directory* subdir;
-    struct file* file;
 
     sprintf(fullout, "%s/%s/%s", outputdir, dir->parent, dir->directory_name);
 
-    if (makedir(fullout) != 0) {
-        if (errno != EEXIST) {
-            fprintf(stderr, "Error: Could not create a directory, cannot continue\n");
-            return;
+    if (sink->make_directory(sink, fullout) != 0) {
+        fprintf(stderr, "Error: Could not create a directory, cannot continue\n");
+        return -1;
+    }
+
+    for (subdir = (struct directory*)utarray_front(dir->subdirs); subdir != NULL; subdir = (struct directory*)utarray_next(dir->subdirs, subdir)) {
+        if (make_directories(sink, subdir, outputdir) != 0) {
+            return -1;
         }
     }
+    return 0;
+}
 
-    for (file = (struct file*)utarray_front(dir->files); file != NULL; file = (struct file*)utarray_next(dir->files, file)) {
-        extract_file(infile, file, outputdir);
+// Writes the stored copy of a file through a sink that can't link it
+static int extract_stored_file(struct output_sink* sink, const char* storepath, const char* outputpath, uint64_t size) {
+    uint8_t* buffer = (uint8_t*)malloc(EXTRACT_BATCH_BLOCKS * 0x10000);
+    FILE* input = fopen(storepath, "rb");
+    uint64_t offset = 0;
+    size_t length;
+    void* outfile = NULL;
+    int result = 0;
+
+    if (buffer == NULL || input == NULL || (outfile = sink->open(sink, outputpath, size)) == NULL) {
+        result = -1;
     }
-    for (subdir = (struct directory*)utarray_front(dir->subdirs); subdir != NULL; subdir = (struct directory*)utarray_next(dir->subdirs, subdir)) {
-        extract_dir(infile, subdir, outputdir);
+    while (result == 0 && offset < size && (length = fread(buffer, 1, EXTRACT_BATCH_BLOCKS * 0x10000, input)) > 0) {
+        result = sink->write_at(sink, outfile, buffer, length, offset);
+        offset += length;
     }
+    if (outfile != NULL) {
+        result |= sink->close(sink, outfile);
+    }
+    if (input != NULL) {
+        fclose(input);
+    }
+    free(buffer);
+    return (result == 0 && offset == size) ? 0 : -1;
 }
 
-void extract_file(FILE* infile, struct file* file, char* outputdir) {
+static void extract_file_contents(struct image_source* infile, struct output_sink* sink, struct content_store* store, struct file* file, char* outputdir) {
     char fullout[1024];
+    char storepath[1024];
     uint8_t first_iv[16];
-    uint8_t* cluster_id;
+    uint8_t key[20];
     struct partition_entry* entry;
+    int64_t done = -1;
+    uint64_t start;
+    int keyed = 0;
+    int found;
+    void* outfile;
 
     sprintf(fullout, "%s/%s/%s", outputdir, file->parent, file->filename);
-    printf("%s\n", fullout);
 
-    memset(first_iv, 0, 16);
+    // Whatever an earlier run finished is kept, a complete file is skipped entirely
+    start = stats_start();
+    if (sink->completed != NULL) {
+        done = sink->completed(sink, fullout, (uint64_t)file->size);
+    }
+    stats_stop(STATS_METADATA, start, 0, 0);
+    if (done == file->size) {
+        // Still part of the index, an earlier run only skipped writing it down
+        if (store != NULL && file->size > 0 && store_key(infile, file, key) == 0) {
+            store_queue(store, key, (uint64_t)file->size, fullout, 1);
+        }
+        progress_skip((uint64_t)file->size, 1);
+        return;
+    }
+    if (done < 0) {
+        done = 0;
+    }
+    progress_skip((uint64_t)done, 0);
+
+    // Keep the listing off stdout when the sink writes its output there, a progress line replaces it
+    if (!progress_active()) {
+        fprintf(sink->uses_stdout ? stderr : stdout, "%s\n", fullout);
+    }
+
+    // Content shared with an earlier disc or revision is copied from there, without decrypting it again
+    if (store != NULL && file->size > 0 && store_key(infile, file, key) == 0) {
+        keyed = 1;
+        found = (done == 0) ? store_lookup(store, key, (uint64_t)file->size, storepath) : 0;
+        if (found) {
+            // Files of an earlier extraction belong to its tree, only the store is shared through hardlinks
+            if ((sink->link != NULL && sink->link(sink, storepath, fullout, found == STORE_FOUND_SHARED) == 0)
+                || extract_stored_file(sink, storepath, fullout, (uint64_t)file->size) == 0) {
+                store->hits++;
+                store->hit_bytes += (uint64_t)file->size;
+                store_queue(store, key, (uint64_t)file->size, fullout, 1);
+                progress_skip((uint64_t)file->size, 1);
+                return;
+            }
+        }
+    }
+
+    start = stats_start();
+    outfile = sink->open(sink, fullout, (uint64_t)file->size);
+    stats_stop(STATS_METADATA, start, 0, 0);
+    if (outfile == NULL) {
+        fprintf(stderr, "Error: Cannot write output file, wasn't able to open it\n");
+        fprintf(stderr, "Error for \"%s\"", fullout);
+        progress_add((uint64_t)(file->size - done), 1);
+        return;
+    }
+    PROBE_FILE_OPEN(fullout, file->size);
+
     entry = (struct partition_entry*)utarray_eltptr(file->parent_partition->entries, file->entry_id);
-    cluster_id = (uint8_t*)(&(entry->starting_cluster));
-    first_iv[0] = cluster_id[1];
-    first_iv[1] = cluster_id[0];
+    file_first_iv(file, first_iv);
 
-    if (entry->unknown == 0x0400
-        || entry->unknown == 0x0040
-        || (file->parent_partition->clusters[entry->starting_cluster].unknown1 == 0x00000400
-            && file->parent_partition->clusters[entry->starting_cluster].unknown2 == 0x02000000)) {
-        extract_file_hashed(infile, fullout, file->parent_partition->name, file->volume_base_offset, file->data_section_offset, file->lba, file->size, file->parent_partition->key, first_iv, entry->starting_cluster);
+    if (file_is_hashed(file)) {
+        extract_file_hashed(infile, sink, outfile, fullout, file->parent_partition->name, file->volume_base_offset, file->data_section_offset, file->lba + done, file->size - done, (uint64_t)done, file->parent_partition->key, first_iv, entry->starting_cluster);
     } else {
-        extract_file_unhashed(infile, fullout, file->parent_partition->name, file->volume_base_offset, file->data_section_offset, file->lba, file->size, file->parent_partition->key, first_iv);
+        extract_file_unhashed(infile, sink, outfile, fullout, file->parent_partition->name, file->volume_base_offset, file->data_section_offset, file->lba + done, file->size - done, (uint64_t)done, file->parent_partition->key, first_iv);
+    }
+    start = stats_start();
+    if (sink->close(sink, outfile) == 0 && keyed) {
+        store_queue(store, key, (uint64_t)file->size, fullout, 0);
     }
+    stats_stop(STATS_METADATA, start, 0, 0);
+    PROBE_FILE_CLOSE(fullout, file->size);
+    progress_add(0, 1);
 }
 
-void extract_file_hashed(FILE* infile, char* outputpath, char* volumename, int64_t volume_offset, int64_t cluster_offset, int64_t file_offset, int64_t size, uint8_t* key, uint8_t* iv, uint16_t cluster_id) {
-    uint8_t* encrypted_cluster;
-    uint8_t* decrypted_header;
-    uint8_t* decrypted_cluster;
-    uint8_t cluster_iv[16];
-    uint8_t h0[0x14];
-    uint8_t block_sha1[0x14];
-    int64_t max_copy_size;
-    int64_t copy_size;
-    int64_t read_offset = 0;
-    int64_t block_size = 0xFC00;
-    int64_t iv_block = 0;
-    struct block blockstruct;
-    FILE* outfile;
+void extract_file(struct image_source* infile, struct output_sink* sink, struct content_store* store, struct file* file, char* outputdir) {
+    uint64_t start = stats_start();
 
-    memset(block_sha1, 0, 0x14);
+    extract_file_contents(infile, sink, store, file, outputdir);
+    if (trace_active()) {
+        trace_span(file->filename, "file", start, monotonic_nanoseconds(), (uint64_t)file->size, 0);
+    }
+}
 
-    outfile = fopen(outputpath, "w");
-    if (outfile == NULL) {
-        fprintf(stderr, "Error: Cannot write output file, wasn't able to open it\n");
-        fprintf(stderr, "Error for \"%s\"", outputpath);
-        return;
+// Where the first byte of file is stored in the image, behind the hash header of its block if hashed
+int64_t file_physical_offset(struct file* file) {
+    int hashed = file_is_hashed(file);
+    int64_t block_size = hashed ? 0xFC00 : 0x8000;
+    int64_t physical_block_size = hashed ? 0x10000 : 0x8000;
+
+    return WIIU_DECRYPTED_AREA_OFFSET + file->volume_base_offset + file->data_section_offset
+        + (file->lba / block_size) * physical_block_size + (hashed ? 0x400 : 0) + (file->lba % block_size);
+}
+
+// Ties (empty files) are broken by the file table, so the order is the same on every run
+static int file_offset_cmp(const void* e1, const void* e2) {
+    struct file* file1 = *(struct file**)e1;
+    struct file* file2 = *(struct file**)e2;
+    int64_t offset1 = file_physical_offset(file1);
+    int64_t offset2 = file_physical_offset(file2);
+
+    if (offset1 != offset2) {
+        return (offset1 > offset2) - (offset1 < offset2);
     }
+    if (file1->volume_base_offset != file2->volume_base_offset) {
+        return (file1->volume_base_offset > file2->volume_base_offset) - (file1->volume_base_offset < file2->volume_base_offset);
+    }
+    return (file1->entry_id > file2->entry_id) - (file1->entry_id < file2->entry_id);
+}
 
-    decrypted_header = (uint8_t*)malloc(0x400 * sizeof(uint8_t));
-    decrypted_cluster = (uint8_t*)malloc(block_size * sizeof(uint8_t));
-    while (size > 0) {
-        blockstruct.number = file_offset / block_size;
-        blockstruct.offset = file_offset % block_size;
+void sort_files_by_offset(UT_array* files) {
+    utarray_sort(files, file_offset_cmp);
+}
 
-        if(blockstruct.offset != (file_offset - (file_offset / block_size * block_size))) {
-            blockstruct.offset = file_offset - (file_offset / block_size * block_size);
-        }
+struct cluster_position {
+    uint64_t offset;
+    uint16_t cluster;
+};
 
-        iv_block = blockstruct.number & 0xF;
+static int cluster_position_cmp(const void* e1, const void* e2) {
+    uint64_t offset1 = ((const struct cluster_position*)e1)->offset;
+    uint64_t offset2 = ((const struct cluster_position*)e2)->offset;
 
-        read_offset = WIIU_DECRYPTED_AREA_OFFSET + volume_offset + cluster_offset + (blockstruct.number * 0x10000);
+    return (offset1 > offset2) - (offset1 < offset2);
+}
 
-        encrypted_cluster = readFileOffset(read_offset, sizeof(uint8_t), 0x400, infile);
-        AES128_CBC_decrypt_buffer(decrypted_header, encrypted_cluster, 0x400, key, iv);
-        free(encrypted_cluster);
+uint16_t* sort_clusters_by_offset(struct partition* partition) {
+    struct cluster_position* positions = (struct cluster_position*)malloc((partition->cluster_count ? partition->cluster_count : 1) * sizeof(struct cluster_position));
+    uint16_t* order = (uint16_t*)malloc((partition->cluster_count ? partition->cluster_count : 1) * sizeof(uint16_t));
+    uint32_t c;
 
-        memcpy(cluster_iv, decrypted_header + (iv_block * 0x14), 16);
-        memcpy(h0, decrypted_header + (iv_block * 0x14), 0x14);
+    if (positions == NULL || order == NULL) {
+        free(positions);
+        free(order);
+        return NULL;
+    }
+    for (c = 0; c < partition->cluster_count; c++) {
+        positions[c].offset = partition->clusters[c].offset;
+        positions[c].cluster = (uint16_t)c;
+    }
+    qsort(positions, partition->cluster_count, sizeof(struct cluster_position), cluster_position_cmp);
+    for (c = 0; c < partition->cluster_count; c++) {
+        order[c] = positions[c].cluster;
+    }
+    free(positions);
+    return order;
+}
 
-        if (iv_block == 0) {
-            cluster_iv[1] ^= (uint8_t)cluster_id;
-        }
+int file_is_hashed(struct file* file) {
+    struct partition_entry* entry = (struct partition_entry*)utarray_eltptr(file->parent_partition->entries, file->entry_id);
 
-        encrypted_cluster = readFileOffset(read_offset + 0x400, sizeof(uint8_t), block_size, infile);
-        AES128_CBC_decrypt_buffer(decrypted_cluster, encrypted_cluster, block_size, key, cluster_iv);
-        free(encrypted_cluster);
+    return entry->unknown == 0x0400
+        || entry->unknown == 0x0040
+        || (file->parent_partition->clusters[entry->starting_cluster].unknown1 == 0x00000400
+            && file->parent_partition->clusters[entry->starting_cluster].unknown2 == 0x02000000);
+}
+
+int cluster_is_hashed(struct partition* partition, uint16_t cluster) {
+    struct partition_entry* entry;
 
-        mbedtls_sha1(decrypted_cluster, block_size, block_sha1);
-        if (iv_block == 0) {
-            block_sha1[1] ^= (uint8_t)cluster_id;
+    if (partition->clusters[cluster].unknown1 == 0x00000400 && partition->clusters[cluster].unknown2 == 0x02000000) {
+        return 1;
+    }
+    // Otherwise the flags of the files stored in it tell
+    for (entry = (struct partition_entry*)utarray_front(partition->entries); entry != NULL; entry = (struct partition_entry*)utarray_next(partition->entries, entry)) {
+        if (!entry->is_directory && entry->starting_cluster == cluster && (entry->unknown == 0x0400 || entry->unknown == 0x0040)) {
+            return 1;
         }
+    }
+    return 0;
+}
+
+void file_first_iv(struct file* file, uint8_t* iv) {
+    struct partition_entry* entry = (struct partition_entry*)utarray_eltptr(file->parent_partition->entries, file->entry_id);
+
+    // The IV of a cluster starts with its big endian cluster index
+    memset(iv, 0, 16);
+    iv[0] = (uint8_t)(entry->starting_cluster >> 8);
+    iv[1] = (uint8_t)(entry->starting_cluster & 0xFF);
+}
+
+int decrypt_hashed_block(struct AES128_ctx* ctx, uint8_t* encrypted_block, uint8_t* iv, uint16_t cluster_id, int64_t block_number, uint8_t* decrypted_header, uint8_t* decrypted_data) {
+    uint8_t cluster_iv[16];
+    uint8_t h0[0x14];
+    uint8_t block_sha1[0x14];
+    int64_t iv_block = block_number & 0xF;
+    uint64_t start = stats_start();
+
+    AES128_CBC_decrypt_buffer_ctx(ctx, decrypted_header, encrypted_block, 0x400, iv);
+
+    memcpy(cluster_iv, decrypted_header + (iv_block * 0x14), 16);
+    memcpy(h0, decrypted_header + (iv_block * 0x14), 0x14);
+
+    if (iv_block == 0) {
+        cluster_iv[1] ^= (uint8_t)cluster_id;
+    }
+
+    AES128_CBC_decrypt_buffer_ctx(ctx, decrypted_data, encrypted_block + 0x400, 0xFC00, cluster_iv);
+    stats_stop(STATS_DECRYPT, start, 0x10000, 1);
+    PROBE_BLOCK_DECRYPT(cluster_id, block_number, 0x10000);
+
+    start = stats_start();
+    mbedtls_sha1(decrypted_data, 0xFC00, block_sha1);
+    stats_stop(STATS_HASH, start, 0xFC00, 1);
+    if (iv_block == 0) {
+        block_sha1[1] ^= (uint8_t)cluster_id;
+    }
 
-        if (memcmp(block_sha1, h0, 0x14) != 0) {
-            fprintf(stderr, "Warning: Failed SHA1 checksum verification for %s\n", outputpath);
+    if (memcmp(block_sha1, h0, 0x14) != 0) {
+        PROBE_HASH_MISMATCH(cluster_id, block_number, 0);
+        return 1;
+    }
+    return 0;
+}
+
+int64_t read_file_data(struct image_source* infile, struct file* file, struct block_cache* cache, uint64_t offset, uint8_t* buffer, size_t size) {
+    uint8_t first_iv[16];
+    uint8_t decrypted_header[0x400];
+    uint8_t encrypted[CACHE_BLOCK_SIZE];
+    uint8_t decrypted[CACHE_BLOCK_SIZE];
+    uint8_t* target;
+    uint32_t decrypted_size, count, k;
+    uint64_t position, block_offset, copy_size, read_offset, cluster_base, cluster_blocks;
+    int64_t block_number;
+    int64_t done = 0;
+    uint64_t start;
+    int hit;
+    int hashed = file_is_hashed(file);
+    uint64_t block_size = hashed ? 0xFC00 : 0x8000;
+    uint64_t physical_block_size = hashed ? 0x10000 : 0x8000;
+    struct partition_entry* entry = (struct partition_entry*)utarray_eltptr(file->parent_partition->entries, file->entry_id);
+    struct AES128_ctx ctx;
+
+    if (offset >= (uint64_t)file->size) {
+        return 0;
+    }
+    if (size > (uint64_t)file->size - offset) {
+        size = (size_t)((uint64_t)file->size - offset);
+    }
+
+    // Everything lives on the stack, so concurrent reads never allocate or share scratch memory
+    AES128_init_ctx(&ctx, file->parent_partition->key);
+    file_first_iv(file, first_iv);
+    cluster_base = WIIU_DECRYPTED_AREA_OFFSET + file->volume_base_offset + file->data_section_offset;
+    cluster_blocks = file->parent_partition->clusters[entry->starting_cluster].size / physical_block_size;
+
+    while (size > 0) {
+        position = file->lba + offset;
+        block_number = position / block_size;
+        block_offset = position % block_size;
+        read_offset = cluster_base + (block_number * physical_block_size);
+
+        hit = (cache != NULL && block_cache_get(cache, read_offset, decrypted, &decrypted_size));
+        if (cache != NULL) {
+            stats_cache(hit);
+        }
+        if (!hit) {
+            // Decrypt a whole readahead window when the access pattern is sequential
+            count = (cache != NULL) ? block_cache_readahead(cache, read_offset, physical_block_size) : 1;
+            if (count > 1 && block_number + count > cluster_blocks) {
+                count = (block_number < cluster_blocks) ? (uint32_t)(cluster_blocks - block_number) : 1;
+            }
+
+            for (k = 0; k < count; k++) {
+                if (readFileOffsetBuffer(read_offset + (k * physical_block_size), encrypted, physical_block_size, infile) != physical_block_size) {
+                    if (k > 0) {
+                        break;
+                    }
+                    fprintf(stderr, "Could not read encrypted chunk from file\n");
+                    return -1;
+                }
+
+                // Blocks read ahead are decrypted in place and only end up in the cache
+                target = (k == 0) ? decrypted : encrypted + (hashed ? 0x400 : 0);
+                if (hashed) {
+                    if (decrypt_hashed_block(&ctx, encrypted, first_iv, entry->starting_cluster, block_number + k, decrypted_header, target) != 0) {
+                        fprintf(stderr, "Warning: Failed SHA1 checksum verification for %s/%s\n", file->parent, file->filename);
+                    }
+                } else {
+                    start = stats_start();
+                    AES128_CBC_decrypt_buffer_ctx(&ctx, target, encrypted, 0x8000, first_iv);
+                    stats_stop(STATS_DECRYPT, start, 0x8000, 1);
+                    PROBE_BLOCK_DECRYPT(entry->starting_cluster, block_number + k, 0x8000);
+                }
+                if (cache != NULL) {
+                    block_cache_put(cache, read_offset + (k * physical_block_size), target, (uint32_t)block_size);
+                }
+            }
         }
 
-        max_copy_size = block_size - blockstruct.offset;
-        copy_size = (size > max_copy_size) ? max_copy_size : size;
-        if (fwrite(decrypted_cluster + blockstruct.offset, sizeof(uint8_t), copy_size, outfile) != copy_size) {
-            fprintf(stderr, "Warning: Couldn't write expected output for %s\n", outputpath);
+        copy_size = block_size - block_offset;
+        if (copy_size > size) {
+            copy_size = size;
         }
+        memcpy(buffer + done, decrypted + block_offset, copy_size);
 
         size -= copy_size;
-        file_offset += copy_size;
+        offset += copy_size;
+        done += copy_size;
     }
-    free(decrypted_header);
-    free(decrypted_cluster);
 
-    fclose(outfile);
+    return done;
 }
 
-void extract_file_unhashed(FILE* infile, char* outputpath, char* volumename, int64_t volume_offset, int64_t cluster_offset, int64_t file_offset, int64_t size, uint8_t* key, uint8_t* iv) {
-    uint8_t* encrypted_cluster;
-    uint8_t* decrypted_cluster;
-    int64_t max_copy_size;
+void extract_file_hashed(struct image_source* infile, struct output_sink* sink, void* outfile, char* outputpath, char* volumename, int64_t volume_offset, int64_t cluster_offset, int64_t file_offset, int64_t size, uint64_t write_offset, uint8_t* key, uint8_t* iv, uint16_t cluster_id) {
+    uint8_t* blocks;
+    uint8_t decrypted_header[0x400];
     int64_t copy_size;
     int64_t read_offset = 0;
-    struct block blockstruct;
-    FILE* outfile;
-
-    outfile = fopen(outputpath, "w");
-    if (outfile == NULL) {
-        fprintf(stderr, "Error: Cannot write output file, wasn't able to open it\n");
-        fprintf(stderr, "Error for \"%s\"", outputpath);
+    int64_t block_size = 0xFC00;
+    int64_t block_number, block_offset;
+    uint64_t start;
+    uint32_t count, blocks_read, k;
+    struct image_iovec vectors[EXTRACT_BATCH_BLOCKS];
+    struct AES128_ctx ctx;
+
+    AES128_init_ctx(&ctx, key);
+    blocks = (uint8_t*)malloc(EXTRACT_BATCH_BLOCKS * 0x10000);
+    if (blocks == NULL) {
+        fprintf(stderr, "Could not allocate enough memory to decrypt %s\n", outputpath);
         return;
     }
+    for (k = 0; k < EXTRACT_BATCH_BLOCKS; k++) {
+        vectors[k].buffer = blocks + (k * 0x10000);
+        vectors[k].size = 0x10000;
+    }
 
-    decrypted_cluster = (uint8_t*)malloc(0x8000 * sizeof(uint8_t));
     while (size > 0) {
-        blockstruct.number = file_offset / 0x8000;
-        blockstruct.offset = file_offset % 0x8000;
+        block_number = file_offset / block_size;
+        block_offset = file_offset % block_size;
+        count = (uint32_t)((block_offset + size + block_size - 1) / block_size);
+        if (count > EXTRACT_BATCH_BLOCKS) {
+            count = EXTRACT_BATCH_BLOCKS;
+        }
 
-        read_offset = WIIU_DECRYPTED_AREA_OFFSET + volume_offset + cluster_offset + (blockstruct.number * 0x8000);
+        read_offset = WIIU_DECRYPTED_AREA_OFFSET + volume_offset + cluster_offset + (block_number * 0x10000);
+        // Files are extracted in disc order, so a streamed image never needs anything before this block again
+        image_release(infile, read_offset);
+        if (block_offset + size > count * block_size) {
+            image_hint(infile, IMAGE_HINT_WILLNEED, read_offset + (count * 0x10000), EXTRACT_BATCH_BLOCKS * 0x10000);
+        }
 
-        encrypted_cluster = readFileOffset(read_offset, sizeof(uint8_t), 0x8000, infile);
-        AES128_CBC_decrypt_buffer(decrypted_cluster, encrypted_cluster, 0x8000, key, iv);
-        free(encrypted_cluster);
+        start = stats_start();
+        blocks_read = (uint32_t)(image_read_vectored(infile, read_offset, vectors, (int)count) / 0x10000);
+        stats_stop(STATS_READ, start, blocks_read * 0x10000, blocks_read);
+        for (k = 0; k < blocks_read && size > 0; k++) {
+            // The data part of a block is decrypted in place behind its hash header
+            if (decrypt_hashed_block(&ctx, blocks + (k * 0x10000), iv, cluster_id, block_number + k, decrypted_header, blocks + (k * 0x10000) + 0x400) != 0) {
+                fprintf(stderr, "Warning: Failed SHA1 checksum verification for %s\n", outputpath);
+            }
+
+            copy_size = block_size - block_offset;
+            if (copy_size > size) {
+                copy_size = size;
+            }
+            start = stats_start();
+            if (sink->write_at(sink, outfile, blocks + (k * 0x10000) + 0x400 + block_offset, (size_t)copy_size, write_offset) != 0) {
+                fprintf(stderr, "Warning: Couldn't write expected output for %s\n", outputpath);
+            }
+            stats_stop(sink->writes_behind ? STATS_QUEUE : STATS_WRITE, start, copy_size, 0);
+            progress_add((uint64_t)copy_size, 0);
+            write_offset += copy_size;
+
+            size -= copy_size;
+            file_offset += copy_size;
+            block_offset = 0;
+        }
+        if (blocks_read < count) {
+            fprintf(stderr, "Warning: Couldn't read expected input for %s\n", outputpath);
+            break;
+        }
+    }
+    free(blocks);
+}
 
-        max_copy_size = 0x8000 - blockstruct.offset;
-        copy_size = (size > max_copy_size) ? max_copy_size : size;
-        if (fwrite(decrypted_cluster + blockstruct.offset, sizeof(uint8_t), copy_size, outfile) != copy_size) {
-            fprintf(stderr, "Warning: Couldn't write expected output for\n%s\n", outputpath);
+void extract_file_unhashed(struct image_source* infile, struct output_sink* sink, void* outfile, char* outputpath, char* volumename, int64_t volume_offset, int64_t cluster_offset, int64_t file_offset, int64_t size, uint64_t write_offset, uint8_t* key, uint8_t* iv) {
+    uint8_t* blocks;
+    int64_t copy_size;
+    int64_t read_offset = 0;
+    int64_t block_number, block_offset;
+    uint64_t start;
+    uint32_t count, blocks_read, k;
+    struct image_iovec vectors[EXTRACT_BATCH_BLOCKS];
+    struct AES128_ctx ctx;
+
+    AES128_init_ctx(&ctx, key);
+    blocks = (uint8_t*)malloc(EXTRACT_BATCH_BLOCKS * 0x8000);
+    if (blocks == NULL) {
+        fprintf(stderr, "Could not allocate enough memory to decrypt %s\n", outputpath);
+        return;
+    }
+    for (k = 0; k < EXTRACT_BATCH_BLOCKS; k++) {
+        vectors[k].buffer = blocks + (k * 0x8000);
+        vectors[k].size = 0x8000;
+    }
+
+    while (size > 0) {
+        block_number = file_offset / 0x8000;
+        block_offset = file_offset % 0x8000;
+        count = (uint32_t)((block_offset + size + 0x8000 - 1) / 0x8000);
+        if (count > EXTRACT_BATCH_BLOCKS) {
+            count = EXTRACT_BATCH_BLOCKS;
         }
 
+        read_offset = WIIU_DECRYPTED_AREA_OFFSET + volume_offset + cluster_offset + (block_number * 0x8000);
+        image_release(infile, read_offset);
+        if (block_offset + size > count * 0x8000) {
+            image_hint(infile, IMAGE_HINT_WILLNEED, read_offset + (count * 0x8000), EXTRACT_BATCH_BLOCKS * 0x8000);
+        }
 
-        size -= copy_size;
-        file_offset += copy_size;
+        start = stats_start();
+        blocks_read = (uint32_t)(image_read_vectored(infile, read_offset, vectors, (int)count) / 0x8000);
+        stats_stop(STATS_READ, start, blocks_read * 0x8000, blocks_read);
+        for (k = 0; k < blocks_read && size > 0; k++) {
+            // Every block starts over with the first IV
+            start = stats_start();
+            AES128_CBC_decrypt_buffer_ctx(&ctx, blocks + (k * 0x8000), blocks + (k * 0x8000), 0x8000, iv);
+            stats_stop(STATS_DECRYPT, start, 0x8000, 1);
+            // The IV of a cluster starts with its index
+            PROBE_BLOCK_DECRYPT((iv[0] << 8) | iv[1], block_number + k, 0x8000);
+
+            copy_size = 0x8000 - block_offset;
+            if (copy_size > size) {
+                copy_size = size;
+            }
+            start = stats_start();
+            if (sink->write_at(sink, outfile, blocks + (k * 0x8000) + block_offset, (size_t)copy_size, write_offset) != 0) {
+                fprintf(stderr, "Warning: Couldn't write expected output for\n%s\n", outputpath);
+            }
+            stats_stop(sink->writes_behind ? STATS_QUEUE : STATS_WRITE, start, copy_size, 0);
+            progress_add((uint64_t)copy_size, 0);
+            write_offset += copy_size;
+
+            size -= copy_size;
+            file_offset += copy_size;
+            block_offset = 0;
+        }
+        if (blocks_read < count) {
+            fprintf(stderr, "Warning: Couldn't read expected input for %s\n", outputpath);
+            break;
+        }
     }
-    free(decrypted_cluster);
-
-    fclose(outfile);
+    free(blocks);
 }
 
 int strincmp(const char *s1, const char *s2, int n)
@@ -434,3 +1085,64 @@ uint16_t bytesToUShortBE(uint8_t* bytes) {
 uint32_t bytesToUIntBE(uint8_t* bytes) {
     return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
 }
+
+// Escapes quotes, backslashes and control characters, everything else is written as it is
+void fprint_json_string(FILE* output, const char* string) {
+    fputc('"', output);
+    for (; *string != '\0'; string++) {
+        if (*string == '"' || *string == '\\') {
+            fprintf(output, "\\%c", *string);
+        } else if ((unsigned char)*string < 0x20) {
+            fprintf(output, "\\u%04x", (unsigned int)(unsigned char)*string);
+        } else {
+            fputc(*string, output);
+        }
+    }
+    fputc('"', output);
+}
+
+uint64_t monotonic_nanoseconds(void) {
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000ULL + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000ULL / (uint64_t)frequency.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// Checks 64 bytes per step with vector ORs, the tail falls back to bytes
+int buffer_is_zero(const uint8_t* data, size_t size) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128i acc;
+
+    for (; i + 64 <= size; i += 64) {
+        acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i*)(data + i)), _mm_loadu_si128((const __m128i*)(data + i + 16))),
+                           _mm_or_si128(_mm_loadu_si128((const __m128i*)(data + i + 32)), _mm_loadu_si128((const __m128i*)(data + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF) {
+            return 0;
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    uint8x16_t acc;
+
+    for (; i + 64 <= size; i += 64) {
+        acc = vorrq_u8(vorrq_u8(vld1q_u8(data + i), vld1q_u8(data + i + 16)), vorrq_u8(vld1q_u8(data + i + 32), vld1q_u8(data + i + 48)));
+        if (vmaxvq_u8(acc) != 0) {
+            return 0;
+        }
+    }
+#endif
+    for (; i < size; i++) {
+        if (data[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
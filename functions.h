@@ -2,30 +2,64 @@
 #define _FUNCTIONS_H_
 #include <stdio.h>
 #include "struct.h"
+#include "cache.h"
+#include "aes.h"
+#include "sink.h"
+#include "image.h"
+
+struct content_store;
 
 uint8_t* loadKeyFile(FILE* file);
 uint8_t* loadKey(char* filename);
 
-void* readFileOffset(uint64_t offset, size_t size, size_t count, FILE* file);
+size_t readFileOffsetBuffer(uint64_t offset, void* buffer, size_t size, struct image_source* file);
+void* readFileOffset(uint64_t offset, size_t size, size_t count, struct image_source* file);
 void* readFile(size_t size, size_t count, FILE* file);
 
-uint8_t* readEncryptedOffset(uint8_t* key, uint64_t offset, size_t size, FILE* file);
-uint8_t* readVolumeEncryptedOffset(uint8_t* key, int64_t volume_offset, int64_t cluster_offset, int64_t file_offset, size_t size, FILE* file);
+uint8_t* readEncryptedOffset(uint8_t* key, uint64_t offset, size_t size, struct image_source* file);
+uint8_t* readVolumeEncryptedOffset(uint8_t* key, int64_t volume_offset, int64_t cluster_offset, int64_t file_offset, size_t size, struct image_source* file);
+
+struct partition* read_partition_table(struct image_source* infile, uint8_t* disckey, uint32_t* partition_count);
+int read_partition(struct image_source* infile, struct partition* partition, uint8_t* commonkey, uint8_t* disckey, UT_array* titlekeys);
+struct partition* read_partitions(struct image_source* infile, uint8_t* commonkey, uint8_t* disckey, uint32_t* partition_count);
 
 struct partition_entry* create_partition_entry(uint8_t* raw_entry);
 struct file* create_file(char* parent, char* filename, int64_t volume_base_offset, int64_t data_section_offset, int64_t lba, int64_t size, struct partition* source_partition, uint32_t entry_id);
 struct directory* create_directory(struct partition* source_partition, uint32_t* current_index, char* parent);
+void init_volume(struct volume* volume, struct partition* source_partition);
+void collect_files(struct directory* dir, UT_array* files);
+void free_directory(struct directory* dir);
+void free_volume(struct volume* volume);
+void free_partitions(struct partition* partitions, uint32_t partition_count);
+
+// store may be NULL, otherwise files found there are copied from it and the rest is added to it.
+// Only files stored from range_start up to range_end (image offsets) are extracted, all directories are made.
+void extract_all(struct image_source* infile, struct output_sink* sink, struct content_store* store, struct volume* volume, char* outputdir, uint64_t range_start, uint64_t range_end);
+int make_directories(struct output_sink* sink, struct directory* dir, char* outputdir);
+void extract_file(struct image_source* infile, struct output_sink* sink, struct content_store* store, struct file* file, char* outputdir);
 
-void extract_all(FILE* infile, struct directory* root_directory, char* outputdir);
-void extract_dir(FILE* infile, struct directory* dir, char* outputdir);
-void extract_file(FILE* infile, struct file* file, char* outputdir);
+int file_is_hashed(struct file* file);
+int cluster_is_hashed(struct partition* partition, uint16_t cluster);
+int64_t file_physical_offset(struct file* file);
+void sort_files_by_offset(UT_array* files);
+// Indexes of the clusters of partition in the order they are stored, free() the result
+uint16_t* sort_clusters_by_offset(struct partition* partition);
+void file_first_iv(struct file* file, uint8_t* iv);
+int decrypt_hashed_block(struct AES128_ctx* ctx, uint8_t* encrypted_block, uint8_t* iv, uint16_t cluster_id, int64_t block_number, uint8_t* decrypted_header, uint8_t* decrypted_data);
+int64_t read_file_data(struct image_source* infile, struct file* file, struct block_cache* cache, uint64_t offset, uint8_t* buffer, size_t size);
 
-void extract_file_hashed(FILE* infile, char* outputpath, char* volumename, int64_t volume_offset, int64_t cluster_offset, int64_t file_offset, int64_t size, uint8_t* key, uint8_t* iv, uint16_t cluster_id);
-void extract_file_unhashed(FILE* infile, char* outputpath, char* volumename, int64_t volume_offset, int64_t cluster_offset, int64_t file_offset, int64_t size, uint8_t* key, uint8_t* iv);
+// Decrypt size bytes from file_offset on into the opened outfile, starting at write_offset
+void extract_file_hashed(struct image_source* infile, struct output_sink* sink, void* outfile, char* outputpath, char* volumename, int64_t volume_offset, int64_t cluster_offset, int64_t file_offset, int64_t size, uint64_t write_offset, uint8_t* key, uint8_t* iv, uint16_t cluster_id);
+void extract_file_unhashed(struct image_source* infile, struct output_sink* sink, void* outfile, char* outputpath, char* volumename, int64_t volume_offset, int64_t cluster_offset, int64_t file_offset, int64_t size, uint64_t write_offset, uint8_t* key, uint8_t* iv);
 
 int strincmp(const char* s1, const char* s2, int n);
 int titlekeycmp(const void* e1, const void* e2);
 
 uint16_t bytesToUShortBE(uint8_t* bytes);
 uint32_t bytesToUIntBE(uint8_t* bytes);
+int buffer_is_zero(const uint8_t* data, size_t size);
+// A clock that never jumps, only differences between two calls mean anything
+uint64_t monotonic_nanoseconds(void);
+// Writes string as a quoted JSON string
+void fprint_json_string(FILE* output, const char* string);
 #endif // _FUNCTIONS_H_
@@ -0,0 +1,525 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "aes.h"
+#include "sha1.h"
+#include "gen.h"
+
+#define GEN_DIR_COUNT 5
+#define GEN_HASHED_BLOCK 0xFC00
+#define GEN_UNHASHED_BLOCK 0x8000
+
+struct gen_dir {
+    const char* name;
+    int parent;
+};
+
+struct gen_file {
+    char name[32];
+    int dir;
+    uint64_t size;
+    uint64_t offset;
+    uint16_t cluster;
+    uint64_t seed;
+    const uint8_t* data;
+};
+
+struct gen_partition {
+    char name[PTOC_SIZE];
+    uint8_t key[16];
+    uint64_t fst_offset;
+    uint64_t fst_size;
+
+    uint32_t cluster_count;
+    uint64_t cluster_offset[3];
+    uint64_t cluster_size[3];
+    uint8_t cluster_hashed[3];
+
+    const struct gen_dir* dirs;
+    int dir_count;
+    uint32_t file_count;
+    struct gen_file* files;
+};
+
+// Directory layout of the generated partitions, index 0 is the root
+static const struct gen_dir si_dirs[] = { { "", -1 }, { "01", 0 } };
+static const struct gen_dir gm_dirs[GEN_DIR_COUNT] = { { "", -1 }, { "code", 0 }, { "content", 0 }, { "audio", 2 }, { "meta", 0 } };
+
+static uint64_t splitmix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static void put_u32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void put_u16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+// Deterministic file content, every third 128 KiB stretch of larger files is zero
+static void file_content(const struct gen_file* file, uint64_t pos, uint8_t* out, uint64_t size) {
+    uint64_t i, word = 0;
+    if (file->data != NULL) {
+        memcpy(out, file->data + pos, size);
+        return;
+    }
+    for (i = 0; i < size; i++, pos++) {
+        if (file->size > 0x40000 && ((pos >> 17) % 3) == 1) {
+            out[i] = 0;
+            continue;
+        }
+        if (i == 0 || (pos & 7) == 0) {
+            word = splitmix64(file->seed ^ (pos >> 3));
+        }
+        out[i] = (uint8_t)(word >> ((pos & 7) * 8));
+    }
+}
+
+// Builds the plaintext of one cluster data block from all files overlapping it
+static void cluster_block(const struct gen_partition* part, uint16_t cluster, uint64_t block_start, uint8_t* out, uint64_t block_size) {
+    uint32_t i;
+    uint64_t start, end;
+    memset(out, 0, block_size);
+    for (i = 0; i < part->file_count; i++) {
+        const struct gen_file* file = &part->files[i];
+        if (file->cluster != cluster || file->offset + file->size <= block_start || file->offset >= block_start + block_size) {
+            continue;
+        }
+        start = (file->offset > block_start) ? file->offset : block_start;
+        end = (file->offset + file->size < block_start + block_size) ? file->offset + file->size : block_start + block_size;
+        file_content(file, start - file->offset, out + (start - block_start), end - start);
+    }
+}
+
+static int write_at(FILE* out, uint64_t offset, const uint8_t* buf, size_t size) {
+#ifndef _WIN32
+    if (fseeko(out, (off_t)offset, SEEK_SET) != 0 || fwrite(buf, 1, size, out) != size) {
+#else
+    if (_fseeki64(out, (__int64)offset, SEEK_SET) != 0 || fwrite(buf, 1, size, out) != size) {
+#endif
+        fprintf(stderr, "Error: Could not write to image at 0x%llX\n", (unsigned long long int)offset);
+        return -1;
+    }
+    return 0;
+}
+
+static void first_iv(uint16_t cluster, uint8_t* iv) {
+    memset(iv, 0, 16);
+    iv[0] = (uint8_t)(cluster >> 8);
+    iv[1] = (uint8_t)cluster;
+}
+
+static int write_unhashed_cluster(FILE* out, const struct gen_partition* part, uint16_t cluster) {
+    uint8_t iv[16];
+    uint8_t* plain = (uint8_t*)malloc(GEN_UNHASHED_BLOCK);
+    uint8_t* enc = (uint8_t*)malloc(GEN_UNHASHED_BLOCK);
+    uint64_t block;
+
+    first_iv(cluster, iv);
+    for (block = 0; block * GEN_UNHASHED_BLOCK < part->cluster_size[cluster]; block++) {
+        cluster_block(part, cluster, block * GEN_UNHASHED_BLOCK, plain, GEN_UNHASHED_BLOCK);
+        AES128_CBC_encrypt_buffer(enc, plain, GEN_UNHASHED_BLOCK, part->key, iv);
+        if (write_at(out, part->fst_offset + part->cluster_offset[cluster] + block * GEN_UNHASHED_BLOCK, enc, GEN_UNHASHED_BLOCK) != 0) {
+            free(plain);
+            free(enc);
+            return -1;
+        }
+    }
+    free(plain);
+    free(enc);
+    return 0;
+}
+
+// Two passes: collect H0 of every block, then derive H1/H2 tables and write headers plus data
+static int write_hashed_cluster(FILE* out, const struct gen_partition* part, uint16_t cluster) {
+    uint64_t block_count = part->cluster_size[cluster] / 0x10000;
+    uint8_t* h0 = (uint8_t*)calloc(((block_count + 4095) / 4096) * 4096, 0x14);
+    uint8_t* h1 = (uint8_t*)calloc(((block_count + 4095) / 4096) * 256, 0x14);
+    uint8_t* h2 = (uint8_t*)calloc(((block_count + 4095) / 4096) * 16, 0x14);
+    uint8_t* plain = (uint8_t*)malloc(GEN_HASHED_BLOCK);
+    uint8_t* enc = (uint8_t*)malloc(0x10000);
+    uint8_t header[0x400];
+    uint8_t iv[16];
+    uint8_t sha[0x14];
+    uint64_t block, group;
+    int result = 0;
+
+    for (block = 0; block < block_count; block++) {
+        cluster_block(part, cluster, block * GEN_HASHED_BLOCK, plain, GEN_HASHED_BLOCK);
+        mbedtls_sha1(plain, GEN_HASHED_BLOCK, sha);
+        if ((block & 0xF) == 0) {
+            sha[1] ^= (uint8_t)cluster;
+        }
+        memcpy(h0 + block * 0x14, sha, 0x14);
+    }
+    for (group = 0; group < (block_count + 15) / 16; group++) {
+        mbedtls_sha1(h0 + group * 16 * 0x14, 0x140, h1 + group * 0x14);
+    }
+    for (group = 0; group < (block_count + 255) / 256; group++) {
+        mbedtls_sha1(h1 + group * 16 * 0x14, 0x140, h2 + group * 0x14);
+    }
+
+    for (block = 0; block < block_count && result == 0; block++) {
+        memset(header, 0, 0x400);
+        memcpy(header, h0 + (block / 16) * 16 * 0x14, 0x140);
+        memcpy(header + 0x140, h1 + (block / 256) * 16 * 0x14, 0x140);
+        memcpy(header + 0x280, h2 + (block / 4096) * 16 * 0x14, 0x140);
+        first_iv(cluster, iv);
+        AES128_CBC_encrypt_buffer(enc, header, 0x400, part->key, iv);
+
+        cluster_block(part, cluster, block * GEN_HASHED_BLOCK, plain, GEN_HASHED_BLOCK);
+        memcpy(iv, h0 + block * 0x14, 16);
+        if ((block & 0xF) == 0) {
+            iv[1] ^= (uint8_t)cluster;
+        }
+        AES128_CBC_encrypt_buffer(enc + 0x400, plain, GEN_HASHED_BLOCK, part->key, iv);
+        result = write_at(out, part->fst_offset + part->cluster_offset[cluster] + block * 0x10000, enc, 0x10000);
+    }
+
+    free(h0);
+    free(h1);
+    free(h2);
+    free(plain);
+    free(enc);
+    return result;
+}
+
+static uint32_t fst_emit_dir(const struct gen_partition* part, int dir, uint8_t* entries, uint32_t* index, uint8_t* names, uint32_t* name_size, int parent_index) {
+    uint32_t own = (*index)++;
+    uint32_t i;
+    int d;
+
+    entries[own * 0x10] = 1;
+    put_u32(entries + own * 0x10, ((uint32_t)1 << 24) | *name_size);
+    put_u32(entries + own * 0x10 + 4, (uint32_t)(parent_index < 0 ? 0 : parent_index));
+    strcpy((char*)names + *name_size, part->dirs[dir].name);
+    *name_size += (uint32_t)strlen(part->dirs[dir].name) + 1;
+
+    for (i = 0; i < part->file_count; i++) {
+        const struct gen_file* file = &part->files[i];
+        uint8_t* entry;
+        if (file->dir != dir) {
+            continue;
+        }
+        entry = entries + (*index)++ * 0x10;
+        put_u32(entry, *name_size);
+        put_u32(entry + 4, (uint32_t)(file->offset >> 5));
+        put_u32(entry + 8, (uint32_t)file->size);
+        put_u16(entry + 0x0C, part->cluster_hashed[file->cluster] ? 0x0400 : 0x0000);
+        put_u16(entry + 0x0E, file->cluster);
+        strcpy((char*)names + *name_size, file->name);
+        *name_size += (uint32_t)strlen(file->name) + 1;
+    }
+    for (d = 0; d < part->dir_count; d++) {
+        if (part->dirs[d].parent == dir) {
+            fst_emit_dir(part, d, entries, index, names, name_size, (int)own);
+        }
+    }
+
+    put_u32(entries + own * 0x10 + 8, *index);
+    return own;
+}
+
+static uint32_t fst_entry_count(const struct gen_partition* part) {
+    return (uint32_t)part->dir_count + part->file_count;
+}
+
+static uint64_t fst_size(const struct gen_partition* part) {
+    uint64_t size = 0x20 + 0x20 * part->cluster_count + 0x10 * fst_entry_count(part);
+    uint32_t i;
+    int d;
+    for (d = 0; d < part->dir_count; d++) {
+        size += strlen(part->dirs[d].name) + 1;
+    }
+    for (i = 0; i < part->file_count; i++) {
+        size += strlen(part->files[i].name) + 1;
+    }
+    // Name reads look 0x200 bytes ahead of every name
+    return ((size + 0x200 + 0x7FFF) / 0x8000) * 0x8000;
+}
+
+static int write_fst(FILE* out, const struct gen_partition* part) {
+    uint8_t* plain = (uint8_t*)calloc(part->fst_size, 1);
+    uint8_t* enc = (uint8_t*)malloc(part->fst_size);
+    uint8_t iv[16];
+    uint32_t c, index = 0, name_size = 0;
+    uint64_t entries_offset = 0x20 + 0x20 * part->cluster_count;
+    int result;
+
+    memcpy(plain, PARTITION_FILE_TABLE_SIGNATURE, 4);
+    put_u32(plain + 4, 0x20);
+    put_u32(plain + 8, part->cluster_count);
+    for (c = 0; c < part->cluster_count; c++) {
+        put_u32(plain + 0x20 + 0x20 * c, c == 0 ? 0 : (uint32_t)(part->cluster_offset[c] / 0x8000 + 1));
+        put_u32(plain + 0x20 + 0x20 * c + 4, (uint32_t)(part->cluster_size[c] / 0x8000));
+        if (part->cluster_hashed[c]) {
+            put_u32(plain + 0x20 + 0x20 * c + 0x10, 0x00000400);
+            put_u32(plain + 0x20 + 0x20 * c + 0x14, 0x02000000);
+        }
+    }
+    fst_emit_dir(part, 0, plain + entries_offset, &index, plain + entries_offset + 0x10 * fst_entry_count(part), &name_size, -1);
+
+    memset(iv, 0, 16);
+    AES128_CBC_encrypt_buffer(enc, plain, (uint32_t)part->fst_size, part->key, iv);
+    result = write_at(out, part->fst_offset, enc, part->fst_size);
+    free(plain);
+    free(enc);
+    return result;
+}
+
+// Lays the files of every cluster out back to back, 32 byte aligned as the FST requires
+static void layout_partition(struct gen_partition* part, uint64_t fst_offset) {
+    uint64_t used[3] = { 0, 0, 0 };
+    uint64_t next;
+    uint32_t i, c;
+
+    for (i = 0; i < part->file_count; i++) {
+        part->files[i].offset = used[part->files[i].cluster];
+        used[part->files[i].cluster] = (part->files[i].offset + part->files[i].size + 0x1F) & ~(uint64_t)0x1F;
+    }
+
+    part->fst_offset = fst_offset;
+    part->fst_size = fst_size(part);
+    part->cluster_offset[0] = 0;
+    part->cluster_size[0] = part->fst_size;
+    next = part->fst_size;
+    for (c = 1; c < part->cluster_count; c++) {
+        part->cluster_offset[c] = next;
+        if (part->cluster_hashed[c]) {
+            part->cluster_size[c] = ((used[c] + GEN_HASHED_BLOCK - 1) / GEN_HASHED_BLOCK) * 0x10000;
+        } else {
+            part->cluster_size[c] = ((used[c] + GEN_UNHASHED_BLOCK - 1) / GEN_UNHASHED_BLOCK) * GEN_UNHASHED_BLOCK;
+        }
+        if (part->cluster_size[c] == 0) {
+            part->cluster_size[c] = 0x10000;
+        }
+        next += part->cluster_size[c];
+    }
+}
+
+static uint64_t partition_end(const struct gen_partition* part) {
+    return part->fst_offset + part->cluster_offset[part->cluster_count - 1] + part->cluster_size[part->cluster_count - 1];
+}
+
+static int write_partition(FILE* out, const struct gen_partition* part) {
+    uint32_t c;
+    if (write_fst(out, part) != 0) {
+        return -1;
+    }
+    for (c = 1; c < part->cluster_count; c++) {
+        if ((part->cluster_hashed[c] ? write_hashed_cluster(out, part, (uint16_t)c) : write_unhashed_cluster(out, part, (uint16_t)c)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void dir_path(const struct gen_partition* part, int dir, char* out) {
+    char tmp[512];
+    if (dir <= 0) {
+        out[0] = '\0';
+        return;
+    }
+    dir_path(part, part->dirs[dir].parent, tmp);
+    sprintf(out, "%s%s/", tmp, part->dirs[dir].name);
+}
+
+static int write_plain(const char* plaindir, const struct gen_partition* part) {
+    char path[1024];
+    char dirs[512];
+    uint8_t* buf = (uint8_t*)malloc(0x100000);
+    uint64_t pos, chunk;
+    uint32_t i;
+    int d;
+    FILE* file;
+
+    sprintf(path, "%s/%s", plaindir, part->name);
+    makedir(path);
+    for (d = 1; d < part->dir_count; d++) {
+        dir_path(part, d, dirs);
+        sprintf(path, "%s/%s/%s", plaindir, part->name, dirs);
+        makedir(path);
+    }
+    for (i = 0; i < part->file_count; i++) {
+        dir_path(part, part->files[i].dir, dirs);
+        sprintf(path, "%s/%s/%s%s", plaindir, part->name, dirs, part->files[i].name);
+        file = fopen(path, "wb");
+        if (file == NULL) {
+            fprintf(stderr, "Error: Could not write plaintext file %s\n", path);
+            free(buf);
+            return -1;
+        }
+        for (pos = 0; pos < part->files[i].size; pos += chunk) {
+            chunk = (part->files[i].size - pos > 0x100000) ? 0x100000 : part->files[i].size - pos;
+            file_content(&part->files[i], pos, buf, chunk);
+            fwrite(buf, 1, chunk, file);
+        }
+        fclose(file);
+    }
+    free(buf);
+    return 0;
+}
+
+static int write_key(const char* filename, const uint8_t* key) {
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL || fwrite(key, 1, KEY_LENGTH, file) != KEY_LENGTH) {
+        fprintf(stderr, "Error: Could not write key file %s\n", filename);
+        if (file != NULL) {
+            fclose(file);
+        }
+        return -1;
+    }
+    fclose(file);
+    return 0;
+}
+
+void gen_default_options(struct gen_options* options) {
+    options->file_count = 64;
+    options->min_size = 1;
+    options->max_size = 0x400000;
+    options->unhashed_percent = 25;
+    options->seed = 1;
+    options->revision = 0;
+    options->disc_seed = 0;
+}
+
+int64_t gen_write_image(const struct gen_options* options, const char* image, const char* commonkey_path, const char* disckey_path, const char* plaindir) {
+    FILE* out;
+    uint8_t commonkey[16], disckey[16], titlekey[16], enc_titlekey[16], titleid[8], iv[16];
+    uint8_t toc[0x8000], enc_toc[0x8000];
+    uint8_t header[0x20];
+    uint64_t seed = options->seed, disc_seed = options->disc_seed ? options->disc_seed : options->seed, r;
+    uint32_t file_count = options->file_count, i;
+    struct gen_partition parts[2];
+    struct gen_file ticket;
+    uint8_t ticket_data[0x350];
+    double span;
+    int p, result = 0;
+
+    if (options->min_size == 0 || options->min_size > options->max_size || options->max_size > 0xFFFFFFFFULL) {
+        fprintf(stderr, "Error: Invalid file size range\n");
+        return -1;
+    }
+
+    // Test keys, all derived from the seed
+    for (i = 0; i < 16; i++) {
+        commonkey[i] = (uint8_t)splitmix64(seed * 3 + i);
+        disckey[i] = (uint8_t)splitmix64(disc_seed * 5 + i + 0x100);
+        titlekey[i] = (uint8_t)splitmix64(seed * 7 + i + 0x200);
+    }
+    memcpy(titleid, "\x00\x05\x00\x00\x10\x10\x00\x00", 8);
+    titleid[6] = (uint8_t)(seed >> 8);
+    titleid[7] = (uint8_t)seed;
+    memset(iv, 0, 16);
+    memcpy(iv, titleid, 8);
+    AES128_CBC_encrypt_buffer(enc_titlekey, titlekey, 16, commonkey, iv);
+
+    // SI partition holding the ticket, encrypted with the disc key
+    memset(&parts[0], 0, sizeof(struct gen_partition));
+    strcpy(parts[0].name, "SI");
+    memcpy(parts[0].key, disckey, 16);
+    parts[0].cluster_count = 2;
+    parts[0].dirs = si_dirs;
+    parts[0].dir_count = 2;
+    parts[0].file_count = 1;
+    parts[0].files = &ticket;
+    memset(&ticket, 0, sizeof(struct gen_file));
+    strcpy(ticket.name, "title.tik");
+    ticket.dir = 1;
+    ticket.size = 0x350;
+    ticket.cluster = 1;
+    ticket.seed = seed;
+    ticket.data = ticket_data;
+    memset(ticket_data, 0, sizeof(ticket_data));
+    memcpy(ticket_data + 0x1BF, enc_titlekey, 16);
+    memcpy(ticket_data + 0x1DC, titleid, 8);
+
+    // GM partition with an unhashed code cluster and a hashed content cluster
+    memset(&parts[1], 0, sizeof(struct gen_partition));
+    sprintf(parts[1].name, "GM%02X%02X%02X%02X%02X%02X%02X%02X", titleid[0], titleid[1], titleid[2], titleid[3], titleid[4], titleid[5], titleid[6], titleid[7]);
+    memcpy(parts[1].key, titlekey, 16);
+    parts[1].cluster_count = 3;
+    parts[1].cluster_hashed[2] = 1;
+    parts[1].dirs = gm_dirs;
+    parts[1].dir_count = GEN_DIR_COUNT;
+    parts[1].file_count = file_count;
+    parts[1].files = (struct gen_file*)calloc(file_count ? file_count : 1, sizeof(struct gen_file));
+    if (parts[1].files == NULL) {
+        fprintf(stderr, "Could not allocate enough memory for %u files\n", file_count);
+        return -1;
+    }
+    span = (double)options->max_size / (double)options->min_size;
+    for (i = 0; i < file_count; i++) {
+        struct gen_file* file = &parts[1].files[i];
+        r = splitmix64(seed ^ ((uint64_t)i << 20));
+        sprintf(file->name, "file%04u.bin", i);
+        file->seed = splitmix64(r);
+        // A later revision changes the content of every 8th file, sizes and layout stay
+        if (options->revision > 0 && i % 8 == 3) file->seed ^= splitmix64(options->revision);
+        // Log-uniform sizes: many small files, a few large ones
+        file->size = (uint64_t)((double)options->min_size * pow(span, (double)(r & 0xFFFF) / 65535.0));
+        if (file->size > options->max_size) file->size = options->max_size;
+        if ((r >> 16) % 100 < options->unhashed_percent) {
+            file->cluster = 1;
+            file->dir = 1;
+        } else {
+            file->cluster = 2;
+            file->dir = 2 + (int)((r >> 24) % 3);
+        }
+    }
+
+    layout_partition(&parts[0], 0x20000);
+    layout_partition(&parts[1], partition_end(&parts[0]));
+
+    out = fopen(image, "wb+");
+    if (out == NULL) {
+        fprintf(stderr, "Error: Could not create image %s\n", image);
+        free(parts[1].files);
+        return -1;
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, "WUP-P-TEST_00_550USA", 20);
+    memset(toc, 0, sizeof(toc));
+    memcpy(toc, DECRYPTED_AREA_SIGNATURE, 4);
+    put_u32(toc + 0x1C, 2);
+    for (p = 0; p < 2; p++) {
+        memcpy(toc + PARTITION_TOC_OFFSET + p * PARTITION_TOC_ENTRY_SIZE, parts[p].name, strlen(parts[p].name));
+        put_u32(toc + PARTITION_TOC_OFFSET + p * PARTITION_TOC_ENTRY_SIZE + 0x20, (uint32_t)((parts[p].fst_offset - 0x8000) / 0x8000));
+    }
+    memset(iv, 0, 16);
+    AES128_CBC_encrypt_buffer(enc_toc, toc, sizeof(toc), disckey, iv);
+
+    if (write_at(out, 0, header, sizeof(header)) != 0
+        || write_at(out, WIIU_DECRYPTED_AREA_OFFSET, enc_toc, sizeof(enc_toc)) != 0
+        || write_partition(out, &parts[0]) != 0
+        || write_partition(out, &parts[1]) != 0) {
+        result = -1;
+    }
+    if (fclose(out) != 0) {
+        result = -1;
+    }
+
+    if (result == 0 && (write_key(commonkey_path, commonkey) != 0 || write_key(disckey_path, disckey) != 0)) {
+        result = -1;
+    }
+    if (result == 0 && plaindir != NULL) {
+        makedir(plaindir);
+        if (write_plain(plaindir, &parts[0]) != 0 || write_plain(plaindir, &parts[1]) != 0) {
+            result = -1;
+        }
+    }
+    free(parts[1].files);
+    return (result == 0) ? (int64_t)partition_end(&parts[1]) : -1;
+}
@@ -0,0 +1,24 @@
+#ifndef _GEN_H_
+#define _GEN_H_
+#include <stdint.h>
+
+// What a synthetic image holds, every byte of it follows from these
+struct gen_options {
+    uint32_t file_count;
+    // File sizes are log-uniform between the two
+    uint64_t min_size;
+    uint64_t max_size;
+    // Share of files in the unhashed cluster, the rest is hashed
+    uint32_t unhashed_percent;
+    uint64_t seed;
+    // Above 0 every 8th file gets other content, sizes and layout stay the same
+    uint32_t revision;
+    // Above 0 the disc key follows from this instead of seed, giving another disc with the same content
+    uint64_t disc_seed;
+};
+
+void gen_default_options(struct gen_options* options);
+// Writes the image and the test keys it is encrypted with, plus the plaintext of every file below plaindir
+// unless that is NULL. Returns the size of the image or -1.
+int64_t gen_write_image(const struct gen_options* options, const char* image, const char* commonkey_path, const char* disckey_path, const char* plaindir);
+#endif // _GEN_H_
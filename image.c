@@ -0,0 +1,704 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else
+#include <fcntl.h>
+#include <io.h>
+#endif
+#include "cache.h"
+#include "image.h"
+#include "probes.h"
+
+// preadv() and posix_fadvise() are not available everywhere, without them the same is done with more syscalls
+#if defined(__linux__)
+#define HAVE_PREADV 1
+#define HAVE_FADVISE 1
+#endif
+// Most buffers a single preadv() gets, larger vectored reads are split
+#define IMAGE_MAX_VECTORS 64
+
+// A stream never buffers more than this, larger gaps between release() and a read are an error
+#define STREAM_MAX_BUFFER (512 * 1024 * 1024)
+#define STREAM_SKIP_CHUNK 0x10000
+
+// "WUX0" followed by a second magic, see the header layout in image_open_wux()
+#define WUX_MAGIC_0 0x30585557
+#define WUX_MAGIC_1 0x1099D02E
+#define WUX_HEADER_SIZE 0x20
+// Sectors stored once but used several times (mostly empty ones) stay in this many cache slots
+#define WUX_CACHE_SECTORS 64
+
+// FAT32 dumpers write game_part1.wud, game_part2.wud, ...
+#define SPLIT_MAX_PARTS 64
+
+struct stream_source {
+    FILE* input;
+
+    // data holds the image bytes [base, base + length)
+    uint8_t* data;
+    size_t capacity;
+    size_t length;
+    uint64_t base;
+    // Bytes consumed from input so far, lags behind base while a released range still has to be skipped
+    uint64_t position;
+};
+
+struct wux_source {
+    FILE* file;
+    uint32_t sector_size;
+    uint64_t size;
+    uint64_t data_offset;
+
+    // Stored sector for every logical sector of the image
+    uint32_t sector_count;
+    uint32_t* sector_index;
+    // One bit per stored sector, set if more than one logical sector points to it
+    uint8_t* shared;
+    struct block_cache* cache;
+};
+
+struct split_source {
+    uint32_t part_count;
+    FILE* parts[SPLIT_MAX_PARTS];
+    // Image offset each part starts at, starts[part_count] is the total size
+    uint64_t starts[SPLIT_MAX_PARTS + 1];
+};
+
+static size_t read_file_at(FILE* file, uint64_t offset, void* buffer, size_t size) {
+    size_t done = 0;
+#ifndef _WIN32
+    ssize_t result;
+
+    // Positional reads leave the stream position alone, so several threads can share one image
+    while (done < size) {
+        result = pread(fileno(file), (uint8_t*)buffer + done, size - done, (off_t)(offset + done));
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            break;
+        }
+        done += (size_t)result;
+    }
+#else
+    static pthread_mutex_t seek_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock(&seek_lock);
+    if (_fseeki64(file, (__int64)offset, SEEK_SET) == 0) {
+        done = fread(buffer, 1, size, file);
+    }
+    pthread_mutex_unlock(&seek_lock);
+#endif
+    return done;
+}
+
+static size_t file_read_at(struct image_source* source, uint64_t offset, void* buffer, size_t size) {
+    return read_file_at((FILE*)source->data, offset, buffer, size);
+}
+
+static size_t file_read_vectored(struct image_source* source, uint64_t offset, const struct image_iovec* vectors, int count) {
+    FILE* file = (FILE*)source->data;
+    size_t done = 0, skip, result;
+    int i = 0;
+#ifdef HAVE_PREADV
+    struct iovec iov[IMAGE_MAX_VECTORS];
+    ssize_t read_size;
+    size_t total = 0;
+    int n;
+
+    // One syscall fills all buffers, anything short of that is finished below one buffer at a time
+    n = (count > IMAGE_MAX_VECTORS) ? IMAGE_MAX_VECTORS : count;
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = vectors[i].buffer;
+        iov[i].iov_len = vectors[i].size;
+        total += vectors[i].size;
+    }
+    do {
+        read_size = preadv(fileno(file), iov, n, (off_t)offset);
+    } while (read_size < 0 && errno == EINTR);
+    if (read_size > 0) {
+        done = (size_t)read_size;
+    }
+    if (done == total && n == count) {
+        return done;
+    }
+#endif
+
+    skip = done;
+    for (i = 0; i < count; i++) {
+        if (skip >= vectors[i].size) {
+            skip -= vectors[i].size;
+            continue;
+        }
+        result = read_file_at(file, offset + done, (uint8_t*)vectors[i].buffer + skip, vectors[i].size - skip);
+        done += result;
+        if (result != vectors[i].size - skip) {
+            break;
+        }
+        skip = 0;
+    }
+    return done;
+}
+
+static uint64_t file_size_of(struct image_source* source) {
+#ifndef _WIN32
+    struct stat info;
+
+    if (fstat(fileno((FILE*)source->data), &info) != 0) {
+        return 0;
+    }
+    return (uint64_t)info.st_size;
+#else
+    return (uint64_t)_filelengthi64(_fileno((FILE*)source->data));
+#endif
+}
+
+static void file_hint(struct image_source* source, int hint, uint64_t offset, uint64_t length) {
+#ifdef HAVE_FADVISE
+    int advice;
+
+    switch (hint) {
+    case IMAGE_HINT_SEQUENTIAL:
+        advice = POSIX_FADV_SEQUENTIAL;
+        break;
+    case IMAGE_HINT_RANDOM:
+        advice = POSIX_FADV_RANDOM;
+        break;
+    case IMAGE_HINT_WILLNEED:
+        advice = POSIX_FADV_WILLNEED;
+        break;
+    case IMAGE_HINT_DONTNEED:
+        advice = POSIX_FADV_DONTNEED;
+        break;
+    default:
+        return;
+    }
+    posix_fadvise(fileno((FILE*)source->data), (off_t)offset, (off_t)length, advice);
+#endif
+}
+
+static void file_close(struct image_source* source) {
+    fclose((FILE*)source->data);
+    free(source);
+}
+
+struct image_source* image_open_file(const char* path) {
+    struct image_source* source = (struct image_source*)calloc(1, sizeof(struct image_source));
+    if (source == NULL) {
+        return NULL;
+    }
+    source->data = fopen(path, "rb");
+    if (source->data == NULL) {
+        free(source);
+        return NULL;
+    }
+    source->read_at = file_read_at;
+    source->read_vectored = file_read_vectored;
+    source->size = file_size_of;
+    source->hint = file_hint;
+    source->close = file_close;
+    return source;
+}
+
+static uint32_t read_le32(const uint8_t* bytes) {
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static uint64_t read_le64(const uint8_t* bytes) {
+    return (uint64_t)read_le32(bytes) | ((uint64_t)read_le32(bytes + 4) << 32);
+}
+
+static size_t wux_read_at(struct image_source* source, uint64_t offset, void* buffer, size_t size) {
+    struct wux_source* wux = (struct wux_source*)source->data;
+    uint8_t sector[CACHE_BLOCK_SIZE];
+    uint8_t* output = (uint8_t*)buffer;
+    uint64_t sector_number, sector_offset, stored_offset, run_length;
+    uint32_t stored, cached_size, run;
+    size_t done = 0, copy_size;
+
+    if (offset >= wux->size) {
+        return 0;
+    }
+    if (size > wux->size - offset) {
+        size = (size_t)(wux->size - offset);
+    }
+
+    while (done < size) {
+        sector_number = (offset + done) / wux->sector_size;
+        sector_offset = (offset + done) % wux->sector_size;
+        stored = wux->sector_index[sector_number];
+
+        if (wux->cache != NULL && (wux->shared[stored / 8] & (1 << (stored % 8)))) {
+            // A sector shared by several logical sectors is only read once while it stays cached. Like every
+            // other user of the cache it is keyed by byte offset, which the cache hashes into buckets.
+            stored_offset = (uint64_t)stored * wux->sector_size;
+            if (!block_cache_get(wux->cache, stored_offset, sector, &cached_size)) {
+                if (read_file_at(wux->file, wux->data_offset + stored_offset, sector, wux->sector_size) != wux->sector_size) {
+                    break;
+                }
+                block_cache_put(wux->cache, stored_offset, sector, wux->sector_size);
+            }
+            copy_size = (size_t)(wux->sector_size - sector_offset);
+            if (copy_size > size - done) {
+                copy_size = size - done;
+            }
+            memcpy(output + done, sector + sector_offset, copy_size);
+            done += copy_size;
+            continue;
+        }
+
+        // Logical sectors stored back to back are read with a single positional read
+        for (run = 1; sector_number + run < wux->sector_count && (uint64_t)run * wux->sector_size - sector_offset < size - done; run++) {
+            if (wux->sector_index[sector_number + run] != stored + run) {
+                break;
+            }
+        }
+        run_length = (uint64_t)run * wux->sector_size - sector_offset;
+        copy_size = (run_length > size - done) ? size - done : (size_t)run_length;
+        if (read_file_at(wux->file, wux->data_offset + (uint64_t)stored * wux->sector_size + sector_offset, output + done, copy_size) != copy_size) {
+            break;
+        }
+        done += copy_size;
+    }
+    return done;
+}
+
+static uint64_t wux_size(struct image_source* source) {
+    return ((struct wux_source*)source->data)->size;
+}
+
+static void wux_free(struct wux_source* wux) {
+    if (wux->file != NULL) {
+        fclose(wux->file);
+    }
+    block_cache_free(wux->cache);
+    free(wux->sector_index);
+    free(wux->shared);
+    free(wux);
+}
+
+static void wux_close(struct image_source* source) {
+    wux_free((struct wux_source*)source->data);
+    free(source);
+}
+
+// Opens a WUX image, a WUD with every sector stored only once:
+// 0x00 magic "WUX0", 0x04 second magic, 0x08 sector size, 0x10 uncompressed size, 0x18 flags,
+// 0x20 one little endian stored sector number per logical sector, then the sectors aligned to the sector size.
+struct image_source* image_open_wux(const char* path) {
+    struct image_source* source;
+    struct wux_source* wux;
+    uint8_t header[WUX_HEADER_SIZE];
+    uint8_t* table;
+    uint64_t sector_count, table_size;
+    uint32_t i, stored_count = 0;
+    uint8_t* seen;
+
+    wux = (struct wux_source*)calloc(1, sizeof(struct wux_source));
+    if (wux == NULL) {
+        return NULL;
+    }
+    wux->file = fopen(path, "rb");
+    if (wux->file == NULL || read_file_at(wux->file, 0, header, WUX_HEADER_SIZE) != WUX_HEADER_SIZE
+        || read_le32(header) != WUX_MAGIC_0 || read_le32(header + 4) != WUX_MAGIC_1) {
+        wux_free(wux);
+        return NULL;
+    }
+
+    wux->sector_size = read_le32(header + 8);
+    wux->size = read_le64(header + 0x10);
+    if (wux->sector_size < 0x100 || (wux->sector_size & (wux->sector_size - 1)) != 0) {
+        fprintf(stderr, "Error: WUX image has an invalid sector size 0x%X\n", wux->sector_size);
+        wux_free(wux);
+        return NULL;
+    }
+    sector_count = (wux->size + wux->sector_size - 1) / wux->sector_size;
+    if (sector_count > UINT32_MAX) {
+        fprintf(stderr, "Error: WUX image is too large\n");
+        wux_free(wux);
+        return NULL;
+    }
+    wux->sector_count = (uint32_t)sector_count;
+    table_size = sector_count * 4;
+    wux->data_offset = (WUX_HEADER_SIZE + table_size + wux->sector_size - 1) & ~((uint64_t)wux->sector_size - 1);
+
+    table = (uint8_t*)malloc((size_t)table_size);
+    wux->sector_index = (uint32_t*)malloc((size_t)sector_count * sizeof(uint32_t));
+    if (table == NULL || wux->sector_index == NULL) {
+        fprintf(stderr, "Could not allocate enough memory for the WUX sector table\n");
+        free(table);
+        wux_free(wux);
+        return NULL;
+    }
+    if (read_file_at(wux->file, WUX_HEADER_SIZE, table, (size_t)table_size) != table_size) {
+        fprintf(stderr, "Error: WUX sector table is truncated\n");
+        free(table);
+        wux_free(wux);
+        return NULL;
+    }
+    for (i = 0; i < wux->sector_count; i++) {
+        wux->sector_index[i] = read_le32(table + (size_t)i * 4);
+        if (wux->sector_index[i] >= stored_count) {
+            stored_count = wux->sector_index[i] + 1;
+        }
+    }
+    free(table);
+
+    // Mark stored sectors used more than once, only those are worth caching
+    seen = (uint8_t*)calloc(stored_count / 8 + 1, 1);
+    wux->shared = (uint8_t*)calloc(stored_count / 8 + 1, 1);
+    if (seen == NULL || wux->shared == NULL) {
+        fprintf(stderr, "Could not allocate enough memory for the WUX sector table\n");
+        free(seen);
+        wux_free(wux);
+        return NULL;
+    }
+    for (i = 0; i < wux->sector_count; i++) {
+        if (seen[wux->sector_index[i] / 8] & (1 << (wux->sector_index[i] % 8))) {
+            wux->shared[wux->sector_index[i] / 8] |= (uint8_t)(1 << (wux->sector_index[i] % 8));
+        }
+        seen[wux->sector_index[i] / 8] |= (uint8_t)(1 << (wux->sector_index[i] % 8));
+    }
+    free(seen);
+    if (wux->sector_size <= CACHE_BLOCK_SIZE) {
+        wux->cache = block_cache_create(WUX_CACHE_SECTORS, 1);
+    }
+
+    source = (struct image_source*)calloc(1, sizeof(struct image_source));
+    if (source == NULL) {
+        wux_free(wux);
+        return NULL;
+    }
+    source->data = wux;
+    source->read_at = wux_read_at;
+    source->size = wux_size;
+    source->close = wux_close;
+    return source;
+}
+
+static int64_t file_size(FILE* file) {
+#ifndef _WIN32
+    if (fseeko(file, 0, SEEK_END) != 0) {
+        return -1;
+    }
+    return (int64_t)ftello(file);
+#else
+    if (_fseeki64(file, 0, SEEK_END) != 0) {
+        return -1;
+    }
+    return (int64_t)_ftelli64(file);
+#endif
+}
+
+static size_t split_read_at(struct image_source* source, uint64_t offset, void* buffer, size_t size) {
+    struct split_source* split = (struct split_source*)source->data;
+    uint32_t part = 0;
+    size_t done = 0, chunk, result;
+
+    while (part < split->part_count && offset >= split->starts[part + 1]) {
+        part++;
+    }
+    // Reads crossing into the next part are split into one positional read per part
+    while (done < size && part < split->part_count) {
+        chunk = size - done;
+        if (chunk > split->starts[part + 1] - (offset + done)) {
+            chunk = (size_t)(split->starts[part + 1] - (offset + done));
+        }
+        result = read_file_at(split->parts[part], offset + done - split->starts[part], (uint8_t*)buffer + done, chunk);
+        done += result;
+        if (result != chunk) {
+            break;
+        }
+        part++;
+    }
+    return done;
+}
+
+static uint64_t split_size(struct image_source* source) {
+    struct split_source* split = (struct split_source*)source->data;
+
+    return split->starts[split->part_count];
+}
+
+static void split_hint(struct image_source* source, int hint, uint64_t offset, uint64_t length) {
+    struct split_source* split = (struct split_source*)source->data;
+    struct image_source part_source;
+    uint64_t end = (length == 0) ? split->starts[split->part_count] : offset + length;
+    uint64_t start;
+    uint32_t i;
+
+    // Every part overlapping the range gets the hint for its share of it
+    memset(&part_source, 0, sizeof(part_source));
+    for (i = 0; i < split->part_count; i++) {
+        if (end <= split->starts[i] || offset >= split->starts[i + 1]) {
+            continue;
+        }
+        start = (offset > split->starts[i]) ? offset - split->starts[i] : 0;
+        part_source.data = split->parts[i];
+        file_hint(&part_source, hint, start, ((end < split->starts[i + 1]) ? end : split->starts[i + 1]) - split->starts[i] - start);
+    }
+}
+
+static void split_free(struct split_source* split) {
+    uint32_t i;
+
+    for (i = 0; i < split->part_count; i++) {
+        fclose(split->parts[i]);
+    }
+    free(split);
+}
+
+static void split_close(struct image_source* source) {
+    split_free((struct split_source*)source->data);
+    free(source);
+}
+
+// Finds "part<N>.wud" at the end of path, returns the offset of N or -1
+static int split_number_offset(const char* path) {
+    size_t length = strlen(path);
+    size_t end, start;
+
+    if (length < 9 || strcmp(path + length - 4, ".wud") != 0) {
+        return -1;
+    }
+    end = length - 4;
+    for (start = end; start > 0 && path[start - 1] >= '0' && path[start - 1] <= '9'; start--) {
+    }
+    if (start == end || start < 4 || strncmp(path + start - 4, "part", 4) != 0) {
+        return -1;
+    }
+    return (int)start;
+}
+
+struct image_source* image_open_split(const char* path) {
+    struct image_source* source;
+    struct split_source* split;
+    char part_path[1024];
+    int number_offset = split_number_offset(path);
+    int64_t size;
+    FILE* part;
+
+    if (number_offset < 0 || strlen(path) >= sizeof(part_path) - 8) {
+        return NULL;
+    }
+    split = (struct split_source*)calloc(1, sizeof(struct split_source));
+    if (split == NULL) {
+        return NULL;
+    }
+
+    // Whatever part was named, the image always starts at part 1
+    while (split->part_count < SPLIT_MAX_PARTS) {
+        sprintf(part_path, "%.*s%u.wud", number_offset, path, split->part_count + 1);
+        part = fopen(part_path, "rb");
+        if (part == NULL) {
+            break;
+        }
+        size = file_size(part);
+        if (size < 0) {
+            fclose(part);
+            break;
+        }
+        split->parts[split->part_count] = part;
+        split->starts[split->part_count + 1] = split->starts[split->part_count] + (uint64_t)size;
+        split->part_count++;
+    }
+    if (split->part_count == 0) {
+        split_free(split);
+        return NULL;
+    }
+
+    source = (struct image_source*)calloc(1, sizeof(struct image_source));
+    if (source == NULL) {
+        split_free(split);
+        return NULL;
+    }
+    source->data = split;
+    source->read_at = split_read_at;
+    source->size = split_size;
+    source->hint = split_hint;
+    source->close = split_close;
+    return source;
+}
+
+struct image_source* image_open(const char* path) {
+    uint8_t magic[4];
+    FILE* file;
+    size_t result;
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    result = fread(magic, 1, 4, file);
+    fclose(file);
+
+    if (result == 4 && read_le32(magic) == WUX_MAGIC_0) {
+        return image_open_wux(path);
+    }
+    if (split_number_offset(path) >= 0) {
+        return image_open_split(path);
+    }
+    return image_open_file(path);
+}
+
+static int stream_skip(struct stream_source* stream) {
+    uint8_t scratch[STREAM_SKIP_CHUNK];
+    size_t chunk;
+
+    while (stream->position < stream->base) {
+        chunk = (stream->base - stream->position > STREAM_SKIP_CHUNK) ? STREAM_SKIP_CHUNK : (size_t)(stream->base - stream->position);
+        if (fread(scratch, 1, chunk, stream->input) != chunk) {
+            return -1;
+        }
+        stream->position += chunk;
+    }
+    return 0;
+}
+
+static size_t stream_read_at(struct image_source* source, uint64_t offset, void* buffer, size_t size) {
+    struct stream_source* stream = (struct stream_source*)source->data;
+    uint8_t* data;
+    uint64_t end = offset + size;
+    size_t needed, capacity, result;
+
+    if (offset < stream->base) {
+        fprintf(stderr, "Error: Streaming input cannot go back to offset 0x%llX\n", (unsigned long long int)offset);
+        return 0;
+    }
+    if (stream->length == 0 && stream_skip(stream) != 0) {
+        return 0;
+    }
+
+    if (end > stream->position) {
+        if (end - stream->base > STREAM_MAX_BUFFER) {
+            fprintf(stderr, "Error: Streaming input would need to buffer more than %d MiB\n", STREAM_MAX_BUFFER / (1024 * 1024));
+            return 0;
+        }
+        needed = (size_t)(end - stream->base);
+        if (needed > stream->capacity) {
+            capacity = (stream->capacity * 2 > needed) ? stream->capacity * 2 : needed;
+            data = (uint8_t*)realloc(stream->data, capacity);
+            if (data == NULL) {
+                fprintf(stderr, "Could not allocate enough memory to buffer the input stream\n");
+                return 0;
+            }
+            stream->data = data;
+            stream->capacity = capacity;
+        }
+
+        result = fread(stream->data + stream->length, 1, needed - stream->length, stream->input);
+        stream->length += result;
+        stream->position += result;
+        if (offset >= stream->position) {
+            return 0;
+        }
+        if (end > stream->position) {
+            size = (size_t)(stream->position - offset);
+        }
+    }
+
+    memcpy(buffer, stream->data + (offset - stream->base), size);
+    return size;
+}
+
+static void stream_release(struct image_source* source, uint64_t offset) {
+    struct stream_source* stream = (struct stream_source*)source->data;
+    size_t drop;
+
+    if (offset <= stream->base) {
+        return;
+    }
+    drop = (offset - stream->base > stream->length) ? stream->length : (size_t)(offset - stream->base);
+    memmove(stream->data, stream->data + drop, stream->length - drop);
+    stream->length -= drop;
+    // Anything released but not read yet is skipped on the next read
+    stream->base = offset;
+}
+
+static void stream_close(struct image_source* source) {
+    struct stream_source* stream = (struct stream_source*)source->data;
+
+    free(stream->data);
+    free(stream);
+    free(source);
+}
+
+struct image_source* image_open_stream(FILE* input) {
+    struct image_source* source = (struct image_source*)calloc(1, sizeof(struct image_source));
+    struct stream_source* stream = (struct stream_source*)calloc(1, sizeof(struct stream_source));
+    if (source == NULL || stream == NULL) {
+        free(source);
+        free(stream);
+        return NULL;
+    }
+#ifdef _WIN32
+    _setmode(_fileno(input), _O_BINARY);
+#endif
+    stream->input = input;
+    source->data = stream;
+    source->read_at = stream_read_at;
+    source->release = stream_release;
+    source->close = stream_close;
+    return source;
+}
+
+#ifdef WUDECRYPT_PROBES
+static size_t iovec_size(const struct image_iovec* vectors, int count) {
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        size += vectors[i].size;
+    }
+    return size;
+}
+#endif
+
+size_t image_read_vectored(struct image_source* source, uint64_t offset, const struct image_iovec* vectors, int count) {
+    size_t done = 0, result;
+    int i;
+
+    PROBE_READ_START(offset, iovec_size(vectors, count));
+    if (source->read_vectored != NULL) {
+        done = source->read_vectored(source, offset, vectors, count);
+    } else {
+        for (i = 0; i < count; i++) {
+            result = source->read_at(source, offset + done, vectors[i].buffer, vectors[i].size);
+            done += result;
+            if (result != vectors[i].size) {
+                break;
+            }
+        }
+    }
+    PROBE_READ_DONE(offset, iovec_size(vectors, count), done);
+    return done;
+}
+
+uint64_t image_size(struct image_source* source) {
+    return (source->size != NULL) ? source->size(source) : 0;
+}
+
+void image_hint(struct image_source* source, int hint, uint64_t offset, uint64_t length) {
+    if (source->hint != NULL) {
+        source->hint(source, hint, offset, length);
+    }
+}
+
+void image_release(struct image_source* source, uint64_t offset) {
+    if (source->release != NULL) {
+        source->release(source, offset);
+    }
+}
+
+void image_close(struct image_source* source) {
+    if (source != NULL) {
+        source->close(source);
+    }
+}
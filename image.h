@@ -0,0 +1,54 @@
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Access pattern hints, see image_hint()
+#define IMAGE_HINT_SEQUENTIAL 1
+#define IMAGE_HINT_RANDOM 2
+#define IMAGE_HINT_WILLNEED 3
+#define IMAGE_HINT_DONTNEED 4
+
+// One destination buffer of a vectored read
+struct image_iovec {
+    void* buffer;
+    size_t size;
+};
+
+// Where the raw disc image comes from. Everything reading the image goes through read_at().
+struct image_source {
+    // Reads up to size bytes at offset, returns the number of bytes read
+    size_t (*read_at)(struct image_source* source, uint64_t offset, void* buffer, size_t size);
+    // Fills the buffers one after another from offset on, returns the number of bytes read, may be NULL
+    size_t (*read_vectored)(struct image_source* source, uint64_t offset, const struct image_iovec* vectors, int count);
+    // Size of the image, may be NULL if unknown
+    uint64_t (*size)(struct image_source* source);
+    // Advice about how a range will be accessed, length 0 means up to the end, may be NULL
+    void (*hint)(struct image_source* source, int hint, uint64_t offset, uint64_t length);
+    // Promises that nothing before offset is read again, may be NULL
+    void (*release)(struct image_source* source, uint64_t offset);
+    void (*close)(struct image_source* source);
+
+    void* data;
+};
+
+// Opens path with the backend matching it: a WUX, the parts of a split WUD or a plain WUD
+struct image_source* image_open(const char* path);
+// A regular image file, safe to read from several threads at once
+struct image_source* image_open_file(const char* path);
+// A sector-deduplicated WUX image, read as the WUD it stands for. Thread-safe.
+struct image_source* image_open_wux(const char* path);
+// A WUD split into <name>part1.wud, <name>part2.wud, ... read as one image, path can name any part
+struct image_source* image_open_split(const char* path);
+// A forward-only stream such as a pipe. Only the data between the last release() and the
+// furthest read is buffered, reading before that fails. Not thread-safe.
+struct image_source* image_open_stream(FILE* input);
+
+// Wrappers for backends lacking an operation: plain reads instead, 0 for an unknown size, hints are dropped
+size_t image_read_vectored(struct image_source* source, uint64_t offset, const struct image_iovec* vectors, int count);
+uint64_t image_size(struct image_source* source);
+void image_hint(struct image_source* source, int hint, uint64_t offset, uint64_t length);
+void image_release(struct image_source* source, uint64_t offset);
+void image_close(struct image_source* source);
+#endif // _IMAGE_H_
@@ -0,0 +1,499 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "utarray.h"
+#include "sha1.h"
+#include "journal.h"
+
+// One line of the journal: "F <size> <sha1> <path>" for a finished file,
+// "P <bytes> <sha1> <path>" for the first bytes of a file that reached the disk.
+// The first line, "I <identity>", names the image the files came from.
+struct journal_record {
+    char* path;
+    char type;
+    uint64_t bytes;
+    uint8_t hash[20];
+};
+
+struct journal_sink {
+    struct output_sink* inner;
+    FILE* file;
+    char path[1100];
+    char root[1024];
+    size_t root_length;
+    // Identity of the image of the earlier runs, empty if they recorded none
+    char identity[JOURNAL_IDENTITY_LENGTH + 1];
+
+    // Everything earlier runs recorded, sorted by path and size
+    UT_array* records;
+    // Finished files waiting until their data is written
+    UT_array* pending;
+    uint64_t pending_bytes;
+
+    // Result of the last completed() call, picked up by the following open()
+    char resume_path[1024];
+    uint64_t resume_bytes;
+    mbedtls_sha1_context resume_sha1;
+};
+
+struct journal_output {
+    void* inner;
+    char path[1024];
+    uint64_t size;
+    uint64_t written;
+    uint64_t next_checkpoint;
+    // Cleared once the output is written out of order or fails, it is never recorded then
+    int hashing;
+    mbedtls_sha1_context sha1;
+};
+
+static void record_copy(void* dst, const void* src) {
+    struct journal_record* target = (struct journal_record*)dst;
+    const struct journal_record* source = (const struct journal_record*)src;
+
+    *target = *source;
+    target->path = (source->path != NULL) ? strdup(source->path) : NULL;
+}
+
+static void record_dtor(void* element) {
+    free(((struct journal_record*)element)->path);
+}
+
+static const UT_icd journal_record_icd = { sizeof(struct journal_record), NULL, record_copy, record_dtor };
+
+static int record_cmp(const void* e1, const void* e2) {
+    const struct journal_record* record1 = (const struct journal_record*)e1;
+    const struct journal_record* record2 = (const struct journal_record*)e2;
+    int result = strcmp(record1->path, record2->path);
+
+    if (result != 0) {
+        return result;
+    }
+    return (record1->bytes > record2->bytes) - (record1->bytes < record2->bytes);
+}
+
+static void hash_to_hex(const uint8_t* hash, char* output) {
+    int i;
+    for (i = 0; i < 20; i++) {
+        sprintf(output + (i * 2), "%02x", hash[i]);
+    }
+}
+
+static int hex_to_hash(const char* input, uint8_t* hash) {
+    unsigned int value;
+    int i;
+
+    if (strlen(input) != 40) {
+        return -1;
+    }
+    for (i = 0; i < 20; i++) {
+        if (sscanf(input + (i * 2), "%2x", &value) != 1) {
+            return -1;
+        }
+        hash[i] = (uint8_t)value;
+    }
+    return 0;
+}
+
+// Paths are recorded relative to the output directory, so the journal survives moving it
+static const char* journal_relative(struct journal_sink* journal, const char* path) {
+    if (strncmp(path, journal->root, journal->root_length) == 0 && path[journal->root_length] == '/') {
+        return path + journal->root_length + 1;
+    }
+    return path;
+}
+
+static void journal_append(struct journal_sink* journal, char type, uint64_t bytes, const uint8_t* hash, const char* path) {
+    char hex[41];
+
+    hash_to_hex(hash, hex);
+    fprintf(journal->file, "%c %llu %s %s\n", type, (unsigned long long int)bytes, hex, path);
+    fflush(journal->file);
+}
+
+static void journal_load(struct journal_sink* journal, FILE* input) {
+    char line[2048];
+    char hex[41];
+    unsigned long long int bytes;
+    struct journal_record record;
+    size_t length;
+    int path_start;
+
+    while (fgets(line, sizeof(line), input) != NULL) {
+        // A line cut off by a crash has no newline and is ignored
+        length = strlen(line);
+        if (length == 0 || line[length - 1] != '\n') {
+            continue;
+        }
+        line[length - 1] = '\0';
+
+        if (line[0] == 'I' && line[1] == ' ') {
+            strncpy(journal->identity, line + 2, JOURNAL_IDENTITY_LENGTH);
+            journal->identity[JOURNAL_IDENTITY_LENGTH] = '\0';
+            continue;
+        }
+        path_start = 0;
+        if (sscanf(line, "%c %llu %40s %n", &(record.type), &bytes, hex, &path_start) != 3 || path_start == 0
+            || (record.type != 'F' && record.type != 'P') || hex_to_hash(hex, record.hash) != 0 || line[path_start] == '\0') {
+            continue;
+        }
+        record.bytes = (uint64_t)bytes;
+        record.path = line + path_start;
+        utarray_push_back(journal->records, &record);
+    }
+    utarray_sort(journal->records, record_cmp);
+}
+
+// Index of the first record of path, -1 if there is none
+static int journal_find(struct journal_sink* journal, const char* path) {
+    struct journal_record* record;
+    int low = 0, high = (int)utarray_len(journal->records), middle;
+
+    while (low < high) {
+        middle = low + ((high - low) / 2);
+        record = (struct journal_record*)utarray_eltptr(journal->records, (unsigned int)middle);
+        if (strcmp(record->path, path) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low < (int)utarray_len(journal->records)
+        && strcmp(((struct journal_record*)utarray_eltptr(journal->records, (unsigned int)low))->path, path) == 0) {
+        return low;
+    }
+    return -1;
+}
+
+// Hashes what is on disk up to the resume points of path, the last one still matching wins
+static uint64_t journal_verify_prefix(struct journal_sink* journal, const char* path, int first, uint64_t size) {
+    struct journal_record* record;
+    mbedtls_sha1_context sha1, finished;
+    uint8_t hash[20];
+    uint8_t* buffer;
+    uint64_t position = 0, verified = 0;
+    size_t chunk;
+    unsigned int i;
+    FILE* input = fopen(path, "rb");
+
+    buffer = (uint8_t*)malloc(1024 * 1024);
+    if (input == NULL || buffer == NULL) {
+        if (input != NULL) {
+            fclose(input);
+        }
+        free(buffer);
+        return 0;
+    }
+
+    mbedtls_sha1_init(&sha1);
+    mbedtls_sha1_init(&finished);
+    mbedtls_sha1_starts(&sha1);
+    for (i = (unsigned int)first; i < utarray_len(journal->records); i++) {
+        record = (struct journal_record*)utarray_eltptr(journal->records, i);
+        if (strcmp(record->path, journal_relative(journal, path)) != 0) {
+            break;
+        }
+        if (record->type != 'P' || record->bytes >= size || record->bytes <= verified) {
+            continue;
+        }
+
+        while (position < record->bytes) {
+            chunk = (record->bytes - position > 1024 * 1024) ? 1024 * 1024 : (size_t)(record->bytes - position);
+            if (fread(buffer, 1, chunk, input) != chunk) {
+                break;
+            }
+            mbedtls_sha1_update(&sha1, buffer, chunk);
+            position += chunk;
+        }
+        if (position < record->bytes) {
+            break;
+        }
+        mbedtls_sha1_clone(&finished, &sha1);
+        mbedtls_sha1_finish(&finished, hash);
+        if (memcmp(hash, record->hash, 20) != 0) {
+            break;
+        }
+        verified = record->bytes;
+        mbedtls_sha1_clone(&(journal->resume_sha1), &sha1);
+    }
+    mbedtls_sha1_free(&finished);
+    mbedtls_sha1_free(&sha1);
+    free(buffer);
+    fclose(input);
+    return verified;
+}
+
+static int64_t journal_completed(struct output_sink* sink, const char* path, uint64_t size) {
+    struct journal_sink* journal = (struct journal_sink*)sink->data;
+    struct journal_record* record;
+    struct stat info;
+    const char* relative = journal_relative(journal, path);
+    int first = journal_find(journal, relative);
+    unsigned int i;
+
+    journal->resume_bytes = 0;
+    journal->resume_path[0] = '\0';
+    if (first < 0) {
+        return -1;
+    }
+
+    // Finished files are trusted as long as their size is right, rehashing everything would take as long as extracting
+    for (i = (unsigned int)first; i < utarray_len(journal->records); i++) {
+        record = (struct journal_record*)utarray_eltptr(journal->records, i);
+        if (strcmp(record->path, relative) != 0) {
+            break;
+        }
+        if (record->type == 'F' && record->bytes == size && stat(path, &info) == 0 && (uint64_t)info.st_size == size) {
+            return (int64_t)size;
+        }
+    }
+
+    journal->resume_bytes = journal_verify_prefix(journal, path, first, size);
+    if (journal->resume_bytes == 0) {
+        return -1;
+    }
+    strncpy(journal->resume_path, path, 1023);
+    journal->resume_path[1023] = '\0';
+    return (int64_t)journal->resume_bytes;
+}
+
+static int journal_make_directory(struct output_sink* sink, const char* path) {
+    struct journal_sink* journal = (struct journal_sink*)sink->data;
+    return journal->inner->make_directory(journal->inner, path);
+}
+
+static void* journal_open(struct output_sink* sink, const char* path, uint64_t size) {
+    struct journal_sink* journal = (struct journal_sink*)sink->data;
+    struct journal_output* output = (struct journal_output*)calloc(1, sizeof(struct journal_output));
+
+    if (output == NULL) {
+        return NULL;
+    }
+    mbedtls_sha1_init(&(output->sha1));
+    if (journal->resume_bytes > 0 && strcmp(journal->resume_path, path) == 0) {
+        output->inner = journal->inner->reopen(journal->inner, path, size);
+        output->written = journal->resume_bytes;
+        mbedtls_sha1_clone(&(output->sha1), &(journal->resume_sha1));
+    } else {
+        output->inner = journal->inner->open(journal->inner, path, size);
+        mbedtls_sha1_starts(&(output->sha1));
+    }
+    journal->resume_bytes = 0;
+    journal->resume_path[0] = '\0';
+    if (output->inner == NULL) {
+        mbedtls_sha1_free(&(output->sha1));
+        free(output);
+        return NULL;
+    }
+
+    strncpy(output->path, journal_relative(journal, path), 1023);
+    output->path[1023] = '\0';
+    output->size = size;
+    output->next_checkpoint = output->written + JOURNAL_CHECKPOINT_SIZE;
+    output->hashing = 1;
+    return output;
+}
+
+static int journal_write_at(struct output_sink* sink, void* handle, const uint8_t* data, size_t size, uint64_t offset) {
+    struct journal_sink* journal = (struct journal_sink*)sink->data;
+    struct journal_output* output = (struct journal_output*)handle;
+    uint8_t hash[20];
+    mbedtls_sha1_context checkpoint;
+    int result;
+
+    if (offset != output->written) {
+        output->hashing = 0;
+    }
+    if (output->hashing) {
+        mbedtls_sha1_update(&(output->sha1), data, size);
+        output->written += size;
+    }
+    result = journal->inner->write_at(journal->inner, output->inner, data, size, offset);
+    if (result != 0) {
+        output->hashing = 0;
+    }
+
+    // A resume point is only recorded once everything before it is on disk
+    if (output->hashing && output->written >= output->next_checkpoint && output->written < output->size) {
+        if (journal->inner->sync(journal->inner, output->inner) == 0) {
+            mbedtls_sha1_init(&checkpoint);
+            mbedtls_sha1_clone(&checkpoint, &(output->sha1));
+            mbedtls_sha1_finish(&checkpoint, hash);
+            mbedtls_sha1_free(&checkpoint);
+            journal_append(journal, 'P', output->written, hash, output->path);
+        }
+        output->next_checkpoint = output->written + JOURNAL_CHECKPOINT_SIZE;
+    }
+    return result;
+}
+
+// Records the finished files once the sink wrote all of them, if it failed they are left out
+static void journal_flush_pending(struct journal_sink* journal, int written) {
+    struct journal_record* record;
+
+    if (written) {
+        for (record = (struct journal_record*)utarray_front(journal->pending); record != NULL; record = (struct journal_record*)utarray_next(journal->pending, record)) {
+            journal_append(journal, 'F', record->bytes, record->hash, record->path);
+        }
+    }
+    utarray_clear(journal->pending);
+    journal->pending_bytes = 0;
+}
+
+static int journal_close(struct output_sink* sink, void* handle) {
+    struct journal_sink* journal = (struct journal_sink*)sink->data;
+    struct journal_output* output = (struct journal_output*)handle;
+    struct journal_record record;
+    int result = journal->inner->close(journal->inner, output->inner);
+
+    if (result == 0 && output->hashing && output->written == output->size) {
+        record.path = output->path;
+        record.type = 'F';
+        record.bytes = output->size;
+        mbedtls_sha1_finish(&(output->sha1), record.hash);
+        utarray_push_back(journal->pending, &record);
+        journal->pending_bytes += output->size;
+    }
+    mbedtls_sha1_free(&(output->sha1));
+    free(output);
+
+    if (utarray_len(journal->pending) >= JOURNAL_BATCH_FILES || journal->pending_bytes >= JOURNAL_CHECKPOINT_SIZE) {
+        journal_flush_pending(journal, journal->inner->sync(journal->inner, NULL) == 0);
+    }
+    return result;
+}
+
+static int journal_sync(struct output_sink* sink, void* handle) {
+    struct journal_sink* journal = (struct journal_sink*)sink->data;
+    return journal->inner->sync(journal->inner, (handle != NULL) ? ((struct journal_output*)handle)->inner : NULL);
+}
+
+static int journal_link(struct output_sink* sink, const char* source, const char* path, int hardlink) {
+    struct journal_sink* journal = (struct journal_sink*)sink->data;
+
+    if (journal->inner->link == NULL) {
+        return -1;
+    }
+    return journal->inner->link(journal->inner, source, path, hardlink);
+}
+
+static int journal_finish(struct output_sink* sink) {
+    struct journal_sink* journal = (struct journal_sink*)sink->data;
+    int result = sink_finish(journal->inner);
+
+    journal_flush_pending(journal, result == 0);
+    return result;
+}
+
+static void journal_free(struct output_sink* sink) {
+    struct journal_sink* journal = (struct journal_sink*)sink->data;
+
+    fclose(journal->file);
+    utarray_free(journal->records);
+    utarray_free(journal->pending);
+    mbedtls_sha1_free(&(journal->resume_sha1));
+    sink_free(journal->inner);
+    free(journal);
+    free(sink);
+}
+
+int journal_set_identity(struct output_sink* sink, const char* identity) {
+    struct journal_sink* journal = (struct journal_sink*)sink->data;
+
+    if (strcmp(journal->identity, identity) == 0) {
+        return 0;
+    }
+    // Files of another image only look finished, everything is extracted again
+    if (utarray_len(journal->records) > 0) {
+        fprintf(stderr, "WARNING: %s belongs to another image, extracting everything again\n", journal->path);
+        utarray_clear(journal->records);
+    }
+    fclose(journal->file);
+    journal->file = fopen(journal->path, "wb");
+    if (journal->file == NULL) {
+        fprintf(stderr, "Error: Could not open the journal %s\n", journal->path);
+        return -1;
+    }
+    strncpy(journal->identity, identity, JOURNAL_IDENTITY_LENGTH);
+    journal->identity[JOURNAL_IDENTITY_LENGTH] = '\0';
+    fprintf(journal->file, "I %s\n", journal->identity);
+    fflush(journal->file);
+    return 0;
+}
+
+struct output_sink* sink_create_journal(struct output_sink* inner, const char* outputdir) {
+    return sink_create_journal_named(inner, outputdir, JOURNAL_FILE_NAME);
+}
+
+struct output_sink* sink_create_journal_named(struct output_sink* inner, const char* outputdir, const char* name) {
+    struct output_sink* sink;
+    struct journal_sink* journal;
+    char path[1024];
+    FILE* input;
+
+    if (inner == NULL) {
+        return NULL;
+    }
+    if (inner->reopen == NULL || inner->sync == NULL) {
+        sink_free(inner);
+        return NULL;
+    }
+    if (makedir(outputdir) != 0 && errno != EEXIST) {
+        sink_free(inner);
+        return NULL;
+    }
+
+    sink = (struct output_sink*)calloc(1, sizeof(struct output_sink));
+    journal = (struct journal_sink*)calloc(1, sizeof(struct journal_sink));
+    if (sink == NULL || journal == NULL) {
+        free(sink);
+        free(journal);
+        sink_free(inner);
+        return NULL;
+    }
+    strncpy(journal->root, outputdir, sizeof(journal->root) - 1);
+    journal->root_length = strlen(journal->root);
+    while (journal->root_length > 1 && journal->root[journal->root_length - 1] == '/') {
+        journal->root[--(journal->root_length)] = '\0';
+    }
+    utarray_new(journal->records, &journal_record_icd);
+    utarray_new(journal->pending, &journal_record_icd);
+    mbedtls_sha1_init(&(journal->resume_sha1));
+
+    snprintf(path, sizeof(path), "%s/%s", journal->root, name);
+    strcpy(journal->path, path);
+    input = fopen(path, "rb");
+    if (input != NULL) {
+        journal_load(journal, input);
+        fclose(input);
+    }
+    journal->file = fopen(path, "ab");
+    if (journal->file == NULL) {
+        fprintf(stderr, "Error: Could not open the journal %s\n", path);
+        utarray_free(journal->records);
+        utarray_free(journal->pending);
+        free(journal);
+        free(sink);
+        sink_free(inner);
+        return NULL;
+    }
+
+    journal->inner = inner;
+    sink->data = journal;
+    sink->uses_stdout = inner->uses_stdout;
+    sink->writes_behind = inner->writes_behind;
+    sink->make_directory = journal_make_directory;
+    sink->open = journal_open;
+    sink->write_at = journal_write_at;
+    sink->close = journal_close;
+    sink->finish = journal_finish;
+    sink->completed = journal_completed;
+    sink->sync = journal_sync;
+    sink->link = journal_link;
+    sink->free = journal_free;
+    return sink;
+}
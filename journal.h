@@ -0,0 +1,26 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+#include "sink.h"
+
+// Name of the journal inside the output directory
+#define JOURNAL_FILE_NAME ".wudecrypt-journal"
+// Large files get a resume point after about this many bytes
+#define JOURNAL_CHECKPOINT_SIZE (64 * 1024 * 1024)
+// Finished files are recorded in batches of this many files or JOURNAL_CHECKPOINT_SIZE bytes,
+// once their data was handed to the filesystem
+#define JOURNAL_BATCH_FILES 256
+// Longest image identity a journal keeps
+#define JOURNAL_IDENTITY_LENGTH 64
+
+// Wraps a sink that supports reopen() and sync() and records finished files and resume points of
+// large files in an append-only journal in outputdir. Outputs an earlier run already finished are
+// skipped and partial ones continue at their last resume point whose data is still intact.
+// Returns NULL if inner can't be resumed or the journal can't be opened, inner is freed with the result.
+struct output_sink* sink_create_journal(struct output_sink* inner, const char* outputdir);
+// Ties the journal to the image identified by identity, e.g. wud_image_identity() in hex. If earlier runs
+// recorded another image or none, their records are dropped and every file is extracted again. Call it
+// before the first output is opened. Returns 0 on success.
+int journal_set_identity(struct output_sink* journal, const char* identity);
+// The same with the journal called name, so several workers can write to one output directory
+struct output_sink* sink_create_journal_named(struct output_sink* inner, const char* outputdir, const char* name);
+#endif // _JOURNAL_H_
@@ -2,280 +2,441 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 #include "config.h"
-#include "utarray.h"
-#include "struct.h"
 #include "functions.h"
-#include "aes.h"
+#include "dump.h"
+#include "journal.h"
+#include "progress.h"
+#include "record.h"
+#include "stats.h"
+#include "trace.h"
+#include "store.h"
+#include "verify.h"
+#include "wudecrypt.h"
+
+static void print_usage(const char* program) {
+    printf("Usage: %s [options] <disc.wud> <outputdir> <commonkey.bin> <disckey.bin> [<partition_identifier>]\n", program);
+    printf("       %s --dump [--null] <disc.wud> <outputdir> <commonkey.bin> <disckey.bin> [<partition_identifier>]\n", program);
+    printf("       %s --usage [--trim <trimmed.wud>] <disc.wud> <commonkey.bin> <disckey.bin>\n", program);
+    printf("       %s --verify [--verify-level <0-3>] [--threads <count>] <disc.wud> <commonkey.bin> <disckey.bin> [<partition_identifier>]\n", program);
+    printf("Options:\n");
+    printf("  -v, --verbose  List every extracted file instead of showing the progress\n");
+    printf("  --null    Decrypt everything but discard the output, useful for benchmarking\n");
+    printf("  --tar     Write a tar archive to stdout instead of files, <outputdir> becomes the path inside it\n");
+    printf("  --sparse  Don't write all-zero regions, extracted files become sparse\n");
+    printf("  --store <dir>  Share files between discs through a content store, files found there aren't decrypted again\n");
+    printf("  --delta <dir>  Reuse unchanged files of an earlier extraction (with an index) instead of decrypting them\n");
+    printf("  --index   Write an index of content keys (%s) into <outputdir> for later --delta runs\n", STORE_INDEX_NAME);
+    printf("  --dump    Write each partition decrypted as a single sparse image (<name>%s) with its layout (<name>%s)\n", DUMP_IMAGE_SUFFIX, DUMP_LAYOUT_SUFFIX);
+    printf("  --usage   Only report how much of the image the partitions and their files use\n");
+    printf("  --trim <trimmed.wud>  With --usage, also write a sparse copy of the image holding only the used sectors\n");
+    printf("  --verify  Only check every hashed block, bad blocks and the files they affect are listed on stdout as JSON lines\n");
+    printf("  --verify-level <0-3>  Check the data against H0 only (0) or also the H1 (1), H2 (2) and H3 (3, default) levels of the hash tree\n");
+    printf("  --threads <count>  Workers for --verify, all cores by default\n");
+    printf("  --stats   Print the time spent reading, decrypting, hashing, writing and on metadata per thread at the end\n");
+    printf("  --stats-json <file>  Also write these measurements as JSON to <file>, - for stdout\n");
+    printf("  --record-io <file>  Log every read of the image (offset, length, time, thread) to <file> for wudreplay\n");
+    printf("  --shard <k>/<n>  Extract only the k-th of n parts of about the same size, for n workers sharing one output directory\n");
+    printf("  --trace <file>  Record a timeline of every read, decrypt, hash, write, file and partition per thread to <file> (Chrome trace format)\n");
+    printf("Files are written to <outputdir> together with a journal (%s), running the same\n", JOURNAL_FILE_NAME);
+    printf("command again skips finished files and continues interrupted ones.\n");
+}
 
 int main(int argc, char* argv[]) {
-    int i, j, c;
-    uint32_t partition_count, current_ft_size, current_dir_index;
-    uint64_t cluster_start, entries_offset, total_entries, name_table_offset, current_entry_offset, current_name_offset;
-    char* gameserial;
-    char* gameversion;
-    char* gameregion;
-    char* sysversion;
-    char partition_hash_name[19];
-    char calculated_name[19];
-    char outputdir[1024];
+    uint32_t i, c, partition_count;
+    int arg;
+    int positional_count = 0;
+    char* positional[5];
+    struct output_sink* sink = NULL;
+    int files = 1;
+    const char* store = NULL;
+    const char* previous = NULL;
+    int index = 0;
+    int dump = 0;
+    int verify = 0;
+    int usage = 0;
+    const char* trimmed = NULL;
+    int failed = 0;
+    int stats = 0;
+    int verbose = 0;
+    uint64_t total_bytes;
+    uint32_t file_count, f;
+    const char* stats_json = NULL;
+    const char* trace = NULL;
+    const char* record_io = NULL;
+    uint32_t shard = 0, shard_count = 0;
+    uint64_t shard_bytes;
+    uint32_t shard_files;
+    char journal_name[64];
+    uint8_t identity[20];
+    char identity_hex[41];
+    struct image_source* image;
+    struct image_source* recorded;
+    FILE* stats_output;
+    int verify_level = VERIFY_LEVEL_H3;
+    uint32_t threads = 0;
+    uint64_t bad_blocks, total_bad_blocks = 0;
+    int64_t dumped;
+    uint64_t reused, reused_bytes, added;
+    FILE* info = stdout;
     uint8_t* commonkey;
     uint8_t* disckey;
-    uint8_t* partition_toc;
-    uint8_t* partition_block;
-    uint8_t* decrypted_data;
-    uint8_t* decrypted_data2;
-    uint8_t* titleid;
-    uint8_t raw_entry[16];
-    struct partition_entry* entry;
-    struct partition* partitions;
-    struct volume* volumes;
-    struct titlekey* titlekey;
-    struct titlekey* newtitlekey;
-    UT_array* titlekeys;
-    FILE* wudimage;
-
-    // Initialize array right at the start
-    utarray_new(titlekeys, &titlekey_icd);
-
-    printf("WUDecrypt v%s by makikatze\n", APP_VERSION);
-    printf("Licensed under GNU AGPLv3\n\n");
-
-    if (argc < 5 || argc > 6) {
-        printf("Usage: %s <disc.wud> <outputdir> <commonkey.bin> <disckey.bin> [<partition_identifier>]\n", argv[0]);
+    const uint8_t* partitionkey;
+    const char* partitionname;
+    wud_context* context;
+
+    // Options start with "--" and may appear anywhere, everything else is positional
+    for (arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-v") == 0 || strcmp(argv[arg], "--verbose") == 0) {
+            verbose = 1;
+        } else if (strncmp(argv[arg], "--", 2) != 0) {
+            if (positional_count >= 5) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            positional[positional_count++] = argv[arg];
+        } else if (strcmp(argv[arg], "--null") == 0 || strcmp(argv[arg], "--tar") == 0 || strcmp(argv[arg], "--sparse") == 0) {
+            if (sink != NULL) {
+                fprintf(stderr, "Only one of --null, --tar and --sparse can be used\n");
+                exit(EXIT_FAILURE);
+            }
+            if (strcmp(argv[arg], "--null") == 0) {
+                sink = sink_create_null();
+                files = 0;
+            } else if (strcmp(argv[arg], "--tar") == 0) {
+                sink = sink_create_tar(stdout);
+                files = 0;
+            } else {
+                sink = sink_create_filesystem(SINK_FILESYSTEM_SPARSE);
+            }
+            if (sink == NULL) {
+                fprintf(stderr, "Could not allocate enough memory for the output\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[arg], "--store") == 0 && arg + 1 < argc) {
+            store = argv[++arg];
+            index = 1;
+        } else if (strcmp(argv[arg], "--delta") == 0 && arg + 1 < argc) {
+            previous = argv[++arg];
+            index = 1;
+        } else if (strcmp(argv[arg], "--index") == 0) {
+            index = 1;
+        } else if (strcmp(argv[arg], "--dump") == 0) {
+            dump = 1;
+        } else if (strcmp(argv[arg], "--usage") == 0) {
+            usage = 1;
+        } else if (strcmp(argv[arg], "--trim") == 0 && arg + 1 < argc) {
+            trimmed = argv[++arg];
+            usage = 1;
+        } else if (strcmp(argv[arg], "--verify") == 0) {
+            verify = 1;
+        } else if (strcmp(argv[arg], "--verify-level") == 0 && arg + 1 < argc) {
+            verify_level = atoi(argv[++arg]);
+            if (verify_level < VERIFY_LEVEL_H0 || verify_level > VERIFY_LEVEL_H3) {
+                fprintf(stderr, "--verify-level has to be between %d and %d\n", VERIFY_LEVEL_H0, VERIFY_LEVEL_H3);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[arg], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[arg], "--stats-json") == 0 && arg + 1 < argc) {
+            stats_json = argv[++arg];
+        } else if (strcmp(argv[arg], "--record-io") == 0 && arg + 1 < argc) {
+            record_io = argv[++arg];
+        } else if (strcmp(argv[arg], "--trace") == 0 && arg + 1 < argc) {
+            trace = argv[++arg];
+        } else if (strcmp(argv[arg], "--shard") == 0 && arg + 1 < argc) {
+            if (sscanf(argv[++arg], "%u/%u", &shard, &shard_count) != 2 || shard < 1 || shard > shard_count || shard_count > WUD_SHARD_MAX) {
+                fprintf(stderr, "--shard takes <k>/<n> with k from 1 to n and n up to %d\n", WUD_SHARD_MAX);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+            threads = (uint32_t)strtoul(argv[++arg], NULL, 10);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[arg]);
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Counting starts before anything is read, so the file tables are included
+    if (stats || stats_json != NULL) {
+        if (stats_json != NULL && strcmp(stats_json, "-") == 0 && sink != NULL && sink->uses_stdout) {
+            fprintf(stderr, "--stats-json can't write to stdout when the output goes there\n");
+            exit(EXIT_FAILURE);
+        }
+        stats_enable();
+    }
+    if (trace != NULL && trace_open(trace) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    // Images are written at scattered offsets and need no journal
+    if (dump) {
+        if (verify || index || (sink != NULL && sink->uses_stdout)) {
+            fprintf(stderr, "--dump can't be combined with --tar, --verify, --store, --delta or --index\n");
+            exit(EXIT_FAILURE);
+        }
+        if (sink == NULL) {
+            sink = sink_create_filesystem(SINK_FILESYSTEM_SPARSE);
+            if (sink == NULL) {
+                fprintf(stderr, "Could not allocate enough memory for the output\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        files = 0;
+    }
+    // Verifying and measuring take no output directory, the other arguments keep their places
+    if (verify || usage) {
+        if (sink != NULL || index || dump || (verify && usage) || positional_count < 3 || positional_count > 4) {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        for (arg = positional_count; arg > 1; arg--) {
+            positional[arg] = positional[arg - 1];
+        }
+        positional[1] = NULL;
+        positional_count++;
+        files = 0;
+        info = stderr;
+        if (threads == 0) {
+#ifndef _WIN32
+            threads = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+#else
+            threads = 1;
+#endif
+        }
+    }
+    if (positional_count < 4) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    // Workers share the output directory, but each has its own journal and the index would be incomplete
+    if (shard_count > 0 && (dump || verify || usage || index)) {
+        fprintf(stderr, "--shard can't be combined with --dump, --verify, --usage, --store, --delta or --index\n");
         exit(EXIT_FAILURE);
     }
+    // Extracting to files is journaled, so an interrupted run can be continued
+    if (files) {
+        if (sink == NULL) {
+            sink = sink_create_filesystem(0);
+        }
+        if (shard_count > 0) {
+            snprintf(journal_name, sizeof(journal_name), "%s.%u-of-%u", JOURNAL_FILE_NAME, shard, shard_count);
+            sink = sink_create_journal_named(sink, positional[1], journal_name);
+        } else {
+            sink = sink_create_journal(sink, positional[1]);
+        }
+        if (sink == NULL) {
+            fprintf(stderr, "Error: Could not set up the output directory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // stdout carries the archive, everything else goes to stderr
+    if (sink != NULL && sink->uses_stdout) {
+        info = stderr;
+    }
+
+    fprintf(info, "WUDecrypt v%s by makikatze\n", APP_VERSION);
+    fprintf(info, "Licensed under GNU AGPLv3\n\n");
 
-    commonkey = loadKey(argv[3]);
+    commonkey = loadKey(positional[2]);
     if (commonkey == NULL) {
         fprintf(stderr, "Error while loading common key\n");
         exit(EXIT_FAILURE);
     }
 
-    disckey = loadKey(argv[4]);
+    disckey = loadKey(positional[3]);
     if (disckey == NULL) {
         fprintf(stderr, "Error while loading disc key\n");
         exit(EXIT_FAILURE);
     }
 
-    wudimage = fopen(argv[1], "r");
-    if (wudimage == NULL) {
+    // "-" reads the image from stdin in a single pass
+    image = (strcmp(positional[0], "-") == 0) ? image_open_stream(stdin) : image_open(positional[0]);
+    if (image == NULL) {
         fprintf(stderr, "Could not open WUD image\n");
         exit(EXIT_FAILURE);
     }
-
-    gameserial = (char*)readFileOffset(0, sizeof(char), GAME_SERIAL_LENGTH, wudimage);
-    if (gameserial == NULL) {
-        fprintf(stderr, "Couldn't read game serial from image\n");
-        fclose(wudimage);
-        exit(EXIT_FAILURE);
-    }
-    if (memcmp(gameserial, MAGIC_BYTES, 4) != 0) {
-        fprintf(stderr, "WARNING: Most probably no valid WUD image\nTrying to continue anyways, although errors are expected!\n\n");
+    // Wrapped before anything is read, so the file tables are part of the recording
+    if (record_io != NULL) {
+        recorded = image_record(image, record_io);
+        if (recorded == NULL) {
+            image_close(image);
+            exit(EXIT_FAILURE);
+        }
+        image = recorded;
     }
-
-    if (fseek(wudimage, 1, SEEK_CUR) != 0) {
-        fprintf(stderr, "Error: Could not seek in WUD image\n");
-        fclose(wudimage);
+    context = wud_open_source(image, commonkey, disckey);
+    if (context == NULL) {
         exit(EXIT_FAILURE);
     }
-    gameversion = (char*)readFile(sizeof(char), GAME_VER_LENGTH, wudimage);
-    if (gameversion == NULL) {
-        fprintf(stderr, "Couldn't read game version from image\n");
-        fclose(wudimage);
+    // Keying a file reads ahead within it, verifying reads from several threads and the usage map has
+    // to know the image size, a stream can do none of these
+    if ((index || verify || usage || shard_count > 0) && strcmp(positional[0], "-") == 0) {
+        fprintf(stderr, "--store, --delta, --index, --usage, --verify and --shard can't be used with an image read from stdin\n");
         exit(EXIT_FAILURE);
     }
-
-    if (fseek(wudimage, 1, SEEK_CUR) != 0) {
-        fprintf(stderr, "Error: Could not seek in WUD image\n");
-        fclose(wudimage);
-        exit(EXIT_FAILURE);
+    // A journal only holds for the image it was written for
+    if (files && strcmp(positional[0], "-") != 0) {
+        if (wud_image_identity(context, identity) != 0) {
+            fprintf(stderr, "Error: Could not read the image\n");
+            exit(EXIT_FAILURE);
+        }
+        for (c = 0; c < 20; c++) {
+            sprintf(identity_hex + (c * 2), "%02x", identity[c]);
+        }
+        if (journal_set_identity(sink, identity_hex) != 0) {
+            exit(EXIT_FAILURE);
+        }
     }
-    sysversion = (char*)readFile(sizeof(char), SYS_VER_LENGTH, wudimage);
-    if (sysversion == NULL) {
-        fprintf(stderr, "Couldn't read system version from image\n");
-        fclose(wudimage);
+    // Verification skips what the map marks as padding
+    if ((usage || verify) && wud_build_usage(context) != 0) {
+        fprintf(stderr, "Error: Could not map the used sectors of the image\n");
         exit(EXIT_FAILURE);
     }
-    gameregion = (char*)readFile(sizeof(char), REGION_LENGTH, wudimage);
-    if (gameregion == NULL) {
-        fprintf(stderr, "Couldn't read game region from image\n");
-        fclose(wudimage);
+    if ((store != NULL && wud_set_store(context, store) != 0)
+        || (previous != NULL && wud_add_previous(context, previous) != 0)
+        || (index && wud_write_index(context) != 0)) {
         exit(EXIT_FAILURE);
     }
 
     // Print information about game
-    printf("Game Serial:    %.*s\n", (int)GAME_SERIAL_LENGTH, gameserial);
-    printf("Game Revision:  %.*s\n", (int)GAME_VER_LENGTH, gameversion);
-    printf("System Version: %c.%c.%c\n", sysversion[0], sysversion[1], sysversion[2]);
-    printf("Game Region:    %.*s\n\n", (int)REGION_LENGTH, gameregion);
-
-    partition_toc = readEncryptedOffset(disckey, WIIU_DECRYPTED_AREA_OFFSET, 0x8000, wudimage);
-    if (partition_toc == NULL || memcmp(partition_toc, DECRYPTED_AREA_SIGNATURE, 4) != 0) {
-        fprintf(stderr, "Couldn't decrypt partition table\n");
-        fclose(wudimage);
-        exit(EXIT_FAILURE);
-    }
-
-    partition_count = bytesToUIntBE(partition_toc + 0x1C);
-    printf("Partition count: %d\n", partition_count);
-
-    partitions = (struct partition*)malloc(partition_count * sizeof(struct partition));
-    volumes = (struct volume*)malloc(partition_count * sizeof(struct volume));
-    for (i = 0; i < partition_count; i++) {
-        memcpy(partitions[i].identifier, partition_toc + PARTITION_TOC_OFFSET + (i * PARTITION_TOC_ENTRY_SIZE), 0x19);
-        memcpy(partitions[i].name, partition_toc + PARTITION_TOC_OFFSET + (i * PARTITION_TOC_ENTRY_SIZE), PARTITION_TOC_ENTRY_SIZE);
-        partitions[i].offset = (uint64_t)bytesToUIntBE(partition_toc + PARTITION_TOC_OFFSET + (i * PARTITION_TOC_ENTRY_SIZE) + 0x20);
-        partitions[i].offset *= 0x8000;
-        partitions[i].offset -= 0x10000;
-
-        printf("\nPartition %d:\n", i + 1);
-        printf("\tPartition ID:     %.*s\n", 0x19, partitions[i].identifier);
-        printf("\tPartition Name:   %s\n", partitions[i].name);
-        printf("\tPartition Offset: 0x%llX\n", (unsigned long long int)partitions[i].offset);
-
-        strncpy(partition_hash_name, partitions[i].name, 18);
-        partition_hash_name[18] = '\0';
-        for (titlekey = (struct titlekey*)utarray_front(titlekeys); titlekey != NULL; titlekey = (struct titlekey*)utarray_next(titlekeys, titlekey)) {
-            if (strncmp(titlekey->name, partition_hash_name, 18) == 0) {
-                break;
-            }
+    fprintf(info, "Game Serial:    %s\n", wud_game_serial(context));
+    fprintf(info, "Game Revision:  %s\n", wud_game_revision(context));
+    fprintf(info, "System Version: %s\n", wud_system_version(context));
+    fprintf(info, "Game Region:    %s\n\n", wud_game_region(context));
+
+    partition_count = wud_partition_count(context);
+    fprintf(info, "Partition count: %d\n", partition_count);
+    if (shard_count > 0) {
+        if (wud_set_shard(context, shard - 1, shard_count) != 0) {
+            fprintf(stderr, "Error: Could not split the image into %u shards\n", shard_count);
+            exit(EXIT_FAILURE);
         }
-        if (strncmp((char*)partitions[i].name, "SI", 2) == 0
-            || strncmp((char*)partitions[i].name, "UP", 2) == 0
-            || strncmp((char*)partitions[i].name, "GI", 2) == 0
-            || titlekey != NULL) {
-            if (titlekey == NULL) {
-                memcpy(partitions[i].key, disckey, 16);
-                memset(partitions[i].iv, 0, 16);
-            } else {
-                memcpy(partitions[i].key, titlekey->decryptedKey, 16);
-                memcpy(partitions[i].iv, titlekey->iv, 16);
-            }
-
-            printf("\tPartition Key:    ");
-            for (c = 0; c < 12; c++) {
-                printf("%02X", partitions[i].key[c]);
-            }
-            printf("********\n\n");
-
-            current_ft_size = 0x8000;
-
-            partition_block = readEncryptedOffset(partitions[i].key, WIIU_DECRYPTED_AREA_OFFSET + partitions[i].offset, current_ft_size, wudimage);
-
-            if (memcmp(partition_block, PARTITION_FILE_TABLE_SIGNATURE, 4) != 0) {
-                fprintf(stderr, "Decrypted partition %s has no valid file table signature\n", partitions[i].name);
-                fclose(wudimage);
-                exit(EXIT_FAILURE);
-            }
-
-            partitions[i].cluster_count = bytesToUIntBE(partition_block + 8);
-            partitions[i].clusters = (struct partition_cluster*)malloc(partitions[i].cluster_count * sizeof(struct partition_cluster));
-            for (c = 0; c < partitions[i].cluster_count; c++) {
-                cluster_start = (uint64_t)(bytesToUIntBE(partition_block + 0x20 + (0x20 * c))) * 0x8000;
-                partitions[i].clusters[c].unknown1 = bytesToUIntBE(partition_block + 0x20 + (0x20 * c) + 0x10);
-                partitions[i].clusters[c].unknown2 = bytesToUIntBE(partition_block + 0x20 + (0x20 * c) + 0x14);
-
-                if (cluster_start > 0) {
-                    partitions[i].clusters[c].offset = cluster_start - 0x8000;
-                } else {
-                    partitions[i].clusters[c].offset = 0;
+        shard_files = 0;
+        shard_bytes = 0;
+        for (i = 0; i < partition_count; i++) {
+            file_count = wud_file_count(context, i);
+            for (f = 0; f < file_count; f++) {
+                if (wud_in_shard(context, wud_file(context, i, f))) {
+                    shard_files++;
+                    shard_bytes += wud_file_size(wud_file(context, i, f));
                 }
-
-                partitions[i].clusters[c].size = (uint64_t)(bytesToUIntBE(partition_block + 0x20 + (0x20 * c) + 4)) * 0x8000;
             }
+        }
+        fprintf(info, "Shard %u of %u: %u files, %llu MiB\n", shard, shard_count, shard_files, (unsigned long long int)(shard_bytes / (1024 * 1024)));
+    }
 
-            entries_offset = ((uint64_t)bytesToUIntBE(partition_block + 4) * bytesToUIntBE(partition_block + 8)) + 0x20;
-
-            memcpy(raw_entry, partition_block + entries_offset, 16);
-            entry = create_partition_entry(raw_entry);
-
-            total_entries = entry->last_row_in_dir;
-            name_table_offset = entries_offset + (total_entries * 0x10);
-
-            strncpy(entry->entry_name, (char*)(partition_block + name_table_offset + entry->name_offset), 0x200);
-
-            utarray_new(partitions[i].entries, &partition_entry_icd);
-            utarray_push_back(partitions[i].entries, entry);
-
-            for(j = 1; j < total_entries; j++) {
-                current_entry_offset = entries_offset + (j * 0x10);
-
-                while((current_entry_offset + 0x10) > current_ft_size) {
-                    current_ft_size += 0x8000;
-                    free(partition_block);
-                    partition_block = readEncryptedOffset(partitions[i].key, WIIU_DECRYPTED_AREA_OFFSET + partitions[i].offset, current_ft_size, wudimage);
-                }
-
-                memcpy(raw_entry, partition_block + current_entry_offset, 16);
-                entry = create_partition_entry(raw_entry);
-
-                current_name_offset = name_table_offset + entry->name_offset;
-
-                while((current_name_offset + 0x200) > current_ft_size) {
-                    current_ft_size += 0x8000;
-                    free(partition_block);
-                    partition_block = readEncryptedOffset(partitions[i].key, WIIU_DECRYPTED_AREA_OFFSET + partitions[i].offset, current_ft_size, wudimage);
-                }
-
-                strncpy(entry->entry_name, (char*)(partition_block + current_name_offset), 0x200);
-
-                utarray_push_back(partitions[i].entries, entry);
+    for (i = 0; i < partition_count; i++) {
+        partitionname = wud_partition_name(context, i);
+        fprintf(info, "\nPartition %d:\n", i + 1);
+        fprintf(info, "\tPartition ID:     %.*s\n", 0x19, partitionname);
+        fprintf(info, "\tPartition Name:   %s\n", partitionname);
+        fprintf(info, "\tPartition Offset: 0x%llX\n", (unsigned long long int)wud_partition_offset(context, i));
+
+        partitionkey = wud_partition_key(context, i);
+        if (partitionkey != NULL) {
+            fprintf(info, "\tPartition Key:    ");
+            for (c = 0; c < 12; c++) {
+                fprintf(info, "%02X", partitionkey[c]);
             }
-
-            if (strncmp((char*)partitions[i].name, "SI", 2) == 0
-                || strncmp((char*)partitions[i].name, "GI", 2) == 0) {
-                for (entry = (struct partition_entry*)utarray_front(partitions[i].entries); entry != NULL; entry = (struct partition_entry*)utarray_next(partitions[i].entries, entry)) {
-                    if (entry->is_directory != 1 && strincmp(entry->entry_name, TITLE_TICKET_FILE, strlen(TITLE_TICKET_FILE)) == 0) {
-                        decrypted_data = readVolumeEncryptedOffset(partitions[i].key, partitions[i].offset, partitions[i].clusters[entry->starting_cluster].offset, entry->offset_in_cluster + 0x1BF, 0x10, wudimage);
-                        titleid = readVolumeEncryptedOffset(partitions[i].key, partitions[i].offset, partitions[i].clusters[entry->starting_cluster].offset, entry->offset_in_cluster + 0x1DC, 8, wudimage);
-
-                        // Using raw_entry as iv here because its size is suitable
-                        memset(raw_entry, 0, 16);
-                        memcpy(raw_entry, titleid, 8);
-                        decrypted_data2 = (uint8_t*)malloc(0x10 * sizeof(uint8_t));
-                        AES128_CBC_decrypt_buffer(decrypted_data2, decrypted_data, 0x10, commonkey, raw_entry);
-
-                        sprintf(calculated_name, "GM%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX", titleid[0], titleid[1], titleid[2], titleid[3], titleid[4], titleid[5], titleid[6], titleid[7]);
-                        newtitlekey = (struct titlekey*)malloc(sizeof(struct titlekey));
-                        memcpy(newtitlekey->encryptedKey, decrypted_data, 0x10);
-                        memcpy(newtitlekey->decryptedKey, decrypted_data2, 0x10);
-                        memcpy(newtitlekey->iv, raw_entry, 0x10);
-                        strncpy(newtitlekey->name, calculated_name, 0x12);
-                        newtitlekey->name[18] = '\0';
-
-                        utarray_sort(titlekeys, titlekeycmp);
-                        if(utarray_find(titlekeys, newtitlekey, titlekeycmp) == NULL) {
-                            utarray_push_back(titlekeys, newtitlekey);
+            fprintf(info, "********\n\n");
+
+            if ((positional_count >= 5 && strncmp(partitionname, positional[4], 2) == 0)
+                || positional_count < 5) {
+                if (usage) {
+                    // Reported below for the whole image
+                } else if (dump) {
+                    dumped = wud_dump_partition(context, i, positional[1], sink);
+                    if (dumped < 0) {
+                        fprintf(stderr, "Error: Could not dump partition %s\n", partitionname);
+                    } else {
+                        total_bad_blocks += (uint64_t)dumped;
+                    }
+                } else if (!verify) {
+                    // The file table knows how much there is to do up front
+                    if (!verbose) {
+                        total_bytes = 0;
+                        file_count = wud_file_count(context, i);
+                        shard_files = 0;
+                        for (f = 0; f < file_count; f++) {
+                            if (wud_in_shard(context, wud_file(context, i, f))) {
+                                total_bytes += wud_file_size(wud_file(context, i, f));
+                                shard_files++;
+                            }
                         }
-
-                        free(newtitlekey);
+                        progress_start(partitionname, total_bytes, shard_files, stderr);
+                    }
+                    if (wud_extract_partition(context, i, positional[1], sink) != 0) {
+                        fprintf(stderr, "Error: Could not extract partition %s\n", partitionname);
+                        failed = 1;
                     }
+                    progress_stop();
+                } else if (wud_verify_partition(context, i, verify_level, threads, stdout, &bad_blocks) == 0) {
+                    total_bad_blocks += bad_blocks;
+                } else {
+                    fprintf(stderr, "Error: Could not verify partition %s\n", partitionname);
                 }
             }
+        } else {
+            fprintf(stderr, "WARNING: Partition %s has no matching key and cannot be decrypted\n\n", partitionname);
+        }
+    }
 
-            if ((argc >= 6 && strncmp((char*)partitions[i].name, argv[5], 2) == 0)
-                || argc < 6) {
-                volumes[i].source = &(partitions[i]);
-                volumes[i].volume_base_offset = partitions[i].offset;
-                strncpy(volumes[i].identifier, partitions[i].name, PARTITION_TOC_ENTRY_SIZE - 1);
-                volumes[i].identifier[127] = '\0';
-                current_dir_index = 0;
-                volumes[i].root_directory = create_directory(volumes[i].source, &current_dir_index, "");
-
-                strncpy(outputdir, argv[2], 1023);
-                outputdir[1023] = '\0';
-                if(outputdir[strlen(outputdir) - 1] == '/') {
-                    outputdir[strlen(outputdir) - 1] = '\0';
-                }
-
-                extract_all(wudimage, volumes[i].root_directory, outputdir);
+    // Write-behind errors only show up once everything was written
+    if (sink_finish(sink) != 0) {
+        fprintf(stderr, "Error: Could not finish writing the output\n");
+        failed = 1;
+    }
+    if (usage) {
+        printf("Space used:\n");
+        wud_usage_report(context, stdout);
+        if (trimmed != NULL) {
+            if (wud_write_trimmed(context, trimmed, NULL) != 0) {
+                fprintf(stderr, "Error: Could not write the trimmed image %s\n", trimmed);
+                failed = 1;
+            } else {
+                fprintf(info, "Trimmed image written to %s\n", trimmed);
             }
+        }
+    }
+    if (verify) {
+        fprintf(info, "\nVerification found %llu bad blocks\n", (unsigned long long int)total_bad_blocks);
+    }
+    if (store != NULL || previous != NULL) {
+        wud_store_stats(context, &reused, &reused_bytes, &added);
+        fprintf(info, "\nReused %llu files (%llu MiB), %llu added to the content store\n", (unsigned long long int)reused,
+            (unsigned long long int)(reused_bytes / (1024 * 1024)), (unsigned long long int)added);
+    }
+    // File and partition spans name their entries by the strings of the context
+    trace_flush();
+    wud_close(context);
+    sink_free(sink);
+    free(commonkey);
+    free(disckey);
+
+    // Only now every writer has finished
+    if (stats) {
+        fprintf(info, "\n");
+        stats_print(info);
+    }
+    if (stats_json != NULL) {
+        stats_output = (strcmp(stats_json, "-") == 0) ? stdout : fopen(stats_json, "w");
+        if (stats_output == NULL) {
+            fprintf(stderr, "Error: Could not write the measurements to %s\n", stats_json);
+            failed = 1;
         } else {
-            fprintf(stderr, "WARNING: Partition %s has no matching key and cannot be decrypted\n\n", partitions[i].name);
+            stats_print_json(stats_output);
+            if (stats_output != stdout) {
+                fclose(stats_output);
+            }
         }
     }
-
-    fclose(wudimage);
-    return EXIT_SUCCESS;
+    stats_free();
+    if (trace_close() != 0) {
+        fprintf(stderr, "Error: Could not write the trace to %s\n", trace);
+        failed = 1;
+    }
+    return (failed || total_bad_blocks > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
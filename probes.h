@@ -0,0 +1,38 @@
+#ifndef _PROBES_H_
+#define _PROBES_H_
+// USDT probes of the provider wudecrypt for bpftrace, perf and SystemTap, e.g.
+//   bpftrace -e 'usdt:./wudecrypt:wudecrypt:read__done { @[arg1] = count(); }'
+// Each one is a single nop until something attaches to it. They are built in whenever <sys/sdt.h> is found,
+// define WUDECRYPT_NO_PROBES to leave them out entirely.
+#if !defined(WUDECRYPT_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define WUDECRYPT_PROBES 1
+#endif
+#endif
+
+#ifdef WUDECRYPT_PROBES
+// A read of size bytes of the image at offset, done with the bytes actually read
+#define PROBE_READ_START(offset, size) DTRACE_PROBE2(wudecrypt, read__start, (uint64_t)(offset), (uint64_t)(size))
+#define PROBE_READ_DONE(offset, size, done) DTRACE_PROBE3(wudecrypt, read__done, (uint64_t)(offset), (uint64_t)(size), (uint64_t)(done))
+// size bytes of block in cluster decrypted
+#define PROBE_BLOCK_DECRYPT(cluster, block, size) DTRACE_PROBE3(wudecrypt, block__decrypt, (uint32_t)(cluster), (uint64_t)(block), (uint32_t)(size))
+// A block of cluster failed its hash at level, 0 for H0 up to 3 for H3
+#define PROBE_HASH_MISMATCH(cluster, block, level) DTRACE_PROBE3(wudecrypt, hash__mismatch, (uint32_t)(cluster), (uint64_t)(block), (int)(level))
+// An output file of size bytes opened and closed again, path is a C string
+#define PROBE_FILE_OPEN(path, size) DTRACE_PROBE2(wudecrypt, file__open, (const char*)(path), (uint64_t)(size))
+#define PROBE_FILE_CLOSE(path, size) DTRACE_PROBE2(wudecrypt, file__close, (const char*)(path), (uint64_t)(size))
+// Extracting, verifying or dumping the partition name stored at offset of the image
+#define PROBE_PARTITION_START(name, offset) DTRACE_PROBE2(wudecrypt, partition__start, (const char*)(name), (uint64_t)(offset))
+#define PROBE_PARTITION_END(name, offset) DTRACE_PROBE2(wudecrypt, partition__end, (const char*)(name), (uint64_t)(offset))
+#else
+#define PROBE_READ_START(offset, size) do { } while (0)
+#define PROBE_READ_DONE(offset, size, done) do { } while (0)
+#define PROBE_BLOCK_DECRYPT(cluster, block, size) do { } while (0)
+#define PROBE_HASH_MISMATCH(cluster, block, level) do { } while (0)
+#define PROBE_FILE_OPEN(path, size) do { } while (0)
+#define PROBE_FILE_CLOSE(path, size) do { } while (0)
+#define PROBE_PARTITION_START(name, offset) do { } while (0)
+#define PROBE_PARTITION_END(name, offset) do { } while (0)
+#endif
+#endif // _PROBES_H_
@@ -0,0 +1,144 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#define isatty _isatty
+#endif
+#include "functions.h"
+#include "progress.h"
+
+struct progress_state {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    int running;
+    int stop;
+    // A terminal gets one line redrawn in place, logs a new line now and then
+    int terminal;
+
+    const char* label;
+    FILE* output;
+    uint64_t started;
+    uint64_t total_bytes;
+    uint64_t total_files;
+    uint64_t done_bytes;
+    uint64_t done_files;
+    // Part of done_bytes that needed no work, left out of the throughput
+    uint64_t skipped_bytes;
+};
+
+static struct progress_state progress = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void print_progress(uint64_t done_bytes, uint64_t done_files, uint64_t skipped_bytes) {
+    double seconds = (monotonic_nanoseconds() - progress.started) / 1e9;
+    double rate = (seconds > 0) ? (done_bytes - skipped_bytes) / seconds : 0;
+    uint64_t eta = (rate > 0 && progress.total_bytes > done_bytes) ? (uint64_t)((progress.total_bytes - done_bytes) / rate) : 0;
+
+    fprintf(progress.output, "%s%s: %llu/%llu MiB (%.0f%%), %.1f MiB/s, %.0f files/s, ETA %llu:%02u:%02u%s", progress.terminal ? "\r" : "", progress.label,
+        (unsigned long long int)(done_bytes / (1024 * 1024)), (unsigned long long int)(progress.total_bytes / (1024 * 1024)),
+        (progress.total_bytes > 0) ? 100.0 * done_bytes / progress.total_bytes : 100.0, rate / (1024 * 1024), (seconds > 0) ? done_files / seconds : 0.0,
+        (unsigned long long int)(eta / 3600), (unsigned int)((eta / 60) % 60), (unsigned int)(eta % 60), progress.terminal ? "    " : "\n");
+    fflush(progress.output);
+}
+
+static void* progress_thread(void* arg) {
+    struct timespec deadline;
+    uint64_t interval = progress.terminal ? PROGRESS_TERMINAL_INTERVAL_MS : PROGRESS_LOG_INTERVAL_MS;
+    uint64_t done_bytes, done_files, skipped_bytes;
+
+    pthread_mutex_lock(&(progress.lock));
+    while (!progress.stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t)(interval / 1000);
+        deadline.tv_nsec += (long)((interval % 1000) * 1000000);
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!progress.stop && pthread_cond_timedwait(&(progress.wake), &(progress.lock), &deadline) == 0) {
+        }
+        if (progress.stop) {
+            break;
+        }
+        done_bytes = progress.done_bytes;
+        done_files = progress.done_files;
+        skipped_bytes = progress.skipped_bytes;
+        // Printing may block on a slow terminal, extraction must not wait for that
+        pthread_mutex_unlock(&(progress.lock));
+        print_progress(done_bytes, done_files, skipped_bytes);
+        pthread_mutex_lock(&(progress.lock));
+    }
+    pthread_mutex_unlock(&(progress.lock));
+    return NULL;
+}
+
+int progress_start(const char* label, uint64_t total_bytes, uint64_t total_files, FILE* output) {
+    if (progress.running) {
+        return -1;
+    }
+    progress.label = label;
+    progress.output = output;
+    progress.terminal = isatty(fileno(output));
+    progress.started = monotonic_nanoseconds();
+    progress.total_bytes = total_bytes;
+    progress.total_files = total_files;
+    progress.done_bytes = 0;
+    progress.done_files = 0;
+    progress.skipped_bytes = 0;
+    progress.stop = 0;
+    if (pthread_create(&(progress.thread), NULL, progress_thread, NULL) != 0) {
+        return -1;
+    }
+    progress.running = 1;
+    return 0;
+}
+
+void progress_add(uint64_t bytes, uint64_t files) {
+    if (!progress.running) {
+        return;
+    }
+    pthread_mutex_lock(&(progress.lock));
+    progress.done_bytes += bytes;
+    progress.done_files += files;
+    pthread_mutex_unlock(&(progress.lock));
+}
+
+void progress_skip(uint64_t bytes, uint64_t files) {
+    if (!progress.running) {
+        return;
+    }
+    pthread_mutex_lock(&(progress.lock));
+    progress.done_bytes += bytes;
+    progress.done_files += files;
+    progress.skipped_bytes += bytes;
+    pthread_mutex_unlock(&(progress.lock));
+}
+
+int progress_active(void) {
+    return progress.running;
+}
+
+void progress_stop(void) {
+    double seconds;
+
+    if (!progress.running) {
+        return;
+    }
+    pthread_mutex_lock(&(progress.lock));
+    progress.stop = 1;
+    pthread_cond_signal(&(progress.wake));
+    pthread_mutex_unlock(&(progress.lock));
+    pthread_join(progress.thread, NULL);
+    progress.running = 0;
+
+    seconds = (monotonic_nanoseconds() - progress.started) / 1e9;
+    fprintf(progress.output, "%s%s: %llu MiB in %llu of %llu files, %llu MiB already done, %.1f s (%.1f MiB/s)%s\n", progress.terminal ? "\r" : "", progress.label,
+        (unsigned long long int)(progress.done_bytes / (1024 * 1024)), (unsigned long long int)progress.done_files, (unsigned long long int)progress.total_files,
+        (unsigned long long int)(progress.skipped_bytes / (1024 * 1024)), seconds,
+        (seconds > 0) ? (progress.done_bytes - progress.skipped_bytes) / seconds / (1024 * 1024) : 0.0, progress.terminal ? "        " : "");
+    fflush(progress.output);
+}
@@ -0,0 +1,21 @@
+#ifndef _PROGRESS_H_
+#define _PROGRESS_H_
+#include <stdint.h>
+#include <stdio.h>
+
+// How often the progress line is redrawn on a terminal, and written as a new line anywhere else
+#define PROGRESS_TERMINAL_INTERVAL_MS 250
+#define PROGRESS_LOG_INTERVAL_MS 10000
+
+// Shows how far an extraction of total_bytes in total_files got, with throughput and ETA, on output from
+// a thread of its own. While it runs extraction doesn't list every file. Returns 0 on success.
+int progress_start(const char* label, uint64_t total_bytes, uint64_t total_files, FILE* output);
+// Counts bytes and files as done, does nothing while no progress is shown
+void progress_add(uint64_t bytes, uint64_t files);
+// Counts bytes and files as done that needed no work, e.g. finished by an earlier run
+void progress_skip(uint64_t bytes, uint64_t files);
+// 1 between progress_start() and progress_stop()
+int progress_active(void);
+// Ends the progress line with a summary of the whole run
+void progress_stop(void);
+#endif // _PROGRESS_H_
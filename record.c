@@ -0,0 +1,204 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "functions.h"
+#include "record.h"
+
+#ifdef _MSC_VER
+#define RECORD_THREAD_LOCAL __declspec(thread)
+#else
+#define RECORD_THREAD_LOCAL __thread
+#endif
+
+struct record_source {
+    struct image_source* inner;
+    FILE* output;
+    pthread_mutex_t lock;
+    uint64_t started;
+    uint16_t thread_count;
+    int failed;
+};
+
+// Number of the calling thread plus one, 0 until its first access
+static RECORD_THREAD_LOCAL uint32_t current_thread = 0;
+
+static void put_le16(uint8_t* bytes, uint16_t value) {
+    bytes[0] = (uint8_t)value;
+    bytes[1] = (uint8_t)(value >> 8);
+}
+
+static void put_le32(uint8_t* bytes, uint32_t value) {
+    put_le16(bytes, (uint16_t)value);
+    put_le16(bytes + 2, (uint16_t)(value >> 16));
+}
+
+static void put_le64(uint8_t* bytes, uint64_t value) {
+    put_le32(bytes, (uint32_t)value);
+    put_le32(bytes + 4, (uint32_t)(value >> 32));
+}
+
+static uint32_t get_le32(const uint8_t* bytes) {
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t* bytes) {
+    return (uint64_t)get_le32(bytes) | ((uint64_t)get_le32(bytes + 4) << 32);
+}
+
+static void record_entry(struct record_source* record, int type, int hint, uint64_t offset, uint64_t length, uint64_t started) {
+    uint8_t entry[RECORD_ENTRY_SIZE];
+
+    pthread_mutex_lock(&(record->lock));
+    if (current_thread == 0) {
+        current_thread = ++record->thread_count;
+    }
+    put_le64(entry, offset);
+    put_le64(entry + 8, started - record->started);
+    put_le32(entry + 16, (length > 0xFFFFFFFFULL) ? 0xFFFFFFFFU : (uint32_t)length);
+    put_le16(entry + 20, (uint16_t)(current_thread - 1));
+    entry[22] = (uint8_t)type;
+    entry[23] = (uint8_t)hint;
+    if (fwrite(entry, 1, RECORD_ENTRY_SIZE, record->output) != RECORD_ENTRY_SIZE) {
+        record->failed = 1;
+    }
+    pthread_mutex_unlock(&(record->lock));
+}
+
+static size_t record_read_at(struct image_source* source, uint64_t offset, void* buffer, size_t size) {
+    struct record_source* record = (struct record_source*)source->data;
+    uint64_t started = monotonic_nanoseconds();
+
+    record_entry(record, RECORD_READ, 0, offset, size, started);
+    return record->inner->read_at(record->inner, offset, buffer, size);
+}
+
+static size_t record_read_vectored(struct image_source* source, uint64_t offset, const struct image_iovec* vectors, int count) {
+    struct record_source* record = (struct record_source*)source->data;
+    uint64_t started = monotonic_nanoseconds();
+    uint64_t size = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        size += vectors[i].size;
+    }
+    record_entry(record, RECORD_READ, 0, offset, size, started);
+    return image_read_vectored(record->inner, offset, vectors, count);
+}
+
+static uint64_t record_size(struct image_source* source) {
+    return image_size(((struct record_source*)source->data)->inner);
+}
+
+static void record_hint(struct image_source* source, int hint, uint64_t offset, uint64_t length) {
+    struct record_source* record = (struct record_source*)source->data;
+
+    record_entry(record, RECORD_HINT, hint, offset, length, monotonic_nanoseconds());
+    image_hint(record->inner, hint, offset, length);
+}
+
+static void record_release(struct image_source* source, uint64_t offset) {
+    struct record_source* record = (struct record_source*)source->data;
+
+    record_entry(record, RECORD_RELEASE, 0, offset, 0, monotonic_nanoseconds());
+    image_release(record->inner, offset);
+}
+
+static void record_close(struct image_source* source) {
+    struct record_source* record = (struct record_source*)source->data;
+
+    if (fclose(record->output) != 0 || record->failed) {
+        fprintf(stderr, "Error: The I/O recording is incomplete\n");
+    }
+    image_close(record->inner);
+    pthread_mutex_destroy(&(record->lock));
+    free(record);
+    free(source);
+}
+
+struct image_source* image_record(struct image_source* source, const char* path) {
+    struct image_source* wrapper = (struct image_source*)calloc(1, sizeof(struct image_source));
+    struct record_source* record = (struct record_source*)calloc(1, sizeof(struct record_source));
+    uint8_t header[RECORD_HEADER_SIZE];
+
+    if (wrapper == NULL || record == NULL) {
+        free(wrapper);
+        free(record);
+        return NULL;
+    }
+    record->output = fopen(path, "wb");
+    if (record->output == NULL) {
+        fprintf(stderr, "Error: Could not open %s for writing\n", path);
+        free(wrapper);
+        free(record);
+        return NULL;
+    }
+    record->inner = source;
+    record->started = monotonic_nanoseconds();
+    pthread_mutex_init(&(record->lock), NULL);
+
+    memcpy(header, RECORD_MAGIC, 8);
+    put_le32(header + 8, RECORD_VERSION);
+    put_le32(header + 12, RECORD_ENTRY_SIZE);
+    put_le64(header + 16, image_size(source));
+    put_le64(header + 24, (uint64_t)time(NULL) * 1000000000ULL);
+    if (fwrite(header, 1, RECORD_HEADER_SIZE, record->output) != RECORD_HEADER_SIZE) {
+        record->failed = 1;
+    }
+
+    wrapper->data = record;
+    wrapper->read_at = record_read_at;
+    wrapper->read_vectored = record_read_vectored;
+    wrapper->size = record_size;
+    wrapper->hint = record_hint;
+    wrapper->release = record_release;
+    wrapper->close = record_close;
+    return wrapper;
+}
+
+struct record_entry* record_load(const char* path, uint64_t* count, uint64_t* image_size) {
+    uint8_t header[RECORD_HEADER_SIZE];
+    uint8_t entry[RECORD_ENTRY_SIZE];
+    struct record_entry* entries = NULL;
+    struct record_entry* grown;
+    uint64_t capacity = 0;
+    FILE* file;
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    if (fread(header, 1, RECORD_HEADER_SIZE, file) != RECORD_HEADER_SIZE || memcmp(header, RECORD_MAGIC, 8) != 0
+        || get_le32(header + 8) != RECORD_VERSION || get_le32(header + 12) != RECORD_ENTRY_SIZE) {
+        fclose(file);
+        return NULL;
+    }
+    *image_size = get_le64(header + 16);
+    *count = 0;
+    while (fread(entry, 1, RECORD_ENTRY_SIZE, file) == RECORD_ENTRY_SIZE) {
+        if (*count == capacity) {
+            capacity = (capacity > 0) ? capacity * 2 : 4096;
+            grown = (struct record_entry*)realloc(entries, capacity * sizeof(struct record_entry));
+            if (grown == NULL) {
+                free(entries);
+                fclose(file);
+                return NULL;
+            }
+            entries = grown;
+        }
+        entries[*count].offset = get_le64(entry);
+        entries[*count].nanoseconds = get_le64(entry + 8);
+        entries[*count].length = get_le32(entry + 16);
+        entries[*count].thread = (uint16_t)(entry[20] | (entry[21] << 8));
+        entries[*count].type = entry[22];
+        entries[*count].hint = entry[23];
+        (*count)++;
+    }
+    fclose(file);
+    // An empty recording is still a recording
+    if (entries == NULL) {
+        entries = (struct record_entry*)malloc(sizeof(struct record_entry));
+    }
+    return entries;
+}
@@ -0,0 +1,36 @@
+#ifndef _RECORD_H_
+#define _RECORD_H_
+#include <stdint.h>
+#include "image.h"
+
+// A recording is a header followed by one entry per access, all little endian:
+//   header: "WUDIOREC", u32 version, u32 entry size, u64 image size, u64 wall clock start in ns since 1970
+//   entry:  u64 offset, u64 ns since the start, u32 length, u16 thread, u8 type, u8 hint
+#define RECORD_MAGIC "WUDIOREC"
+#define RECORD_VERSION 1
+#define RECORD_HEADER_SIZE 32
+#define RECORD_ENTRY_SIZE 24
+
+// What an entry stands for. A vectored read is a single read of all its buffers.
+#define RECORD_READ 1
+// An image_hint() with the IMAGE_HINT_* in hint, length 0 means up to the end
+#define RECORD_HINT 2
+// An image_release(), offset only
+#define RECORD_RELEASE 3
+
+struct record_entry {
+    uint64_t offset;
+    uint64_t nanoseconds;
+    uint32_t length;
+    // Threads are numbered from 0 in the order of their first access
+    uint16_t thread;
+    uint8_t type;
+    uint8_t hint;
+};
+
+// Passes everything on to source, which the returned source owns, and appends every read, hint and
+// release to path. Safe to read from several threads at once if source is.
+struct image_source* image_record(struct image_source* source, const char* path);
+// Loads the entries of a recording, free() the result. Returns NULL if path isn't a recording.
+struct record_entry* record_load(const char* path, uint64_t* count, uint64_t* image_size);
+#endif // _RECORD_H_
@@ -0,0 +1,870 @@
+#ifdef __linux__
+// For fallocate()
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+#include "config.h"
+#include "functions.h"
+#include "sink.h"
+#include "store.h"
+#include "stats.h"
+
+struct callback_sink {
+    sink_write_callback callback;
+    void* user;
+};
+
+struct callback_output {
+    char path[1024];
+    uint64_t size;
+};
+
+// The write-behind thread gets the output in buffers this large, aligned for direct transfers
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+#define WRITE_BUFFER_ALIGNMENT 4096
+// Decryption only blocks once this many buffers wait to be written
+#define WRITE_BUFFER_COUNT 8
+// Sparse outputs skip all-zero pages of this size, aligned to file offsets
+#define SPARSE_PAGE_SIZE 4096
+
+struct filesystem_output;
+
+struct write_buffer {
+    uint8_t* data;
+    size_t length;
+    uint64_t offset;
+    struct filesystem_output* output;
+    // Closes the output once the data is written
+    int close;
+    struct write_buffer* next;
+};
+
+struct filesystem_output {
+    int fd;
+    // Set if the file was created empty, zero pages then need no write and no hole punching
+    int fresh;
+    char path[1024];
+    // Collects contiguous writes until the buffer is full
+    struct write_buffer* current;
+    // Buffers of this output submitted but not written yet
+    uint32_t queued;
+    int failed;
+};
+
+struct filesystem_sink {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work_queued;
+    pthread_cond_t buffer_returned;
+
+    struct write_buffer* free_buffers;
+    struct write_buffer* queue_head;
+    struct write_buffer* queue_tail;
+    // Buffers submitted but not written yet
+    uint32_t pending;
+    uint32_t errors;
+    int stop;
+
+    uint32_t flags;
+};
+
+#define TAR_BLOCK_SIZE 512
+// Largest size the 11 octal digits of a ustar header can hold
+#define TAR_USTAR_MAX_SIZE 077777777777ULL
+#define TAR_BUFFER_SIZE (1024 * 1024)
+
+struct tar_sink {
+    FILE* output;
+    uint8_t* buffer;
+    size_t buffered;
+    int64_t mtime;
+
+    // Only one output can be open at a time
+    int open;
+    uint64_t size;
+    uint64_t written;
+};
+
+static void plain_free(struct output_sink* sink);
+#ifndef _WIN32
+static int filesystem_finish(struct output_sink* sink);
+#endif
+
+static int filesystem_make_directory(struct output_sink* sink, const char* path) {
+    if (makedir(path) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+static int filesystem_link(struct output_sink* sink, const char* source, const char* path, int hardlink) {
+    remove(path);
+    return store_clone_file(source, path, hardlink);
+}
+
+#ifndef _WIN32
+static int write_fully(int fd, const uint8_t* data, size_t size, uint64_t offset) {
+    ssize_t result;
+
+    while (size > 0) {
+        result = pwrite(fd, data, size, (off_t)offset);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return -1;
+        }
+        data += result;
+        size -= (size_t)result;
+        offset += (uint64_t)result;
+    }
+    return 0;
+}
+
+// Writes a buffer leaving out its all-zero pages, which become holes of the sparse file
+static int write_sparse(struct filesystem_output* output, const uint8_t* data, size_t size, uint64_t offset) {
+    size_t position = 0, run_start = 0, page_size;
+    int zero;
+
+    while (position < size) {
+        page_size = SPARSE_PAGE_SIZE - (size_t)((offset + position) % SPARSE_PAGE_SIZE);
+        if (page_size > size - position) {
+            page_size = size - position;
+        }
+        zero = buffer_is_zero(data + position, page_size);
+        // Reused files may hold old data there, which has to be overwritten unless a whole page can be punched out
+        if (zero && !output->fresh) {
+#ifdef __linux__
+            if (page_size != SPARSE_PAGE_SIZE
+                || fallocate(output->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)(offset + position), (off_t)page_size) != 0) {
+                zero = 0;
+            }
+#else
+            zero = 0;
+#endif
+        }
+        if (zero && position > run_start && write_fully(output->fd, data + run_start, position - run_start, offset + run_start) != 0) {
+            return -1;
+        }
+        position += page_size;
+        if (zero) {
+            run_start = position;
+        }
+    }
+    if (position > run_start) {
+        return write_fully(output->fd, data + run_start, position - run_start, offset + run_start);
+    }
+    return 0;
+}
+
+static struct write_buffer* writer_take_buffer(struct filesystem_sink* writer) {
+    struct write_buffer* buffer;
+
+    pthread_mutex_lock(&(writer->lock));
+    while (writer->free_buffers == NULL) {
+        pthread_cond_wait(&(writer->buffer_returned), &(writer->lock));
+    }
+    buffer = writer->free_buffers;
+    writer->free_buffers = buffer->next;
+    pthread_mutex_unlock(&(writer->lock));
+
+    buffer->next = NULL;
+    buffer->length = 0;
+    buffer->close = 0;
+    return buffer;
+}
+
+static void writer_submit(struct filesystem_sink* writer, struct write_buffer* buffer) {
+    pthread_mutex_lock(&(writer->lock));
+    if (writer->queue_tail != NULL) {
+        writer->queue_tail->next = buffer;
+    } else {
+        writer->queue_head = buffer;
+    }
+    writer->queue_tail = buffer;
+    writer->pending++;
+    buffer->output->queued++;
+    pthread_cond_signal(&(writer->work_queued));
+    pthread_mutex_unlock(&(writer->lock));
+}
+
+// Write-behind thread: writes queued buffers in order while the caller keeps decrypting
+static void* writer_thread(void* arg) {
+    struct filesystem_sink* writer = (struct filesystem_sink*)arg;
+    struct write_buffer* buffer;
+    struct filesystem_output* output;
+    uint64_t start;
+    int failed;
+
+    stats_name_thread("writer");
+    for (;;) {
+        pthread_mutex_lock(&(writer->lock));
+        while (writer->queue_head == NULL && !writer->stop) {
+            pthread_cond_wait(&(writer->work_queued), &(writer->lock));
+        }
+        buffer = writer->queue_head;
+        if (buffer == NULL) {
+            pthread_mutex_unlock(&(writer->lock));
+            return NULL;
+        }
+        writer->queue_head = buffer->next;
+        if (writer->queue_head == NULL) {
+            writer->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&(writer->lock));
+
+        output = buffer->output;
+        failed = 0;
+        start = stats_start();
+        if ((writer->flags & SINK_FILESYSTEM_SPARSE) && buffer->length > 0) {
+            failed = (write_sparse(output, buffer->data, buffer->length, buffer->offset) != 0);
+        } else if (buffer->length > 0) {
+            failed = (write_fully(output->fd, buffer->data, buffer->length, buffer->offset) != 0);
+        }
+        stats_stop(STATS_WRITE, start, buffer->length, 0);
+        if (buffer->close && close(output->fd) != 0) {
+            failed = 1;
+        }
+
+        pthread_mutex_lock(&(writer->lock));
+        if (failed && !output->failed) {
+            fprintf(stderr, "Warning: Couldn't write expected output for %s\n", output->path);
+            writer->errors++;
+        }
+        output->failed |= failed;
+        output->queued--;
+        buffer->next = writer->free_buffers;
+        writer->free_buffers = buffer;
+        writer->pending--;
+        pthread_cond_broadcast(&(writer->buffer_returned));
+        pthread_mutex_unlock(&(writer->lock));
+
+        // The close job is the last one referencing the output
+        if (buffer->close) {
+            free(output);
+        }
+    }
+}
+
+static void* filesystem_open_output(struct output_sink* sink, const char* path, uint64_t size, int keep) {
+    struct filesystem_sink* writer = (struct filesystem_sink*)sink->data;
+    struct filesystem_output* output;
+    int fd;
+
+    // An old output may be a hardlink into the content store, which must not be truncated with it
+    if (!keep) {
+        unlink(path);
+    }
+    fd = open(path, keep ? (O_WRONLY | O_CREAT) : (O_WRONLY | O_CREAT | O_TRUNC), 0666);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (writer->flags & SINK_FILESYSTEM_SPARSE) {
+        // Only the final size is set, every page never written stays a hole
+        if (ftruncate(fd, (off_t)size) != 0) {
+            close(fd);
+            return NULL;
+        }
+    }
+#ifdef __linux__
+    // Reserving the whole file up front keeps it in few extents, filesystems without support just skip it
+    else if (size > 0) {
+        fallocate(fd, 0, 0, (off_t)size);
+    }
+#endif
+
+    output = (struct filesystem_output*)calloc(1, sizeof(struct filesystem_output));
+    if (output == NULL) {
+        close(fd);
+        return NULL;
+    }
+    output->fd = fd;
+    output->fresh = !keep;
+    strncpy(output->path, path, 1023);
+    output->path[1023] = '\0';
+    return output;
+}
+
+static void* filesystem_open(struct output_sink* sink, const char* path, uint64_t size) {
+    return filesystem_open_output(sink, path, size, 0);
+}
+
+static void* filesystem_reopen(struct output_sink* sink, const char* path, uint64_t size) {
+    return filesystem_open_output(sink, path, size, 1);
+}
+
+static int filesystem_write_at(struct output_sink* sink, void* handle, const uint8_t* data, size_t size, uint64_t offset) {
+    struct filesystem_sink* writer = (struct filesystem_sink*)sink->data;
+    struct filesystem_output* output = (struct filesystem_output*)handle;
+    struct write_buffer* buffer;
+    size_t capacity, copy_size;
+    int failed;
+
+    while (size > 0) {
+        buffer = output->current;
+        if (buffer != NULL && offset != buffer->offset + buffer->length) {
+            writer_submit(writer, buffer);
+            buffer = output->current = NULL;
+        }
+        if (buffer == NULL) {
+            buffer = output->current = writer_take_buffer(writer);
+            buffer->output = output;
+            buffer->offset = offset;
+        }
+
+        // Buffers end on multiples of their size, so all but the first write of a file are aligned
+        capacity = WRITE_BUFFER_SIZE - (size_t)(buffer->offset % WRITE_BUFFER_SIZE);
+        copy_size = capacity - buffer->length;
+        if (copy_size > size) {
+            copy_size = size;
+        }
+        memcpy(buffer->data + buffer->length, data, copy_size);
+        buffer->length += copy_size;
+        data += copy_size;
+        size -= copy_size;
+        offset += copy_size;
+
+        if (buffer->length == capacity) {
+            writer_submit(writer, buffer);
+            output->current = NULL;
+        }
+    }
+
+    pthread_mutex_lock(&(writer->lock));
+    failed = output->failed;
+    pthread_mutex_unlock(&(writer->lock));
+    return failed ? -1 : 0;
+}
+
+static int filesystem_close(struct output_sink* sink, void* handle) {
+    struct filesystem_sink* writer = (struct filesystem_sink*)sink->data;
+    struct filesystem_output* output = (struct filesystem_output*)handle;
+    struct write_buffer* buffer = output->current;
+
+    // Whatever is still buffered goes out together with the close, errors show up in sink_finish()
+    if (buffer == NULL) {
+        buffer = writer_take_buffer(writer);
+        buffer->output = output;
+    }
+    buffer->close = 1;
+    writer_submit(writer, buffer);
+    return 0;
+}
+
+static int filesystem_sync(struct output_sink* sink, void* handle) {
+    struct filesystem_sink* writer = (struct filesystem_sink*)sink->data;
+    struct filesystem_output* output = (struct filesystem_output*)handle;
+    int result;
+
+    if (output == NULL) {
+        return filesystem_finish(sink);
+    }
+    if (output->current != NULL) {
+        writer_submit(writer, output->current);
+        output->current = NULL;
+    }
+    pthread_mutex_lock(&(writer->lock));
+    while (output->queued > 0) {
+        pthread_cond_wait(&(writer->buffer_returned), &(writer->lock));
+    }
+    result = output->failed ? -1 : 0;
+    pthread_mutex_unlock(&(writer->lock));
+
+    // The thread is idle for this output now, so the descriptor can be used here
+#ifdef __linux__
+    if (result == 0 && fdatasync(output->fd) != 0) {
+#else
+    if (result == 0 && fsync(output->fd) != 0) {
+#endif
+        result = -1;
+    }
+    return result;
+}
+
+static int filesystem_finish(struct output_sink* sink) {
+    struct filesystem_sink* writer = (struct filesystem_sink*)sink->data;
+    int result;
+
+    pthread_mutex_lock(&(writer->lock));
+    while (writer->pending > 0) {
+        pthread_cond_wait(&(writer->buffer_returned), &(writer->lock));
+    }
+    result = (writer->errors > 0) ? -1 : 0;
+    pthread_mutex_unlock(&(writer->lock));
+    return result;
+}
+
+static void filesystem_free(struct output_sink* sink) {
+    struct filesystem_sink* writer = (struct filesystem_sink*)sink->data;
+    struct write_buffer* buffer;
+
+    pthread_mutex_lock(&(writer->lock));
+    writer->stop = 1;
+    pthread_cond_signal(&(writer->work_queued));
+    pthread_mutex_unlock(&(writer->lock));
+    pthread_join(writer->thread, NULL);
+
+    while (writer->free_buffers != NULL) {
+        buffer = writer->free_buffers;
+        writer->free_buffers = buffer->next;
+        free(buffer->data);
+        free(buffer);
+    }
+    pthread_mutex_destroy(&(writer->lock));
+    pthread_cond_destroy(&(writer->work_queued));
+    pthread_cond_destroy(&(writer->buffer_returned));
+    free(writer);
+    free(sink);
+}
+
+struct output_sink* sink_create_filesystem(uint32_t flags) {
+    struct output_sink* sink = (struct output_sink*)calloc(1, sizeof(struct output_sink));
+    struct filesystem_sink* writer = (struct filesystem_sink*)calloc(1, sizeof(struct filesystem_sink));
+    struct write_buffer* buffer;
+    void* data;
+    uint32_t i;
+
+    if (sink == NULL || writer == NULL) {
+        free(sink);
+        free(writer);
+        return NULL;
+    }
+    pthread_mutex_init(&(writer->lock), NULL);
+    pthread_cond_init(&(writer->work_queued), NULL);
+    pthread_cond_init(&(writer->buffer_returned), NULL);
+    writer->flags = flags;
+    sink->data = writer;
+    sink->make_directory = filesystem_make_directory;
+    sink->open = filesystem_open;
+    sink->write_at = filesystem_write_at;
+    sink->close = filesystem_close;
+    sink->finish = filesystem_finish;
+    sink->reopen = filesystem_reopen;
+    sink->sync = filesystem_sync;
+    sink->link = filesystem_link;
+    sink->free = filesystem_free;
+    sink->writes_behind = 1;
+
+    for (i = 0; i < WRITE_BUFFER_COUNT; i++) {
+        buffer = (struct write_buffer*)calloc(1, sizeof(struct write_buffer));
+        if (buffer == NULL || posix_memalign(&data, WRITE_BUFFER_ALIGNMENT, WRITE_BUFFER_SIZE) != 0) {
+            free(buffer);
+            break;
+        }
+        buffer->data = (uint8_t*)data;
+        buffer->next = writer->free_buffers;
+        writer->free_buffers = buffer;
+    }
+    if (i < WRITE_BUFFER_COUNT || pthread_create(&(writer->thread), NULL, writer_thread, writer) != 0) {
+        // Without the thread there is nothing to join, free() only has to drop the buffers
+        while (writer->free_buffers != NULL) {
+            buffer = writer->free_buffers;
+            writer->free_buffers = buffer->next;
+            free(buffer->data);
+            free(buffer);
+        }
+        pthread_mutex_destroy(&(writer->lock));
+        pthread_cond_destroy(&(writer->work_queued));
+        pthread_cond_destroy(&(writer->buffer_returned));
+        free(writer);
+        free(sink);
+        return NULL;
+    }
+    return sink;
+}
+#else
+static void* filesystem_open(struct output_sink* sink, const char* path, uint64_t size) {
+    return fopen(path, "wb");
+}
+
+static int filesystem_write_at(struct output_sink* sink, void* handle, const uint8_t* data, size_t size, uint64_t offset) {
+    if (_fseeki64((FILE*)handle, (__int64)offset, SEEK_SET) != 0) {
+        return -1;
+    }
+    return (fwrite(data, 1, size, (FILE*)handle) == size) ? 0 : -1;
+}
+
+static void* filesystem_reopen(struct output_sink* sink, const char* path, uint64_t size) {
+    FILE* output = fopen(path, "r+b");
+    if (output == NULL) {
+        output = fopen(path, "wb");
+    }
+    return output;
+}
+
+static int filesystem_sync(struct output_sink* sink, void* handle) {
+    // Writes go straight through stdio, only a single file has anything left to flush
+    if (handle == NULL) {
+        return 0;
+    }
+    if (fflush((FILE*)handle) != 0 || _commit(_fileno((FILE*)handle)) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int filesystem_close(struct output_sink* sink, void* handle) {
+    return fclose((FILE*)handle);
+}
+
+struct output_sink* sink_create_filesystem(uint32_t flags) {
+    struct output_sink* sink = (struct output_sink*)calloc(1, sizeof(struct output_sink));
+    if (sink == NULL) {
+        return NULL;
+    }
+    sink->make_directory = filesystem_make_directory;
+    sink->open = filesystem_open;
+    sink->write_at = filesystem_write_at;
+    sink->close = filesystem_close;
+    sink->reopen = filesystem_reopen;
+    sink->sync = filesystem_sync;
+    sink->link = filesystem_link;
+    sink->free = plain_free;
+    return sink;
+}
+#endif
+
+static int null_make_directory(struct output_sink* sink, const char* path) {
+    return 0;
+}
+
+static void* null_open(struct output_sink* sink, const char* path, uint64_t size) {
+    return sink;
+}
+
+static int null_write_at(struct output_sink* sink, void* handle, const uint8_t* data, size_t size, uint64_t offset) {
+    return 0;
+}
+
+static int null_close(struct output_sink* sink, void* handle) {
+    return 0;
+}
+
+static void* callback_open(struct output_sink* sink, const char* path, uint64_t size) {
+    struct callback_output* output = (struct callback_output*)malloc(sizeof(struct callback_output));
+    if (output == NULL) {
+        return NULL;
+    }
+    strncpy(output->path, path, 1023);
+    output->path[1023] = '\0';
+    output->size = size;
+    return output;
+}
+
+static int callback_write_at(struct output_sink* sink, void* handle, const uint8_t* data, size_t size, uint64_t offset) {
+    struct callback_sink* callback = (struct callback_sink*)sink->data;
+    struct callback_output* output = (struct callback_output*)handle;
+    return callback->callback(callback->user, output->path, data, size, offset, output->size);
+}
+
+static int callback_close(struct output_sink* sink, void* handle) {
+    free(handle);
+    return 0;
+}
+
+static size_t tar_normalize_path(const char* path, char* output, size_t length) {
+    size_t used = 0;
+
+    // Archive members are relative, "a//b/./c" becomes "a/b/c"
+    while (*path != '\0') {
+        while (*path == '/') {
+            path++;
+        }
+        if (path[0] == '.' && (path[1] == '/' || path[1] == '\0')) {
+            path++;
+            continue;
+        }
+        if (*path == '\0') {
+            break;
+        }
+        if (used > 0 && used < length - 1) {
+            output[used++] = '/';
+        }
+        while (*path != '\0' && *path != '/') {
+            if (used < length - 1) {
+                output[used++] = *path;
+            }
+            path++;
+        }
+    }
+    output[used] = '\0';
+    return used;
+}
+
+static int tar_flush(struct tar_sink* tar) {
+    size_t buffered = tar->buffered;
+
+    tar->buffered = 0;
+    return (fwrite(tar->buffer, 1, buffered, tar->output) == buffered) ? 0 : -1;
+}
+
+// Output is collected in large chunks, so a pipe to an uploader only sees big writes
+static int tar_write(struct tar_sink* tar, const void* data, size_t size) {
+    size_t copy_size;
+
+    while (size > 0) {
+        if (tar->buffered == TAR_BUFFER_SIZE && tar_flush(tar) != 0) {
+            return -1;
+        }
+        copy_size = TAR_BUFFER_SIZE - tar->buffered;
+        if (copy_size > size) {
+            copy_size = size;
+        }
+        memcpy(tar->buffer + tar->buffered, data, copy_size);
+        tar->buffered += copy_size;
+        data = (const uint8_t*)data + copy_size;
+        size -= copy_size;
+    }
+    return 0;
+}
+
+static int tar_pad(struct tar_sink* tar, uint64_t size) {
+    static const uint8_t zeroes[TAR_BLOCK_SIZE];
+    size_t padding = (size_t)((TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE);
+
+    return tar_write(tar, zeroes, padding);
+}
+
+static void tar_octal(char* field, size_t length, uint64_t value) {
+    snprintf(field, length, "%0*llo", (int)(length - 1), (unsigned long long int)value);
+}
+
+static int tar_header(struct tar_sink* tar, const char* name, const char* prefix, uint64_t size, char type) {
+    uint8_t header[TAR_BLOCK_SIZE];
+    uint32_t checksum = 0;
+    size_t i;
+
+    memset(header, 0, TAR_BLOCK_SIZE);
+    strncpy((char*)header, name, 100);
+    tar_octal((char*)header + 100, 8, (type == '5') ? 0755 : 0644);
+    tar_octal((char*)header + 108, 8, 0);
+    tar_octal((char*)header + 116, 8, 0);
+    tar_octal((char*)header + 124, 12, (size > TAR_USTAR_MAX_SIZE) ? 0 : size);
+    tar_octal((char*)header + 136, 12, (uint64_t)tar->mtime);
+    header[156] = (uint8_t)type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    if (prefix != NULL) {
+        strncpy((char*)header + 345, prefix, 155);
+    }
+
+    // The checksum is calculated with its own field filled with spaces
+    memset(header + 148, ' ', 8);
+    for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+        checksum += header[i];
+    }
+    snprintf((char*)header + 148, 8, "%06o", checksum);
+
+    return tar_write(tar, header, TAR_BLOCK_SIZE);
+}
+
+static size_t tar_pax_record(char* output, size_t length, const char* key, const char* value) {
+    size_t size = strlen(key) + strlen(value) + 3;
+    size_t total = size + 1;
+
+    // A record starts with its own length in decimal, including the digits of that length
+    while (total != size + (size_t)snprintf(NULL, 0, "%zu", total)) {
+        total++;
+    }
+    return (size_t)snprintf(output, length, "%zu %s=%s\n", total, key, value);
+}
+
+static int tar_entry(struct tar_sink* tar, const char* path, uint64_t size, char type) {
+    char name[1024];
+    char records[2200];
+    char value[32];
+    char* split;
+    size_t length, records_size = 0;
+
+    length = tar_normalize_path(path, name, sizeof(name) - 1);
+    if (length == 0) {
+        return 0;
+    }
+    if (type == '5') {
+        name[length++] = '/';
+        name[length] = '\0';
+    }
+
+    if (length <= 100 && size <= TAR_USTAR_MAX_SIZE) {
+        return tar_header(tar, name, NULL, size, type);
+    }
+
+    // Long names can be split into a prefix of up to 155 and a name of up to 100 bytes
+    split = strchr(name + ((length > 101) ? length - 101 : 0), '/');
+    if (size <= TAR_USTAR_MAX_SIZE && split != NULL && split - name <= 155 && split[1] != '\0' && strlen(split + 1) <= 100) {
+        *split = '\0';
+        return tar_header(tar, split + 1, name, size, type);
+    }
+
+    // Otherwise a pax extended header carries the full path and size
+    if (length > 100) {
+        records_size += tar_pax_record(records, sizeof(records), "path", name);
+    }
+    if (size > TAR_USTAR_MAX_SIZE) {
+        snprintf(value, sizeof(value), "%llu", (unsigned long long int)size);
+        records_size += tar_pax_record(records + records_size, sizeof(records) - records_size, "size", value);
+    }
+    if (tar_header(tar, "PaxHeader", NULL, records_size, 'x') != 0
+        || tar_write(tar, records, records_size) != 0
+        || tar_pad(tar, records_size) != 0) {
+        return -1;
+    }
+    name[100] = '\0';
+    return tar_header(tar, name, NULL, size, type);
+}
+
+static int tar_make_directory(struct output_sink* sink, const char* path) {
+    return tar_entry((struct tar_sink*)sink->data, path, 0, '5');
+}
+
+static void* tar_open(struct output_sink* sink, const char* path, uint64_t size) {
+    struct tar_sink* tar = (struct tar_sink*)sink->data;
+
+    if (tar->open) {
+        fprintf(stderr, "Error: The tar output can only write one file at a time\n");
+        return NULL;
+    }
+    if (tar_entry(tar, path, size, '0') != 0) {
+        return NULL;
+    }
+    tar->open = 1;
+    tar->size = size;
+    tar->written = 0;
+    return tar;
+}
+
+static int tar_write_at(struct output_sink* sink, void* handle, const uint8_t* data, size_t size, uint64_t offset) {
+    struct tar_sink* tar = (struct tar_sink*)handle;
+
+    if (offset != tar->written || size > tar->size - tar->written) {
+        fprintf(stderr, "Error: The tar output has to be written sequentially\n");
+        return -1;
+    }
+    tar->written += size;
+    return tar_write(tar, data, size);
+}
+
+static int tar_close(struct output_sink* sink, void* handle) {
+    static const uint8_t zeroes[TAR_BLOCK_SIZE];
+    struct tar_sink* tar = (struct tar_sink*)handle;
+    uint64_t missing;
+    int result = 0;
+
+    // The header already promised size bytes, so a short file gets zero filled to keep the archive intact
+    for (missing = tar->size - tar->written; missing > 0 && result == 0; missing -= (missing > TAR_BLOCK_SIZE) ? TAR_BLOCK_SIZE : missing) {
+        result = tar_write(tar, zeroes, (missing > TAR_BLOCK_SIZE) ? TAR_BLOCK_SIZE : (size_t)missing);
+    }
+    tar->open = 0;
+    if (result != 0 || tar_pad(tar, tar->size) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int tar_finish(struct output_sink* sink) {
+    static const uint8_t zeroes[TAR_BLOCK_SIZE * 2];
+    struct tar_sink* tar = (struct tar_sink*)sink->data;
+
+    // The archive ends with two empty blocks
+    if (tar_write(tar, zeroes, sizeof(zeroes)) != 0 || tar_flush(tar) != 0 || fflush(tar->output) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void tar_free(struct output_sink* sink) {
+    struct tar_sink* tar = (struct tar_sink*)sink->data;
+
+    free(tar->buffer);
+    free(tar);
+    free(sink);
+}
+
+static void plain_free(struct output_sink* sink) {
+    free(sink->data);
+    free(sink);
+}
+
+struct output_sink* sink_create_null(void) {
+    struct output_sink* sink = (struct output_sink*)calloc(1, sizeof(struct output_sink));
+    if (sink == NULL) {
+        return NULL;
+    }
+    sink->make_directory = null_make_directory;
+    sink->open = null_open;
+    sink->write_at = null_write_at;
+    sink->close = null_close;
+    sink->free = plain_free;
+    return sink;
+}
+
+struct output_sink* sink_create_callback(sink_write_callback callback, void* user) {
+    struct output_sink* sink = (struct output_sink*)calloc(1, sizeof(struct output_sink));
+    struct callback_sink* data = (struct callback_sink*)malloc(sizeof(struct callback_sink));
+    if (sink == NULL || data == NULL) {
+        free(sink);
+        free(data);
+        return NULL;
+    }
+    data->callback = callback;
+    data->user = user;
+    sink->data = data;
+    sink->make_directory = null_make_directory;
+    sink->open = callback_open;
+    sink->write_at = callback_write_at;
+    sink->close = callback_close;
+    sink->free = plain_free;
+    return sink;
+}
+
+struct output_sink* sink_create_tar(FILE* output) {
+    struct output_sink* sink = (struct output_sink*)calloc(1, sizeof(struct output_sink));
+    struct tar_sink* tar = (struct tar_sink*)calloc(1, sizeof(struct tar_sink));
+    uint8_t* buffer = (uint8_t*)malloc(TAR_BUFFER_SIZE);
+    if (sink == NULL || tar == NULL || buffer == NULL) {
+        free(sink);
+        free(tar);
+        free(buffer);
+        return NULL;
+    }
+    tar->output = output;
+    tar->buffer = buffer;
+    tar->mtime = (int64_t)time(NULL);
+#ifdef _WIN32
+    _setmode(_fileno(output), _O_BINARY);
+#endif
+
+    sink->data = tar;
+    sink->uses_stdout = (output == stdout);
+    sink->make_directory = tar_make_directory;
+    sink->open = tar_open;
+    sink->write_at = tar_write_at;
+    sink->close = tar_close;
+    sink->finish = tar_finish;
+    sink->free = tar_free;
+    return sink;
+}
+
+int sink_finish(struct output_sink* sink) {
+    if (sink == NULL || sink->finish == NULL) {
+        return 0;
+    }
+    return sink->finish(sink);
+}
+
+void sink_free(struct output_sink* sink) {
+    if (sink != NULL) {
+        sink->free(sink);
+    }
+}
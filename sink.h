@@ -0,0 +1,53 @@
+#ifndef _SINK_H_
+#define _SINK_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Where extracted data goes. Extraction only talks to these callbacks, never to files directly.
+struct output_sink {
+    // Creates a directory, returns 0 on success (including if it already exists)
+    int (*make_directory)(struct output_sink* sink, const char* path);
+    // Opens an output of the given final size, returns a handle or NULL
+    void* (*open)(struct output_sink* sink, const char* path, uint64_t size);
+    // Writes size bytes at offset of an opened output, returns 0 on success
+    int (*write_at)(struct output_sink* sink, void* handle, const uint8_t* data, size_t size, uint64_t offset);
+    // Finishes an output, returns 0 on success
+    int (*close)(struct output_sink* sink, void* handle);
+    // Called once after the last output, may be NULL
+    int (*finish)(struct output_sink* sink);
+    // Opens an output of the given final size keeping what an earlier run wrote to it, may be NULL
+    void* (*reopen)(struct output_sink* sink, const char* path, uint64_t size);
+    // Waits until everything written to handle, or to every output if it is NULL, reached the file.
+    // A single handle is also flushed to disk. Returns 0 on success, may be NULL
+    int (*sync)(struct output_sink* sink, void* handle);
+    // Number of leading bytes of path an earlier run already wrote, -1 if nothing can be kept.
+    // The open() of path right after keeps these bytes. May be NULL
+    int64_t (*completed)(struct output_sink* sink, const char* path, uint64_t size);
+    // Makes path a copy of the existing file source without passing the data through the sink, sharing
+    // the file itself through a hardlink only if hardlink is set. Returns 0 on success. May be NULL
+    int (*link)(struct output_sink* sink, const char* source, const char* path, int hardlink);
+    void (*free)(struct output_sink* sink);
+
+    // Set if the sink writes to stdout, messages then have to go to stderr
+    int uses_stdout;
+    // Set if write_at() only queues the data for a thread of the sink, which times the writing itself
+    int writes_behind;
+    void* data;
+};
+
+// Called for every chunk written to a callback sink
+typedef int (*sink_write_callback)(void* user, const char* path, const uint8_t* data, size_t size, uint64_t offset, uint64_t total_size);
+
+// Leaves all-zero pages of the output unwritten, so they become holes of sparse files
+#define SINK_FILESYSTEM_SPARSE 1
+
+struct output_sink* sink_create_filesystem(uint32_t flags);
+struct output_sink* sink_create_null(void);
+struct output_sink* sink_create_callback(sink_write_callback callback, void* user);
+// Streams a ustar archive (pax headers for long names and huge files) to output.
+// Outputs have to be written front to back one at a time, see sort_files_by_offset().
+struct output_sink* sink_create_tar(FILE* output);
+int sink_finish(struct output_sink* sink);
+void sink_free(struct output_sink* sink);
+#endif // _SINK_H_
@@ -0,0 +1,239 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "functions.h"
+#include "stats.h"
+#include "trace.h"
+
+#ifdef _MSC_VER
+#define STATS_THREAD_LOCAL __declspec(thread)
+#else
+#define STATS_THREAD_LOCAL __thread
+#endif
+
+static const char* stage_names[STATS_STAGE_COUNT] = { "read", "decrypt", "hash", "write", "metadata", "queue" };
+
+struct stats_stage {
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t blocks;
+    uint64_t nanoseconds;
+};
+
+// Only ever written by its own thread
+struct stats_thread {
+    const char* name;
+    uint32_t index;
+    struct stats_stage stages[STATS_STAGE_COUNT];
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    struct stats_thread* next;
+};
+
+static int enabled = 0;
+static uint64_t enabled_at;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_thread* threads = NULL;
+static uint32_t thread_count = 0;
+static STATS_THREAD_LOCAL struct stats_thread* current = NULL;
+// Kept even before counting is enabled, threads usually start before that
+static STATS_THREAD_LOCAL const char* current_name = NULL;
+
+// The counters of the calling thread, registered on first use
+static struct stats_thread* current_thread(void) {
+    if (current == NULL) {
+        current = (struct stats_thread*)calloc(1, sizeof(struct stats_thread));
+        if (current == NULL) {
+            return NULL;
+        }
+        current->name = current_name;
+        pthread_mutex_lock(&threads_lock);
+        current->index = thread_count++;
+        current->next = threads;
+        threads = current;
+        pthread_mutex_unlock(&threads_lock);
+    }
+    return current;
+}
+
+void stats_enable(void) {
+    enabled_at = monotonic_nanoseconds();
+    enabled = 1;
+    stats_name_thread("main");
+}
+
+void stats_name_thread(const char* name) {
+    trace_name_thread(name);
+    current_name = name;
+    if (current != NULL) {
+        current->name = name;
+    }
+}
+
+uint64_t stats_start(void) {
+    return (enabled || trace_active()) ? monotonic_nanoseconds() : 0;
+}
+
+void stats_stop(int stage, uint64_t start, uint64_t bytes, uint64_t blocks) {
+    struct stats_thread* thread;
+    uint64_t now;
+
+    if (!enabled && !trace_active()) {
+        return;
+    }
+    // Every timed stage is also a span of the timeline
+    now = monotonic_nanoseconds();
+    trace_span(stage_names[stage], "stage", start, now, bytes, blocks);
+    if (!enabled || (thread = current_thread()) == NULL) {
+        return;
+    }
+    thread->stages[stage].calls++;
+    thread->stages[stage].bytes += bytes;
+    thread->stages[stage].blocks += blocks;
+    thread->stages[stage].nanoseconds += now - start;
+}
+
+void stats_cache(int hit) {
+    struct stats_thread* thread;
+
+    if (!enabled || (thread = current_thread()) == NULL) {
+        return;
+    }
+    if (hit) {
+        thread->cache_hits++;
+    } else {
+        thread->cache_misses++;
+    }
+}
+
+// Everything registered so far in one set of counters, threads are listed oldest first
+static void sum_threads(struct stats_thread* total, struct stats_thread** ordered) {
+    struct stats_thread* thread;
+    int s;
+
+    memset(total, 0, sizeof(struct stats_thread));
+    total->name = "total";
+    for (thread = threads; thread != NULL; thread = thread->next) {
+        ordered[thread->index] = thread;
+        for (s = 0; s < STATS_STAGE_COUNT; s++) {
+            total->stages[s].calls += thread->stages[s].calls;
+            total->stages[s].bytes += thread->stages[s].bytes;
+            total->stages[s].blocks += thread->stages[s].blocks;
+            total->stages[s].nanoseconds += thread->stages[s].nanoseconds;
+        }
+        total->cache_hits += thread->cache_hits;
+        total->cache_misses += thread->cache_misses;
+    }
+}
+
+// Several threads share a name, the index tells them apart
+static void thread_name(struct stats_thread* thread, int numbered, char* name, size_t size) {
+    if (!numbered) {
+        snprintf(name, size, "%s", thread->name);
+    } else {
+        snprintf(name, size, "%s %u", (thread->name != NULL) ? thread->name : "thread", (unsigned int)thread->index);
+    }
+}
+
+static void print_thread(FILE* output, struct stats_thread* thread, int numbered) {
+    char name[32];
+    double seconds, mib;
+    int s;
+
+    thread_name(thread, numbered, name, sizeof(name));
+    for (s = 0; s < STATS_STAGE_COUNT; s++) {
+        if (thread->stages[s].calls == 0) {
+            continue;
+        }
+        seconds = thread->stages[s].nanoseconds / 1e9;
+        mib = thread->stages[s].bytes / (1024.0 * 1024.0);
+        fprintf(output, "  %-12s %-9s %10llu %10llu %10.1f %9.3f %9.1f\n", name, stage_names[s], (unsigned long long int)thread->stages[s].calls,
+            (unsigned long long int)thread->stages[s].blocks, mib, seconds, (seconds > 0) ? mib / seconds : 0.0);
+    }
+    if (thread->cache_hits + thread->cache_misses > 0) {
+        fprintf(output, "  %-12s cache     %llu hits, %llu misses (%.1f%%)\n", name, (unsigned long long int)thread->cache_hits,
+            (unsigned long long int)thread->cache_misses, 100.0 * thread->cache_hits / (thread->cache_hits + thread->cache_misses));
+    }
+}
+
+void stats_print(FILE* output) {
+    struct stats_thread total;
+    struct stats_thread** ordered;
+    uint32_t i;
+
+    if (!enabled) {
+        return;
+    }
+    pthread_mutex_lock(&threads_lock);
+    ordered = (struct stats_thread**)calloc(thread_count + 1, sizeof(struct stats_thread*));
+    if (ordered != NULL) {
+        sum_threads(&total, ordered);
+        fprintf(output, "Stage timings over %.3f s:\n", (monotonic_nanoseconds() - enabled_at) / 1e9);
+        fprintf(output, "  %-12s %-9s %10s %10s %10s %9s %9s\n", "thread", "stage", "calls", "blocks", "MiB", "seconds", "MiB/s");
+        for (i = 0; i < thread_count; i++) {
+            print_thread(output, ordered[i], 1);
+        }
+        print_thread(output, &total, 0);
+        free(ordered);
+    }
+    pthread_mutex_unlock(&threads_lock);
+}
+
+static void print_thread_json(FILE* output, struct stats_thread* thread, int numbered) {
+    char name[32];
+    int s;
+
+    thread_name(thread, numbered, name, sizeof(name));
+    fprintf(output, "{\"name\":");
+    fprint_json_string(output, name);
+    fprintf(output, ",\"stages\":{");
+    for (s = 0; s < STATS_STAGE_COUNT; s++) {
+        fprintf(output, "%s\"%s\":{\"calls\":%llu,\"blocks\":%llu,\"bytes\":%llu,\"seconds\":%.6f}", (s > 0) ? "," : "", stage_names[s],
+            (unsigned long long int)thread->stages[s].calls, (unsigned long long int)thread->stages[s].blocks,
+            (unsigned long long int)thread->stages[s].bytes, thread->stages[s].nanoseconds / 1e9);
+    }
+    fprintf(output, "},\"cache_hits\":%llu,\"cache_misses\":%llu}", (unsigned long long int)thread->cache_hits, (unsigned long long int)thread->cache_misses);
+}
+
+void stats_print_json(FILE* output) {
+    struct stats_thread total;
+    struct stats_thread** ordered;
+    uint32_t i;
+
+    if (!enabled) {
+        return;
+    }
+    pthread_mutex_lock(&threads_lock);
+    ordered = (struct stats_thread**)calloc(thread_count + 1, sizeof(struct stats_thread*));
+    if (ordered != NULL) {
+        sum_threads(&total, ordered);
+        fprintf(output, "{\"wall_seconds\":%.6f,\"threads\":[", (monotonic_nanoseconds() - enabled_at) / 1e9);
+        for (i = 0; i < thread_count; i++) {
+            if (i > 0) {
+                fputc(',', output);
+            }
+            print_thread_json(output, ordered[i], 1);
+        }
+        fprintf(output, "],\"total\":");
+        print_thread_json(output, &total, 0);
+        fprintf(output, "}\n");
+        free(ordered);
+    }
+    pthread_mutex_unlock(&threads_lock);
+}
+
+void stats_free(void) {
+    struct stats_thread* thread;
+
+    pthread_mutex_lock(&threads_lock);
+    while (threads != NULL) {
+        thread = threads;
+        threads = thread->next;
+        free(thread);
+    }
+    thread_count = 0;
+    enabled = 0;
+    current = NULL;
+    pthread_mutex_unlock(&threads_lock);
+}
@@ -0,0 +1,34 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+#include <stdint.h>
+#include <stdio.h>
+
+// Stages a run spends its time in
+#define STATS_READ 0
+#define STATS_DECRYPT 1
+#define STATS_HASH 2
+#define STATS_WRITE 3
+#define STATS_METADATA 4
+// Handing output to a write-behind thread, including waiting for a free buffer. That thread counts the write.
+#define STATS_QUEUE 5
+#define STATS_STAGE_COUNT 6
+
+// Counters are kept per thread and only summed up for the report, so counting never takes a lock.
+// Until stats_enable() every call returns right away without reading the clock, unless a trace is recorded.
+void stats_enable(void);
+// Names the calling thread in the report and the trace, name has to stay valid
+void stats_name_thread(const char* name);
+
+// Start of a timed stage, pass the result to stats_stop()
+uint64_t stats_start(void);
+// Ends a stage begun at start, counting one call moving bytes in blocks
+void stats_stop(int stage, uint64_t start, uint64_t bytes, uint64_t blocks);
+// Counts a lookup in a block cache
+void stats_cache(int hit);
+
+// Writes a table of every thread and the totals, nothing if counting was never enabled
+void stats_print(FILE* output);
+// The same as a single JSON object on one line
+void stats_print_json(FILE* output);
+void stats_free(void);
+#endif // _STATS_H_
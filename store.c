@@ -0,0 +1,450 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#include "config.h"
+#include "functions.h"
+#include "aes.h"
+#include "sha1.h"
+#include "store.h"
+
+#if defined(__linux__) && !defined(FICLONE)
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+// Copies are made in chunks this large
+#define STORE_READ_SIZE (1024 * 1024)
+
+// A file of an earlier extraction
+struct store_entry {
+    uint8_t key[20];
+    uint64_t size;
+    char* path;
+};
+
+// An output of this run
+struct store_output {
+    uint8_t key[20];
+    uint64_t size;
+    int reused;
+    char path[1024];
+};
+
+static void entry_copy(void* dst, const void* src) {
+    struct store_entry* target = (struct store_entry*)dst;
+    const struct store_entry* source = (const struct store_entry*)src;
+
+    *target = *source;
+    target->path = (source->path != NULL) ? strdup(source->path) : NULL;
+}
+
+static void entry_dtor(void* element) {
+    free(((struct store_entry*)element)->path);
+}
+
+static const UT_icd store_entry_icd = { sizeof(struct store_entry), NULL, entry_copy, entry_dtor };
+static const UT_icd store_output_icd = { sizeof(struct store_output), NULL, NULL, NULL };
+
+static int entry_cmp(const void* e1, const void* e2) {
+    return memcmp(((const struct store_entry*)e1)->key, ((const struct store_entry*)e2)->key, 20);
+}
+
+struct content_store* store_open(void) {
+    struct content_store* store = (struct content_store*)calloc(1, sizeof(struct content_store));
+
+    if (store == NULL) {
+        return NULL;
+    }
+    utarray_new(store->previous, &store_entry_icd);
+    utarray_new(store->pending, &store_output_icd);
+    return store;
+}
+
+void store_close(struct content_store* store) {
+    if (store == NULL) {
+        return;
+    }
+    if (store->index != NULL) {
+        fclose(store->index);
+    }
+    utarray_free(store->previous);
+    utarray_free(store->pending);
+    free(store);
+}
+
+int store_set_root(struct content_store* store, const char* root) {
+    store->root[0] = '\0';
+    if (root == NULL) {
+        return 0;
+    }
+    if (makedir(root) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Could not create the content store %s\n", root);
+        return -1;
+    }
+    strncpy(store->root, root, sizeof(store->root) - 1);
+    store->root[sizeof(store->root) - 1] = '\0';
+    return 0;
+}
+
+static void key_to_hex(const uint8_t* key, char* hex) {
+    int i;
+    for (i = 0; i < 20; i++) {
+        sprintf(hex + (i * 2), "%02x", key[i]);
+    }
+}
+
+int store_load_index(struct content_store* store, const char* path) {
+    char index[1024];
+    char base[1024];
+    char line[2048];
+    char hex[41];
+    char full[2048];
+    unsigned long long int size;
+    unsigned int value;
+    struct store_entry entry;
+    struct stat info;
+    size_t length;
+    char* slash;
+    int start, i;
+    FILE* input;
+
+    // An extraction directory stands for the index inside it
+    strncpy(index, path, sizeof(index) - 1);
+    index[sizeof(index) - 1] = '\0';
+    if (stat(path, &info) == 0 && S_ISDIR(info.st_mode)) {
+        snprintf(index, sizeof(index), "%s/%s", path, STORE_INDEX_NAME);
+    }
+    strcpy(base, index);
+    slash = strrchr(base, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+    } else {
+        strcpy(base, ".");
+    }
+
+    input = fopen(index, "rb");
+    if (input == NULL) {
+        fprintf(stderr, "Error: Could not open the index %s\n", index);
+        return -1;
+    }
+    // Lines are "<key> <size> <path relative to the index>"
+    while (fgets(line, sizeof(line), input) != NULL) {
+        length = strlen(line);
+        if (length == 0 || line[length - 1] != '\n') {
+            continue;
+        }
+        line[length - 1] = '\0';
+        start = 0;
+        if (sscanf(line, "%40s %llu %n", hex, &size, &start) != 2 || start == 0 || line[start] == '\0' || strlen(hex) != 40) {
+            continue;
+        }
+        for (i = 0; i < 20 && sscanf(hex + (i * 2), "%2x", &value) == 1; i++) {
+            entry.key[i] = (uint8_t)value;
+        }
+        if (i < 20) {
+            continue;
+        }
+        snprintf(full, sizeof(full), "%s/%s", base, line + start);
+        entry.size = (uint64_t)size;
+        entry.path = full;
+        utarray_push_back(store->previous, &entry);
+    }
+    fclose(input);
+    utarray_sort(store->previous, entry_cmp);
+    return 0;
+}
+
+static void store_mix_u64(mbedtls_sha1_context* sha1, uint64_t value) {
+    uint8_t bytes[8];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        bytes[i] = (uint8_t)(value >> (i * 8));
+    }
+    mbedtls_sha1_update(sha1, bytes, 8);
+}
+
+int store_key(struct image_source* infile, struct file* file, uint8_t* key) {
+    struct partition_entry* entry = (struct partition_entry*)utarray_eltptr(file->parent_partition->entries, file->entry_id);
+    int hashed = file_is_hashed(file);
+    uint64_t block_size = hashed ? 0xFC00 : 0x8000;
+    uint64_t physical_block_size = hashed ? 0x10000 : 0x8000;
+    uint64_t cluster_base = WIIU_DECRYPTED_AREA_OFFSET + file->volume_base_offset + file->data_section_offset;
+    uint64_t start = (uint64_t)file->lba;
+    uint64_t end = start + (uint64_t)file->size;
+    uint64_t block, block_start, slice_start, slice_end;
+    uint8_t first_iv[16];
+    uint8_t iv[16];
+    uint8_t header[0x400];
+    uint8_t digest[20];
+    uint8_t* buffer;
+    struct AES128_ctx ctx;
+    mbedtls_sha1_context sha1;
+    int result = 0;
+
+    buffer = (uint8_t*)malloc(0x10000);
+    if (buffer == NULL) {
+        return -1;
+    }
+    AES128_init_ctx(&ctx, file->parent_partition->key);
+    file_first_iv(file, first_iv);
+    mbedtls_sha1_init(&sha1);
+    mbedtls_sha1_starts(&sha1);
+    mbedtls_sha1_update(&sha1, (const uint8_t*)(hashed ? "H" : "U"), 1);
+    if (hashed) {
+        store_mix_u64(&sha1, start % block_size);
+    }
+    store_mix_u64(&sha1, (uint64_t)file->size);
+
+    // Without H0 hashes only the decrypted data can be compared. Its ciphertext would do on one disc, but
+    // the SI, UP and GI partitions are encrypted with the disc key, which differs on every disc.
+    for (block = start / block_size; !hashed && block * block_size < end && result == 0; block++) {
+        block_start = block * block_size;
+        slice_start = (start > block_start) ? start - block_start : 0;
+        slice_end = (end < block_start + block_size) ? end - block_start : block_size;
+        if (readFileOffsetBuffer(cluster_base + (block * physical_block_size), buffer, (size_t)physical_block_size, infile) != physical_block_size) {
+            result = -1;
+            break;
+        }
+        // Every block starts over with the first IV
+        memcpy(iv, first_iv, 16);
+        AES128_CBC_decrypt_buffer_ctx(&ctx, buffer, buffer, 0x8000, iv);
+        mbedtls_sha1_update(&sha1, buffer + slice_start, (size_t)(slice_end - slice_start));
+    }
+
+    // Every block of a hashed file adds a digest of the file's part of it. Blocks shared with neighbouring
+    // files are decrypted to leave those out, for all others the hash header is enough.
+    for (block = start / block_size; hashed && block * block_size < end && result == 0; block++) {
+        block_start = block * block_size;
+        slice_start = (start > block_start) ? start - block_start : 0;
+        slice_end = (end < block_start + block_size) ? end - block_start : block_size;
+
+        if (slice_start == 0 && slice_end == block_size) {
+            if (readFileOffsetBuffer(cluster_base + (block * physical_block_size), buffer, 0x400, infile) != 0x400) {
+                result = -1;
+                break;
+            }
+            AES128_CBC_decrypt_buffer_ctx(&ctx, header, buffer, 0x400, first_iv);
+            // The H0 of a block is the SHA-1 of its data, the first of a group has the cluster mixed in
+            memcpy(digest, header + ((block & 0xF) * 0x14), 20);
+            if ((block & 0xF) == 0) {
+                digest[1] ^= (uint8_t)entry->starting_cluster;
+            }
+        } else {
+            if (readFileOffsetBuffer(cluster_base + (block * physical_block_size), buffer, (size_t)physical_block_size, infile) != physical_block_size) {
+                result = -1;
+                break;
+            }
+            decrypt_hashed_block(&ctx, buffer, first_iv, entry->starting_cluster, (int64_t)block, header, buffer + 0x400);
+            mbedtls_sha1(buffer + 0x400 + slice_start, (size_t)(slice_end - slice_start), digest);
+        }
+        mbedtls_sha1_update(&sha1, digest, 20);
+    }
+
+    mbedtls_sha1_finish(&sha1, key);
+    mbedtls_sha1_free(&sha1);
+    free(buffer);
+    return result;
+}
+
+static void store_path(struct content_store* store, const uint8_t* key, char* path, char* directory) {
+    char hex[41];
+
+    key_to_hex(key, hex);
+    if (directory != NULL) {
+        snprintf(directory, 1024, "%s/%.2s", store->root, hex);
+    }
+    snprintf(path, 1024, "%s/%.2s/%s", store->root, hex, hex);
+}
+
+int store_lookup(struct content_store* store, const uint8_t* key, uint64_t size, char* path) {
+    struct store_entry* entry;
+    struct stat info;
+    int low = 0, high = (int)utarray_len(store->previous), middle;
+
+    // Earlier extractions first, their files may have been changed or deleted since
+    while (low < high) {
+        middle = low + ((high - low) / 2);
+        entry = (struct store_entry*)utarray_eltptr(store->previous, (unsigned int)middle);
+        if (memcmp(entry->key, key, 20) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (; low < (int)utarray_len(store->previous); low++) {
+        entry = (struct store_entry*)utarray_eltptr(store->previous, (unsigned int)low);
+        if (memcmp(entry->key, key, 20) != 0) {
+            break;
+        }
+        if (entry->size == size && stat(entry->path, &info) == 0 && (uint64_t)info.st_size == size) {
+            strncpy(path, entry->path, 1023);
+            path[1023] = '\0';
+            return STORE_FOUND_PREVIOUS;
+        }
+    }
+
+    if (store->root[0] == '\0') {
+        return 0;
+    }
+    store_path(store, key, path, NULL);
+    return (stat(path, &info) == 0 && (uint64_t)info.st_size == size) ? STORE_FOUND_SHARED : 0;
+}
+
+void store_begin(struct content_store* store, const char* outputdir) {
+    char path[1100];
+
+    // Every partition adds to the index of the same directory, a new directory starts a new one
+    if (store->index != NULL && strcmp(store->index_directory, outputdir) == 0) {
+        return;
+    }
+    if (store->index != NULL) {
+        fclose(store->index);
+    }
+    strncpy(store->index_directory, outputdir, sizeof(store->index_directory) - 1);
+    store->index_directory[sizeof(store->index_directory) - 1] = '\0';
+    snprintf(path, sizeof(path), "%s/%s", outputdir, STORE_INDEX_NAME);
+    store->index = fopen(path, "wb");
+    if (store->index == NULL) {
+        fprintf(stderr, "Warning: Could not write the index %s\n", path);
+    }
+}
+
+void store_queue(struct content_store* store, const uint8_t* key, uint64_t size, const char* path, int reused) {
+    struct store_output output;
+
+    memcpy(output.key, key, 20);
+    output.size = size;
+    output.reused = reused;
+    strncpy(output.path, path, 1023);
+    output.path[1023] = '\0';
+    utarray_push_back(store->pending, &output);
+}
+
+static int store_add(struct content_store* store, const uint8_t* key, const char* source) {
+    char path[1024];
+    char directory[1024];
+    char temporary[1100];
+    struct stat info;
+
+    store_path(store, key, path, directory);
+    if (stat(path, &info) == 0) {
+        return 0;
+    }
+    if (makedir(directory) != 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    // Added under a temporary name first, so the store never holds a partial file under a key
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    remove(temporary);
+    if (store_clone_file(source, temporary, 1) != 0) {
+        remove(temporary);
+        return -1;
+    }
+#ifndef _WIN32
+    // Content in the store is shared by every disc linking it and must never be changed in place
+    chmod(temporary, 0444);
+#endif
+    if (rename(temporary, path) != 0) {
+        remove(temporary);
+        return -1;
+    }
+    store->added++;
+    return 0;
+}
+
+void store_flush(struct content_store* store, struct output_sink* sink) {
+    struct store_output* output;
+    size_t length = strlen(store->index_directory);
+    const char* relative;
+    char hex[41];
+
+    // Without errors so far every queued file is complete on disk once the sink synced
+    if (utarray_len(store->pending) > 0 && sink->link != NULL && sink->sync != NULL && sink->sync(sink, NULL) == 0) {
+        for (output = (struct store_output*)utarray_front(store->pending); output != NULL; output = (struct store_output*)utarray_next(store->pending, output)) {
+            if (!output->reused && store->root[0] != '\0' && store_add(store, output->key, output->path) != 0) {
+                fprintf(stderr, "Warning: Could not add %s to the content store\n", output->path);
+            }
+            if (store->index != NULL) {
+                relative = output->path;
+                if (length > 0 && strncmp(relative, store->index_directory, length) == 0 && relative[length] == '/') {
+                    relative += length + 1;
+                }
+                key_to_hex(output->key, hex);
+                fprintf(store->index, "%s %llu %s\n", hex, (unsigned long long int)output->size, relative);
+            }
+        }
+        if (store->index != NULL) {
+            fflush(store->index);
+        }
+    }
+    utarray_clear(store->pending);
+}
+
+static int copy_file(const char* source, const char* target) {
+    uint8_t* buffer = (uint8_t*)malloc(STORE_READ_SIZE);
+    FILE* input = fopen(source, "rb");
+    FILE* output = fopen(target, "wb");
+    size_t length;
+    int result = 0;
+
+    if (buffer == NULL || input == NULL || output == NULL) {
+        result = -1;
+    }
+    while (result == 0 && (length = fread(buffer, 1, STORE_READ_SIZE, input)) > 0) {
+        if (fwrite(buffer, 1, length, output) != length) {
+            result = -1;
+        }
+    }
+    if (input != NULL && ferror(input)) {
+        result = -1;
+    }
+    if (input != NULL) {
+        fclose(input);
+    }
+    if (output != NULL && fclose(output) != 0) {
+        result = -1;
+    }
+    free(buffer);
+    return result;
+}
+
+int store_clone_file(const char* source, const char* target, int hardlink) {
+#ifdef __linux__
+    int input, output, cloned;
+
+    // A reflink shares the data but stays a separate file, so changing one copy never touches the other
+    input = open(source, O_RDONLY);
+    if (input >= 0) {
+        output = open(target, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (output >= 0) {
+            cloned = (ioctl(output, FICLONE, input) == 0);
+            close(output);
+            if (cloned) {
+                close(input);
+                return 0;
+            }
+            unlink(target);
+        }
+        close(input);
+    }
+#endif
+#ifndef _WIN32
+    if (hardlink && link(source, target) == 0) {
+        chmod(target, 0444);
+        return 0;
+    }
+#endif
+    return copy_file(source, target);
+}
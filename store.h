@@ -0,0 +1,60 @@
+#ifndef _STORE_H_
+#define _STORE_H_
+#include <stdint.h>
+#include "struct.h"
+#include "image.h"
+#include "sink.h"
+
+// Name of the index of content keys written into an output directory
+#define STORE_INDEX_NAME ".wudecrypt-index"
+
+// Where already extracted content can be found: a directory shared by many discs, kept as
+// <root>/<first two hex digits of the key>/<key in hex>, and the indexes of earlier extractions.
+// Every extraction using it writes an index of its own files for later runs.
+struct content_store {
+    // Short enough to leave room for the key below it in a 1024 byte path, empty if unused
+    char root[960];
+    // Files of earlier extractions, sorted by key
+    UT_array* previous;
+    // Files of this run, added to the store and the index once the sink wrote them
+    UT_array* pending;
+
+    FILE* index;
+    char index_directory[1024];
+
+    uint64_t hits;
+    uint64_t hit_bytes;
+    uint64_t added;
+};
+
+struct content_store* store_open(void);
+void store_close(struct content_store* store);
+// Uses root as the shared directory, NULL stops using one. Returns 0 on success.
+int store_set_root(struct content_store* store, const char* root);
+// Loads the index of an earlier extraction, path is the index or the directory holding it. Returns 0 on success.
+int store_load_index(struct content_store* store, const char* path);
+
+// Key of the content of file. A hashed file is keyed by the H0 hashes of its blocks without decrypting
+// more than the blocks it shares with other files. An unhashed file has to be decrypted and is keyed by
+// the SHA-1 of its data, so it matches across discs with different keys. Returns 0 on success.
+int store_key(struct image_source* infile, struct file* file, uint8_t* key);
+// Where store_lookup() found a copy
+#define STORE_FOUND_SHARED 1
+#define STORE_FOUND_PREVIOUS 2
+
+// Puts the path of an existing copy of key with the given size into path. Returns STORE_FOUND_SHARED if
+// it is in the shared directory, STORE_FOUND_PREVIOUS if it belongs to an earlier extraction, 0 if there is none.
+int store_lookup(struct content_store* store, const uint8_t* key, uint64_t size, char* path);
+
+// Starts the index of outputdir, called before its files are queued
+void store_begin(struct content_store* store, const char* outputdir);
+// Remembers an output for the index, and for the shared directory unless it was taken from there
+void store_queue(struct content_store* store, const uint8_t* key, uint64_t size, const char* path, int reused);
+// Records the queued outputs once sink has written them, only sinks writing real files can provide them
+void store_flush(struct content_store* store, struct output_sink* sink);
+
+// Makes target a copy of source: a reflink if the filesystem can, else a hardlink if hardlink is set,
+// else a plain copy. A hardlinked file is made read-only, so writing to either name fails instead of
+// changing both. Returns 0 on success, target must not exist.
+int store_clone_file(const char* source, const char* target, int hardlink);
+#endif // _STORE_H_
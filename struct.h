@@ -33,6 +33,7 @@ struct partition {
     uint8_t identifier[25];
     char name[PTOC_SIZE];
 
+    uint8_t has_key;
     uint8_t key[16];
     uint8_t iv[16];
 
@@ -77,6 +78,7 @@ struct file {
 };
 
 static const UT_icd file_icd = { sizeof(struct file), NULL, NULL, NULL };
+static const UT_icd file_ptr_icd = { sizeof(struct file*), NULL, NULL, NULL };
 
 struct volume {
     struct partition* source;
@@ -86,6 +88,8 @@ struct volume {
     int64_t data_offset;
 
     struct directory* root_directory;
+    // Pointers to every file below root_directory, in directory order
+    UT_array* files;
 };
 
 struct block {
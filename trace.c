@@ -0,0 +1,225 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "functions.h"
+#include "trace.h"
+
+#ifdef _MSC_VER
+#define TRACE_THREAD_LOCAL __declspec(thread)
+// Volatile accesses are acquire and release on MSVC
+#define TRACE_LOAD_ACQUIRE(p) (*(volatile uint64_t*)(p))
+#define TRACE_STORE_RELEASE(p, v) (*(volatile uint64_t*)(p) = (v))
+#else
+#define TRACE_THREAD_LOCAL __thread
+#define TRACE_LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define TRACE_STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+struct trace_event {
+    const char* name;
+    const char* category;
+    uint64_t start;
+    uint64_t end;
+    uint64_t bytes;
+    uint64_t blocks;
+};
+
+// Written only by its thread at head, read only by the flusher at tail
+struct trace_ring {
+    struct trace_event events[TRACE_RING_EVENTS];
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    const char* name;
+    uint32_t index;
+    struct trace_ring* next;
+};
+
+struct trace_state {
+    // Guards the list of rings and the output, never taken when recording
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    int active;
+    int stop;
+
+    FILE* output;
+    uint64_t opened;
+    uint64_t written;
+    int failed;
+    struct trace_ring* rings;
+    uint32_t ring_count;
+};
+
+static struct trace_state trace = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+static TRACE_THREAD_LOCAL struct trace_ring* current = NULL;
+static TRACE_THREAD_LOCAL const char* current_name = NULL;
+
+// The ring of the calling thread, registered on first use
+static struct trace_ring* current_ring(void) {
+    if (current == NULL) {
+        current = (struct trace_ring*)calloc(1, sizeof(struct trace_ring));
+        if (current == NULL) {
+            return NULL;
+        }
+        current->name = current_name;
+        pthread_mutex_lock(&(trace.lock));
+        current->index = trace.ring_count++;
+        current->next = trace.rings;
+        trace.rings = current;
+        pthread_mutex_unlock(&(trace.lock));
+    }
+    return current;
+}
+
+// Microseconds since the trace was opened, the unit of the format
+static double trace_time(uint64_t nanoseconds) {
+    return (nanoseconds > trace.opened) ? (nanoseconds - trace.opened) / 1000.0 : 0.0;
+}
+
+static void write_event(FILE* output, const struct trace_event* event, uint32_t tid) {
+    fprintf(output, "%s\n{\"name\":", (trace.written++ > 0) ? "," : "");
+    fprint_json_string(output, event->name);
+    fprintf(output, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"bytes\":%llu,\"blocks\":%llu}}",
+        event->category, (unsigned int)tid, trace_time(event->start), (event->end - event->start) / 1000.0,
+        (unsigned long long int)event->bytes, (unsigned long long int)event->blocks);
+}
+
+// Called with the lock held
+static void drain_rings(void) {
+    struct trace_ring* ring;
+    uint64_t head, tail;
+
+    for (ring = trace.rings; ring != NULL; ring = ring->next) {
+        head = TRACE_LOAD_ACQUIRE(&(ring->head));
+        for (tail = ring->tail; tail != head; tail++) {
+            write_event(trace.output, &(ring->events[tail & (TRACE_RING_EVENTS - 1)]), ring->index + 1);
+        }
+        TRACE_STORE_RELEASE(&(ring->tail), tail);
+    }
+    if (fflush(trace.output) != 0) {
+        trace.failed = 1;
+    }
+}
+
+static void* trace_thread(void* arg) {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&(trace.lock));
+    while (!trace.stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)(TRACE_FLUSH_INTERVAL_MS * 1000000);
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&(trace.wake), &(trace.lock), &deadline);
+        drain_rings();
+    }
+    pthread_mutex_unlock(&(trace.lock));
+    return NULL;
+}
+
+int trace_open(const char* path) {
+    if (trace.active) {
+        return -1;
+    }
+    trace.output = fopen(path, "w");
+    if (trace.output == NULL) {
+        fprintf(stderr, "Error: Could not open %s for writing\n", path);
+        return -1;
+    }
+    fprintf(trace.output, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    trace.opened = monotonic_nanoseconds();
+    trace.written = 0;
+    trace.failed = 0;
+    trace.stop = 0;
+    if (pthread_create(&(trace.thread), NULL, trace_thread, NULL) != 0) {
+        fclose(trace.output);
+        return -1;
+    }
+    trace.active = 1;
+    if (current_name == NULL) {
+        trace_name_thread("main");
+    }
+    return 0;
+}
+
+int trace_active(void) {
+    return trace.active;
+}
+
+void trace_name_thread(const char* name) {
+    current_name = name;
+    if (current != NULL) {
+        current->name = name;
+    }
+}
+
+void trace_span(const char* name, const char* category, uint64_t start, uint64_t end, uint64_t bytes, uint64_t blocks) {
+    struct trace_ring* ring;
+    struct trace_event* event;
+
+    if (!trace.active || start == 0 || (ring = current_ring()) == NULL) {
+        return;
+    }
+    // A full ring loses the event rather than waiting for the flusher
+    if (ring->head - TRACE_LOAD_ACQUIRE(&(ring->tail)) >= TRACE_RING_EVENTS) {
+        ring->dropped++;
+        return;
+    }
+    event = &(ring->events[ring->head & (TRACE_RING_EVENTS - 1)]);
+    event->name = name;
+    event->category = category;
+    event->start = start;
+    event->end = end;
+    event->bytes = bytes;
+    event->blocks = blocks;
+    TRACE_STORE_RELEASE(&(ring->head), ring->head + 1);
+}
+
+void trace_flush(void) {
+    if (!trace.active) {
+        return;
+    }
+    pthread_mutex_lock(&(trace.lock));
+    drain_rings();
+    pthread_mutex_unlock(&(trace.lock));
+}
+
+int trace_close(void) {
+    struct trace_ring* ring;
+    uint64_t dropped = 0;
+    int result;
+
+    if (!trace.active) {
+        return 0;
+    }
+    pthread_mutex_lock(&(trace.lock));
+    trace.stop = 1;
+    pthread_cond_signal(&(trace.wake));
+    pthread_mutex_unlock(&(trace.lock));
+    pthread_join(trace.thread, NULL);
+    trace.active = 0;
+
+    drain_rings();
+    while (trace.rings != NULL) {
+        ring = trace.rings;
+        trace.rings = ring->next;
+        fprintf(trace.output, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", (trace.written++ > 0) ? "," : "", (unsigned int)(ring->index + 1));
+        fprint_json_string(trace.output, (ring->name != NULL) ? ring->name : "thread");
+        fprintf(trace.output, "}}");
+        dropped += ring->dropped;
+        free(ring);
+    }
+    trace.ring_count = 0;
+    current = NULL;
+    fprintf(trace.output, "\n]}\n");
+    result = (fclose(trace.output) == 0 && !trace.failed) ? 0 : -1;
+    if (dropped > 0) {
+        fprintf(stderr, "WARNING: The trace lost %llu events, the threads recorded them faster than they could be written\n", (unsigned long long int)dropped);
+    }
+    return result;
+}
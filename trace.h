@@ -0,0 +1,25 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+#include <stdint.h>
+
+// Events each thread can hold until the flusher gets to them, a power of two. Events beyond that are dropped.
+#define TRACE_RING_EVENTS 0x4000
+// How often the flusher writes out what the threads recorded
+#define TRACE_FLUSH_INTERVAL_MS 50
+
+// Records a timeline in the Chrome trace event format (chrome://tracing, ui.perfetto.dev) to path.
+// Every thread records into a ring of its own without taking a lock, a thread of the trace writes them out.
+// Returns 0 on success.
+int trace_open(const char* path);
+// 1 between trace_open() and trace_close()
+int trace_active(void);
+// Names the calling thread in the timeline, name has to stay valid
+void trace_name_thread(const char* name);
+// Records a span from start to end of monotonic_nanoseconds() moving bytes in blocks. name and category
+// are not copied and have to stay valid until the next trace_flush().
+void trace_span(const char* name, const char* category, uint64_t start, uint64_t end, uint64_t bytes, uint64_t blocks);
+// Writes out everything recorded so far
+void trace_flush(void);
+// Writes out the rest, names the threads and closes the file. Returns 0 if the whole trace was written.
+int trace_close(void);
+#endif // _TRACE_H_
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "functions.h"
+#include "usage.h"
+
+struct usage_map* usage_map_create(uint64_t image_size) {
+    struct usage_map* map = (struct usage_map*)calloc(1, sizeof(struct usage_map));
+
+    if (map == NULL) {
+        return NULL;
+    }
+    map->image_size = image_size;
+    map->sector_count = (image_size + USAGE_SECTOR_SIZE - 1) / USAGE_SECTOR_SIZE;
+    map->bits = (uint8_t*)calloc((size_t)((map->sector_count + 7) / 8) + 1, 1);
+    if (map->bits == NULL) {
+        free(map);
+        return NULL;
+    }
+    return map;
+}
+
+void usage_map_free(struct usage_map* map) {
+    if (map == NULL) {
+        return;
+    }
+    free(map->bits);
+    free(map);
+}
+
+void usage_map_mark(struct usage_map* map, uint64_t offset, uint64_t length) {
+    uint64_t sector, last;
+
+    if (length == 0 || offset >= map->image_size) {
+        return;
+    }
+    last = (offset + length - 1) / USAGE_SECTOR_SIZE;
+    if (last >= map->sector_count) {
+        last = map->sector_count - 1;
+    }
+    for (sector = offset / USAGE_SECTOR_SIZE; sector <= last; sector++) {
+        if (!(map->bits[sector / 8] & (1 << (sector % 8)))) {
+            map->bits[sector / 8] |= (uint8_t)(1 << (sector % 8));
+            map->used_sectors++;
+        }
+    }
+}
+
+int usage_map_test(const struct usage_map* map, uint64_t offset, uint64_t length) {
+    uint64_t sector, last;
+
+    if (map == NULL) {
+        return 1;
+    }
+    if (length == 0 || offset >= map->image_size) {
+        return 0;
+    }
+    last = (offset + length - 1) / USAGE_SECTOR_SIZE;
+    if (last >= map->sector_count) {
+        last = map->sector_count - 1;
+    }
+    for (sector = offset / USAGE_SECTOR_SIZE; sector <= last; sector++) {
+        if (map->bits[sector / 8] & (1 << (sector % 8))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+uint64_t usage_map_count(const struct usage_map* map, uint64_t start, uint64_t end) {
+    uint64_t sector, used = 0;
+
+    for (sector = start / USAGE_SECTOR_SIZE; sector < map->sector_count && sector * USAGE_SECTOR_SIZE < end; sector++) {
+        if (map->bits[sector / 8] & (1 << (sector % 8))) {
+            used++;
+        }
+    }
+    return used * USAGE_SECTOR_SIZE;
+}
+
+void usage_map_mark_partition(struct usage_map* map, struct partition* partition, struct volume* volume, uint64_t end) {
+    uint64_t start = WIIU_DECRYPTED_AREA_OFFSET + partition->offset;
+    uint64_t base, first_block, last_block;
+    struct file** file;
+
+    if (!partition->has_key || volume->files == NULL) {
+        usage_map_mark(map, start, (end > start) ? end - start : 0);
+        return;
+    }
+
+    // The file table, which is the first cluster
+    usage_map_mark(map, start, 0x8000);
+    if (partition->cluster_count > 0) {
+        usage_map_mark(map, start + partition->clusters[0].offset, partition->clusters[0].size);
+    }
+
+    for (file = (struct file**)utarray_front(volume->files); file != NULL; file = (struct file**)utarray_next(volume->files, file)) {
+        if ((*file)->size <= 0) {
+            continue;
+        }
+        base = WIIU_DECRYPTED_AREA_OFFSET + (*file)->volume_base_offset + (*file)->data_section_offset;
+        if (file_is_hashed(*file)) {
+            // Whole blocks, hash header included
+            first_block = (uint64_t)(*file)->lba / 0xFC00;
+            last_block = (uint64_t)((*file)->lba + (*file)->size - 1) / 0xFC00;
+            usage_map_mark(map, base + (first_block * 0x10000), (last_block - first_block + 1) * 0x10000);
+        } else {
+            usage_map_mark(map, base + (uint64_t)(*file)->lba, (uint64_t)(*file)->size);
+        }
+    }
+}
+
+int usage_write_trimmed(struct image_source* infile, const struct usage_map* map, struct output_sink* sink, const char* path) {
+    uint8_t* buffer;
+    void* output;
+    uint64_t sector, run, offset, length, copy_size;
+    int result = 0;
+
+    buffer = (uint8_t*)malloc(USAGE_COPY_SIZE);
+    if (buffer == NULL) {
+        fprintf(stderr, "Could not allocate enough memory to trim the image\n");
+        return -1;
+    }
+    output = sink->open(sink, path, map->image_size);
+    if (output == NULL) {
+        fprintf(stderr, "Error: Could not open %s for writing\n", path);
+        free(buffer);
+        return -1;
+    }
+
+    image_hint(infile, IMAGE_HINT_SEQUENTIAL, 0, 0);
+    for (sector = 0; sector < map->sector_count && result == 0; sector = run) {
+        if (!(map->bits[sector / 8] & (1 << (sector % 8)))) {
+            run = sector + 1;
+            continue;
+        }
+        // Copy each run of used sectors in one go
+        for (run = sector; run < map->sector_count && (map->bits[run / 8] & (1 << (run % 8))); run++) {
+        }
+        offset = sector * USAGE_SECTOR_SIZE;
+        length = ((run * USAGE_SECTOR_SIZE > map->image_size) ? map->image_size : run * USAGE_SECTOR_SIZE) - offset;
+        image_release(infile, offset);
+        for (; length > 0 && result == 0; length -= copy_size, offset += copy_size) {
+            copy_size = (length > USAGE_COPY_SIZE) ? USAGE_COPY_SIZE : length;
+            if (readFileOffsetBuffer(offset, buffer, (size_t)copy_size, infile) != copy_size) {
+                fprintf(stderr, "Error: Couldn't read expected input at 0x%llX\n", (unsigned long long int)offset);
+                result = -1;
+            } else if (sink->write_at(sink, output, buffer, (size_t)copy_size, offset) != 0) {
+                fprintf(stderr, "Error: Couldn't write expected output for %s\n", path);
+                result = -1;
+            }
+        }
+    }
+    free(buffer);
+    if (sink->close(sink, output) != 0) {
+        result = -1;
+    }
+    return result;
+}
@@ -0,0 +1,38 @@
+#ifndef _USAGE_H_
+#define _USAGE_H_
+#include <stdint.h>
+#include <stdio.h>
+#include "struct.h"
+#include "image.h"
+#include "sink.h"
+
+// Granularity of the map, the unit partitions and clusters are laid out in
+#define USAGE_SECTOR_SIZE 0x8000
+// Bytes copied at once while trimming
+#define USAGE_COPY_SIZE (4 * 1024 * 1024)
+
+// Which sectors of an image hold anything a disc reader would look at: the disc header and partition
+// table, the file table of each partition and the extents of its files. Everything else is padding.
+struct usage_map {
+    uint64_t image_size;
+    uint64_t sector_count;
+    uint64_t used_sectors;
+    uint8_t* bits;
+};
+
+struct usage_map* usage_map_create(uint64_t image_size);
+void usage_map_free(struct usage_map* map);
+// Marks every sector overlapping length bytes at offset as used
+void usage_map_mark(struct usage_map* map, uint64_t offset, uint64_t length);
+// 1 if any sector overlapping length bytes at offset is used, a NULL map counts as fully used
+int usage_map_test(const struct usage_map* map, uint64_t offset, uint64_t length);
+// Used bytes between start and end
+uint64_t usage_map_count(const struct usage_map* map, uint64_t start, uint64_t end);
+
+// Marks what partition uses. Without a key its layout is unknown, so everything up to end is kept.
+void usage_map_mark_partition(struct usage_map* map, struct partition* partition, struct volume* volume, uint64_t end);
+
+// Copies the used sectors of infile into a new image of the same size at path, leaving the rest
+// unwritten so it becomes holes on a sparse sink. The image is read front to back. Returns 0 on success.
+int usage_write_trimmed(struct image_source* infile, const struct usage_map* map, struct output_sink* sink, const char* path);
+#endif // _USAGE_H_
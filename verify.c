@@ -0,0 +1,394 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "functions.h"
+#include "aes.h"
+#include "sha1.h"
+#include "stats.h"
+#include "verify.h"
+#include "probes.h"
+
+// A run of blocks of one cluster, the unit handed to a worker
+struct verify_chunk {
+    uint16_t cluster;
+    uint64_t first_block;
+    uint32_t count;
+};
+
+struct verify_bad_block {
+    uint64_t offset;
+    uint16_t cluster;
+    uint64_t block;
+    int error;
+};
+
+// Hash of the H2 table of a block whose header had to be checked, compared across its group at the end
+struct verify_h2 {
+    uint64_t offset;
+    uint16_t cluster;
+    uint64_t block;
+    uint8_t sha1[0x14];
+};
+
+// Headers a worker already checked. All blocks of a group of 16 carry the same header and all of a
+// group of 256 the same H1 table, so only the first block of a group needs any hashing.
+struct verify_tree {
+    uint16_t cluster;
+    int header_valid;
+    uint64_t header_group;
+    uint8_t header[0x3C0];
+    int h1_valid;
+    uint64_t h1_group;
+    uint8_t h1[0x140];
+};
+
+static const UT_icd verify_chunk_icd = { sizeof(struct verify_chunk), NULL, NULL, NULL };
+static const UT_icd verify_bad_block_icd = { sizeof(struct verify_bad_block), NULL, NULL, NULL };
+static const UT_icd verify_h2_icd = { sizeof(struct verify_h2), NULL, NULL, NULL };
+
+struct verify_job {
+    struct image_source* infile;
+    struct partition* partition;
+    UT_array* chunks;
+    int level;
+
+    pthread_mutex_t lock;
+    // Chunks are handed out in order, so all workers read close to each other
+    uint32_t next_chunk;
+    UT_array* bad_blocks;
+    UT_array* h2_tables;
+    uint64_t checked;
+};
+
+static uint64_t block_image_offset(struct partition* partition, uint16_t cluster, uint64_t block) {
+    return WIIU_DECRYPTED_AREA_OFFSET + partition->offset + partition->clusters[cluster].offset + (block * 0x10000);
+}
+
+// Checks the H0 table of a decrypted header against H1 and, from level 2 on, the H1 table against H2.
+// hashed is set if the header wasn't a copy of one checked before. Returns 0 or the error.
+static int verify_tree_header(struct verify_tree* tree, int level, uint16_t cluster, uint64_t block, const uint8_t* header, int* hashed) {
+    uint8_t sha1[0x14];
+
+    *hashed = 0;
+    if (tree->cluster != cluster) {
+        tree->cluster = cluster;
+        tree->header_valid = 0;
+        tree->h1_valid = 0;
+    }
+    if (tree->header_valid && tree->header_group == block / 16 && memcmp(tree->header, header, 0x3C0) == 0) {
+        return 0;
+    }
+    *hashed = 1;
+
+    mbedtls_sha1(header, 0x140, sha1);
+    if (memcmp(sha1, header + 0x140 + ((block / 16) % 16) * 0x14, 0x14) != 0) {
+        return VERIFY_ERROR_H1;
+    }
+    if (level >= VERIFY_LEVEL_H2 && !(tree->h1_valid && tree->h1_group == block / 256 && memcmp(tree->h1, header + 0x140, 0x140) == 0)) {
+        mbedtls_sha1(header + 0x140, 0x140, sha1);
+        if (memcmp(sha1, header + 0x280 + ((block / 256) % 16) * 0x14, 0x14) != 0) {
+            return VERIFY_ERROR_H2;
+        }
+        memcpy(tree->h1, header + 0x140, 0x140);
+        tree->h1_group = block / 256;
+        tree->h1_valid = 1;
+    }
+
+    memcpy(tree->header, header, 0x3C0);
+    tree->header_group = block / 16;
+    tree->header_valid = 1;
+    return 0;
+}
+
+static void* verify_worker(void* arg) {
+    struct verify_job* job = (struct verify_job*)arg;
+    struct verify_chunk* chunk;
+    struct verify_bad_block bad[VERIFY_CHUNK_BLOCKS];
+    struct verify_h2 h2[VERIFY_CHUNK_BLOCKS];
+    struct verify_tree tree;
+    struct AES128_ctx ctx;
+    uint8_t decrypted_header[0x400];
+    uint8_t iv[16];
+    uint8_t* blocks;
+    uint32_t bad_count, h2_count, blocks_read, k;
+    int error, hashed;
+
+    stats_name_thread("verify");
+    blocks = (uint8_t*)malloc(VERIFY_CHUNK_BLOCKS * 0x10000);
+    if (blocks == NULL) {
+        return NULL;
+    }
+    AES128_init_ctx(&ctx, job->partition->key);
+    memset(&tree, 0, sizeof(tree));
+
+    for (;;) {
+        pthread_mutex_lock(&(job->lock));
+        chunk = (struct verify_chunk*)utarray_eltptr(job->chunks, job->next_chunk);
+        if (chunk != NULL) {
+            job->next_chunk++;
+        }
+        pthread_mutex_unlock(&(job->lock));
+        if (chunk == NULL) {
+            break;
+        }
+
+        memset(iv, 0, 16);
+        iv[0] = (uint8_t)(chunk->cluster >> 8);
+        iv[1] = (uint8_t)(chunk->cluster & 0xFF);
+        blocks_read = (uint32_t)(readFileOffsetBuffer(block_image_offset(job->partition, chunk->cluster, chunk->first_block), blocks, chunk->count * 0x10000, job->infile) / 0x10000);
+
+        bad_count = 0;
+        h2_count = 0;
+        for (k = 0; k < chunk->count; k++) {
+            bad[bad_count].offset = block_image_offset(job->partition, chunk->cluster, chunk->first_block + k);
+            bad[bad_count].cluster = chunk->cluster;
+            bad[bad_count].block = chunk->first_block + k;
+            hashed = 0;
+            if (k >= blocks_read) {
+                error = VERIFY_ERROR_READ;
+            } else if (decrypt_hashed_block(&ctx, blocks + (k * 0x10000), iv, chunk->cluster, (int64_t)(chunk->first_block + k), decrypted_header, blocks + (k * 0x10000) + 0x400) != 0) {
+                error = VERIFY_ERROR_H0;
+            } else if (job->level >= VERIFY_LEVEL_H1) {
+                error = verify_tree_header(&tree, job->level, chunk->cluster, chunk->first_block + k, decrypted_header, &hashed);
+            } else {
+                error = 0;
+            }
+
+            if (error >= VERIFY_ERROR_H1) {
+                PROBE_HASH_MISMATCH(chunk->cluster, chunk->first_block + k, error - VERIFY_ERROR_H0);
+            }
+            if (error != 0) {
+                bad[bad_count++].error = error;
+            } else if (hashed && job->level >= VERIFY_LEVEL_H3) {
+                h2[h2_count].offset = bad[bad_count].offset;
+                h2[h2_count].cluster = chunk->cluster;
+                h2[h2_count].block = chunk->first_block + k;
+                mbedtls_sha1(decrypted_header + 0x280, 0x140, h2[h2_count++].sha1);
+            }
+        }
+
+        pthread_mutex_lock(&(job->lock));
+        job->checked += blocks_read;
+        for (k = 0; k < bad_count; k++) {
+            utarray_push_back(job->bad_blocks, &bad[k]);
+        }
+        for (k = 0; k < h2_count; k++) {
+            utarray_push_back(job->h2_tables, &h2[k]);
+        }
+        pthread_mutex_unlock(&(job->lock));
+    }
+    free(blocks);
+    return NULL;
+}
+
+// Both start with their image offset
+static int offset_cmp(const void* e1, const void* e2) {
+    uint64_t offset1 = *(const uint64_t*)e1;
+    uint64_t offset2 = *(const uint64_t*)e2;
+
+    return (offset1 > offset2) - (offset1 < offset2);
+}
+
+// Without the H3 table from the TMD, the H2 table most checked blocks of a group of 4096 agree on stands in
+// for it and the blocks differing from it are bad. Without a majority every block of the group is.
+static void verify_h2_group(struct verify_job* job, struct verify_h2* group, uint32_t count) {
+    struct verify_h2* reference = NULL;
+    struct verify_bad_block bad;
+    uint32_t i, votes = 0;
+
+    // Boyer-Moore vote, the candidate only has a majority if it really is the table of more than half
+    for (i = 0; i < count; i++) {
+        if (votes == 0) {
+            reference = &group[i];
+            votes = 1;
+        } else if (memcmp(reference->sha1, group[i].sha1, 0x14) == 0) {
+            votes++;
+        } else {
+            votes--;
+        }
+    }
+    votes = 0;
+    for (i = 0; i < count; i++) {
+        votes += (memcmp(reference->sha1, group[i].sha1, 0x14) == 0);
+    }
+    if (votes * 2 <= count) {
+        reference = NULL;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (reference != NULL && memcmp(reference->sha1, group[i].sha1, 0x14) == 0) {
+            continue;
+        }
+        bad.offset = group[i].offset;
+        bad.cluster = group[i].cluster;
+        bad.block = group[i].block;
+        bad.error = (reference != NULL) ? VERIFY_ERROR_H3 : VERIFY_ERROR_H3_GROUP;
+        PROBE_HASH_MISMATCH(group[i].cluster, group[i].block, 3);
+        utarray_push_back(job->bad_blocks, &bad);
+    }
+}
+
+static void verify_h2_groups(struct verify_job* job) {
+    struct verify_h2* h2;
+    struct verify_h2* first = NULL;
+    uint32_t count = 0;
+
+    utarray_sort(job->h2_tables, offset_cmp);
+    for (h2 = (struct verify_h2*)utarray_front(job->h2_tables); h2 != NULL; h2 = (struct verify_h2*)utarray_next(job->h2_tables, h2)) {
+        if (first != NULL && (first->cluster != h2->cluster || first->block / 4096 != h2->block / 4096)) {
+            verify_h2_group(job, first, count);
+            first = NULL;
+        }
+        if (first == NULL) {
+            first = h2;
+            count = 0;
+        }
+        count++;
+    }
+    if (first != NULL) {
+        verify_h2_group(job, first, count);
+    }
+}
+
+static const char* verify_error_name(int error) {
+    switch (error) {
+    case VERIFY_ERROR_READ:
+        return "read";
+    case VERIFY_ERROR_H1:
+        return "h1";
+    case VERIFY_ERROR_H2:
+        return "h2";
+    case VERIFY_ERROR_H3:
+        return "h3";
+    case VERIFY_ERROR_H3_GROUP:
+        return "h3-group";
+    default:
+        return "h0";
+    }
+}
+
+static void report_bad_block(FILE* report, struct partition* partition, struct volume* volume, struct verify_bad_block* bad) {
+    struct partition_entry* entry;
+    struct file** file;
+    uint64_t data_start = bad->block * 0xFC00;
+    char path[1100];
+    int first = 1;
+
+    fprintf(report, "{\"type\":\"bad_block\",\"partition\":");
+    fprint_json_string(report, partition->name);
+    fprintf(report, ",\"cluster\":%u,\"block\":%llu,\"offset\":%llu,\"error\":\"%s\",\"files\":[", (unsigned int)bad->cluster,
+        (unsigned long long int)bad->block, (unsigned long long int)bad->offset,
+        verify_error_name(bad->error));
+
+    // Every file with data inside the block is affected
+    for (file = (struct file**)utarray_front(volume->files); file != NULL; file = (struct file**)utarray_next(volume->files, file)) {
+        entry = (struct partition_entry*)utarray_eltptr(partition->entries, (*file)->entry_id);
+        if (entry->starting_cluster != bad->cluster || (*file)->size == 0
+            || (uint64_t)(*file)->lba >= data_start + 0xFC00 || (uint64_t)((*file)->lba + (*file)->size) <= data_start) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", (*file)->parent, (*file)->filename);
+        if (!first) {
+            fputc(',', report);
+        }
+        fprint_json_string(report, path);
+        first = 0;
+    }
+    fprintf(report, "]}\n");
+}
+
+int verify_partition(struct image_source* infile, struct partition* partition, struct volume* volume, const struct usage_map* usage, int level, uint32_t threads, FILE* report, struct verify_result* result) {
+    struct verify_job job;
+    struct verify_chunk chunk;
+    struct verify_bad_block* bad;
+    pthread_t* workers;
+    uint16_t* order;
+    uint64_t block_count, block;
+    uint32_t c, started;
+
+    memset(result, 0, sizeof(struct verify_result));
+    memset(&job, 0, sizeof(job));
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    // Clusters are walked in the order they are stored, each split into chunks
+    order = sort_clusters_by_offset(partition);
+    workers = (pthread_t*)malloc(threads * sizeof(pthread_t));
+    if (order == NULL || workers == NULL) {
+        free(order);
+        free(workers);
+        return -1;
+    }
+    utarray_new(job.chunks, &verify_chunk_icd);
+    utarray_new(job.bad_blocks, &verify_bad_block_icd);
+    utarray_new(job.h2_tables, &verify_h2_icd);
+    for (c = 0; c < partition->cluster_count; c++) {
+        if (!cluster_is_hashed(partition, order[c])) {
+            result->unhashed_bytes += partition->clusters[order[c]].size;
+            continue;
+        }
+        block_count = partition->clusters[order[c]].size / 0x10000;
+        chunk.cluster = order[c];
+        chunk.count = 0;
+        // Runs of blocks holding file data, the rest is padding nothing ever reads
+        for (block = 0; block < block_count; block++) {
+            if (!usage_map_test(usage, block_image_offset(partition, order[c], block), 0x10000)) {
+                result->skipped_blocks++;
+            } else if (chunk.count > 0 && chunk.first_block + chunk.count == block && chunk.count < VERIFY_CHUNK_BLOCKS) {
+                chunk.count++;
+            } else {
+                if (chunk.count > 0) {
+                    utarray_push_back(job.chunks, &chunk);
+                }
+                chunk.first_block = block;
+                chunk.count = 1;
+            }
+        }
+        if (chunk.count > 0) {
+            utarray_push_back(job.chunks, &chunk);
+        }
+    }
+    free(order);
+
+    job.infile = infile;
+    job.partition = partition;
+    job.level = level;
+    pthread_mutex_init(&(job.lock), NULL);
+    image_hint(infile, IMAGE_HINT_SEQUENTIAL, WIIU_DECRYPTED_AREA_OFFSET + partition->offset, 0);
+    for (started = 0; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, verify_worker, &job) != 0) {
+            break;
+        }
+    }
+    // Without any thread the work is done right here
+    if (started == 0) {
+        verify_worker(&job);
+    }
+    for (c = 0; c < started; c++) {
+        pthread_join(workers[c], NULL);
+    }
+    pthread_mutex_destroy(&(job.lock));
+    free(workers);
+
+    verify_h2_groups(&job);
+    utarray_sort(job.bad_blocks, offset_cmp);
+    for (bad = (struct verify_bad_block*)utarray_front(job.bad_blocks); bad != NULL; bad = (struct verify_bad_block*)utarray_next(job.bad_blocks, bad)) {
+        report_bad_block(report, partition, volume, bad);
+    }
+    result->hashed_blocks = job.checked;
+    result->bad_blocks = utarray_len(job.bad_blocks);
+
+    fprintf(report, "{\"type\":\"summary\",\"partition\":");
+    fprint_json_string(report, partition->name);
+    fprintf(report, ",\"level\":%d,\"hashed_blocks\":%llu,\"skipped_blocks\":%llu,\"unhashed_bytes\":%llu,\"bad_blocks\":%llu}\n", level,
+        (unsigned long long int)result->hashed_blocks, (unsigned long long int)result->skipped_blocks, (unsigned long long int)result->unhashed_bytes, (unsigned long long int)result->bad_blocks);
+    fflush(report);
+
+    utarray_free(job.chunks);
+    utarray_free(job.bad_blocks);
+    utarray_free(job.h2_tables);
+    return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef _VERIFY_H_
+#define _VERIFY_H_
+#include <stdint.h>
+#include <stdio.h>
+#include "struct.h"
+#include "image.h"
+#include "usage.h"
+
+// Blocks one worker checks at a time, 4 MiB of hashed blocks
+#define VERIFY_CHUNK_BLOCKS 64
+
+// Why a block failed verification
+#define VERIFY_ERROR_READ 1
+#define VERIFY_ERROR_H0 2
+#define VERIFY_ERROR_H1 3
+#define VERIFY_ERROR_H2 4
+#define VERIFY_ERROR_H3 5
+// The H2 tables of a group of 4096 blocks disagree without a majority, so none can be trusted
+#define VERIFY_ERROR_H3_GROUP 6
+
+// How much of the hash tree in the 0x400 byte header of every hashed block is checked. Each level
+// includes the ones below it: the data against its H0 entry, the H0 table against its H1 entry, the
+// H1 table against its H2 entry, and finally the H2 table of every block against the one most blocks of
+// its group of 4096 agree on. The H3 table itself lives in the TMD, which isn't read.
+#define VERIFY_LEVEL_H0 0
+#define VERIFY_LEVEL_H1 1
+#define VERIFY_LEVEL_H2 2
+#define VERIFY_LEVEL_H3 3
+
+struct verify_result {
+    uint64_t hashed_blocks;
+    // Blocks the usage map marks as padding, left unchecked
+    uint64_t skipped_blocks;
+    // Unhashed clusters carry no hashes and can't be checked
+    uint64_t unhashed_bytes;
+    uint64_t bad_blocks;
+};
+
+// Checks every block of every hashed cluster of partition up to level with threads workers, in physical
+// order and without writing anything. Upper tables are only hashed once per group of blocks sharing them.
+// Blocks usage marks as unused are skipped, NULL checks all of them. Each bad block is reported to report as a JSON line, together with the files
+// of volume it affects, followed by a summary line. The image has to support reads from several threads.
+// Returns 0 if the partition could be checked, whatever was found.
+int verify_partition(struct image_source* infile, struct partition* partition, struct volume* volume, const struct usage_map* usage, int level, uint32_t threads, FILE* report, struct verify_result* result);
+#endif // _VERIFY_H_
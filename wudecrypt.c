@@ -0,0 +1,657 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "utarray.h"
+#include "struct.h"
+#include "functions.h"
+#include "cache.h"
+#include "image.h"
+#include "store.h"
+#include "verify.h"
+#include "dump.h"
+#include "usage.h"
+#include "stats.h"
+#include "trace.h"
+#include "probes.h"
+#include "sha1.h"
+#include "wudecrypt.h"
+
+// Shared cache of decrypted blocks for wud_read(), 256 blocks are up to 16 MiB
+#define WUD_CACHE_BLOCKS 256
+#define WUD_READAHEAD_BLOCKS 8
+
+struct wud_context {
+    struct image_source* image;
+    uint8_t commonkey[16];
+    uint8_t disckey[16];
+
+    // Big enough for the *_LENGTH fields of config.h plus terminator
+    char game_serial[16];
+    char game_revision[16];
+    char system_version[16];
+    char game_region[16];
+
+    uint32_t partition_count;
+    struct partition* partitions;
+    struct volume* volumes;
+    // Partitions below this index have their file tables read, all of them unless streaming
+    uint32_t loaded_count;
+    UT_array* titlekeys;
+
+    struct block_cache* cache;
+    struct content_store* store;
+    // Set by wud_build_usage(), lets verification skip padding
+    struct usage_map* usage;
+    // Image offsets of the files wud_set_shard() left to this worker
+    uint64_t shard_start;
+    uint64_t shard_end;
+};
+
+static int read_disc_string(wud_context* context, uint64_t offset, char* output, size_t length) {
+    if (readFileOffsetBuffer(offset, output, length, context->image) != length) {
+        return -1;
+    }
+    output[length] = '\0';
+    return 0;
+}
+
+// Reads the file tables of all partitions up to count, a stream can only move forward doing so
+static int load_partitions(wud_context* context, uint32_t count) {
+    struct partition* partition;
+    uint64_t start;
+
+    if (count > context->partition_count) {
+        count = context->partition_count;
+    }
+    while (context->loaded_count < count) {
+        partition = &(context->partitions[context->loaded_count]);
+        image_release(context->image, WIIU_DECRYPTED_AREA_OFFSET + partition->offset);
+        start = stats_start();
+        if (read_partition(context->image, partition, context->commonkey, context->disckey, context->titlekeys) != 0) {
+            return -1;
+        }
+        if (partition->has_key) {
+            init_volume(&(context->volumes[context->loaded_count]), partition);
+        }
+        stats_stop(STATS_METADATA, start, 0, 0);
+        context->loaded_count++;
+    }
+    return 0;
+}
+
+static wud_context* open_context(struct image_source* image, const uint8_t* commonkey, const uint8_t* disckey) {
+    wud_context* context;
+    char sysversion[16];
+
+    context = (wud_context*)calloc(1, sizeof(wud_context));
+    if (context == NULL) {
+        fprintf(stderr, "Could not allocate enough memory for the image context\n");
+        image_close(image);
+        return NULL;
+    }
+    context->image = image;
+    context->shard_end = UINT64_MAX;
+    // Streams don't know their size, everything else has to at least hold the partition table
+    if (image_size(image) != 0 && image_size(image) < WIIU_DECRYPTED_AREA_OFFSET + 0x8000) {
+        fprintf(stderr, "Image is too small to be a WUD\n");
+        image_close(image);
+        free(context);
+        return NULL;
+    }
+    memcpy(context->commonkey, commonkey, 16);
+    memcpy(context->disckey, disckey, 16);
+    utarray_new(context->titlekeys, &titlekey_icd);
+
+    // The disc header is "<serial>_<revision>_<system version><region>"
+    if (read_disc_string(context, 0, context->game_serial, GAME_SERIAL_LENGTH) != 0
+        || read_disc_string(context, GAME_SERIAL_LENGTH + 1, context->game_revision, GAME_VER_LENGTH) != 0
+        || read_disc_string(context, GAME_SERIAL_LENGTH + GAME_VER_LENGTH + 2, sysversion, SYS_VER_LENGTH) != 0
+        || read_disc_string(context, GAME_SERIAL_LENGTH + GAME_VER_LENGTH + SYS_VER_LENGTH + 2, context->game_region, REGION_LENGTH) != 0) {
+        fprintf(stderr, "Couldn't read disc header from image\n");
+        wud_close(context);
+        return NULL;
+    }
+    if (memcmp(context->game_serial, MAGIC_BYTES, 4) != 0) {
+        fprintf(stderr, "WARNING: Most probably no valid WUD image\nTrying to continue anyways, although errors are expected!\n\n");
+    }
+    sprintf(context->system_version, "%c.%c.%c", sysversion[0], sysversion[1], sysversion[2]);
+
+    context->partitions = read_partition_table(context->image, context->disckey, &(context->partition_count));
+    if (context->partitions == NULL) {
+        wud_close(context);
+        return NULL;
+    }
+
+    context->volumes = (struct volume*)calloc(context->partition_count, sizeof(struct volume));
+    context->cache = block_cache_create(WUD_CACHE_BLOCKS, WUD_READAHEAD_BLOCKS);
+    if (context->volumes == NULL || context->cache == NULL) {
+        wud_close(context);
+        return NULL;
+    }
+
+    return context;
+}
+
+wud_context* wud_open(const char* image_path, const uint8_t* commonkey, const uint8_t* disckey) {
+    struct image_source* image;
+
+    image = image_open(image_path);
+    if (image == NULL) {
+        fprintf(stderr, "Could not open WUD image\n");
+        return NULL;
+    }
+    return wud_open_source(image, commonkey, disckey);
+}
+
+wud_context* wud_open_stream(FILE* input, const uint8_t* commonkey, const uint8_t* disckey) {
+    struct image_source* image;
+
+    image = image_open_stream(input);
+    if (image == NULL) {
+        fprintf(stderr, "Could not allocate enough memory for the input stream\n");
+        return NULL;
+    }
+    return wud_open_source(image, commonkey, disckey);
+}
+
+wud_context* wud_open_source(struct image_source* image, const uint8_t* commonkey, const uint8_t* disckey) {
+    wud_context* context;
+
+    context = open_context(image, commonkey, disckey);
+    // A stream doesn't know its size and reads each file table only when it gets there
+    if (context != NULL && image_size(image) != 0 && load_partitions(context, context->partition_count) != 0) {
+        wud_close(context);
+        return NULL;
+    }
+    return context;
+}
+
+void wud_close(wud_context* context) {
+    uint32_t i;
+
+    if (context == NULL) {
+        return;
+    }
+    if (context->volumes != NULL) {
+        for (i = 0; i < context->partition_count; i++) {
+            free_volume(&(context->volumes[i]));
+        }
+        free(context->volumes);
+    }
+    free_partitions(context->partitions, context->partition_count);
+    block_cache_free(context->cache);
+    store_close(context->store);
+    usage_map_free(context->usage);
+    utarray_free(context->titlekeys);
+    image_close(context->image);
+    free(context);
+}
+
+const char* wud_game_serial(wud_context* context) {
+    return context->game_serial;
+}
+
+const char* wud_game_revision(wud_context* context) {
+    return context->game_revision;
+}
+
+const char* wud_system_version(wud_context* context) {
+    return context->system_version;
+}
+
+const char* wud_game_region(wud_context* context) {
+    return context->game_region;
+}
+
+uint32_t wud_partition_count(wud_context* context) {
+    return context->partition_count;
+}
+
+const char* wud_partition_name(wud_context* context, uint32_t partition) {
+    return (partition < context->partition_count) ? context->partitions[partition].name : NULL;
+}
+
+uint64_t wud_partition_offset(wud_context* context, uint32_t partition) {
+    return (partition < context->partition_count) ? context->partitions[partition].offset : 0;
+}
+
+const uint8_t* wud_partition_key(wud_context* context, uint32_t partition) {
+    if (load_partitions(context, partition + 1) != 0 || partition >= context->partition_count || !context->partitions[partition].has_key) {
+        return NULL;
+    }
+    return context->partitions[partition].key;
+}
+
+struct directory* wud_partition_root(wud_context* context, uint32_t partition) {
+    if (load_partitions(context, partition + 1) != 0) {
+        return NULL;
+    }
+    return (partition < context->partition_count) ? context->volumes[partition].root_directory : NULL;
+}
+
+uint32_t wud_file_count(wud_context* context, uint32_t partition) {
+    if (load_partitions(context, partition + 1) != 0 || partition >= context->partition_count || context->volumes[partition].files == NULL) {
+        return 0;
+    }
+    return utarray_len(context->volumes[partition].files);
+}
+
+struct file* wud_file(wud_context* context, uint32_t partition, uint32_t index) {
+    struct file** file;
+
+    if (index >= wud_file_count(context, partition)) {
+        return NULL;
+    }
+    file = (struct file**)utarray_eltptr(context->volumes[partition].files, index);
+    return *file;
+}
+
+const char* wud_file_name(struct file* file) {
+    return file->filename;
+}
+
+const char* wud_file_parent(struct file* file) {
+    return file->parent;
+}
+
+uint64_t wud_file_size(struct file* file) {
+    return (uint64_t)file->size;
+}
+
+int wud_lookup(wud_context* context, const char* path, struct directory** dir, struct file** file) {
+    const char* component;
+    const char* end;
+    size_t length;
+    uint32_t i;
+    int partition = -1;
+    struct directory* subdir;
+    struct file* entry;
+
+    *dir = NULL;
+    *file = NULL;
+    if (load_partitions(context, context->partition_count) != 0) {
+        return -1;
+    }
+
+    component = path;
+    while (*component == '/') {
+        component++;
+    }
+    if (*component == '\0') {
+        return -1;
+    }
+
+    // The first component selects the partition by name
+    end = strchr(component, '/');
+    length = (end != NULL) ? (size_t)(end - component) : strlen(component);
+    for (i = 0; i < context->partition_count; i++) {
+        if (context->volumes[i].root_directory != NULL && strlen(context->volumes[i].identifier) == length && strncmp(context->volumes[i].identifier, component, length) == 0) {
+            partition = (int)i;
+            break;
+        }
+    }
+    if (partition < 0) {
+        return -1;
+    }
+    *dir = context->volumes[partition].root_directory;
+
+    for (component += length; *component != '\0'; component += length) {
+        while (*component == '/') {
+            component++;
+        }
+        if (*component == '\0') {
+            break;
+        }
+        if (*file != NULL) {
+            *file = NULL;
+            return -1;
+        }
+
+        end = strchr(component, '/');
+        length = (end != NULL) ? (size_t)(end - component) : strlen(component);
+
+        for (subdir = (struct directory*)utarray_front((*dir)->subdirs); subdir != NULL; subdir = (struct directory*)utarray_next((*dir)->subdirs, subdir)) {
+            if (strlen(subdir->directory_name) == length && strncmp(subdir->directory_name, component, length) == 0) {
+                break;
+            }
+        }
+        if (subdir != NULL) {
+            *dir = subdir;
+            continue;
+        }
+
+        for (entry = (struct file*)utarray_front((*dir)->files); entry != NULL; entry = (struct file*)utarray_next((*dir)->files, entry)) {
+            if (strlen(entry->filename) == length && strncmp(entry->filename, component, length) == 0) {
+                break;
+            }
+        }
+        if (entry == NULL) {
+            *dir = NULL;
+            return -1;
+        }
+        *file = entry;
+        *dir = NULL;
+    }
+
+    return partition;
+}
+
+int64_t wud_read(wud_context* context, struct file* file, uint64_t offset, size_t length, uint8_t* buffer) {
+    return read_file_data(context->image, file, context->cache, offset, buffer, length);
+}
+
+static struct content_store* context_store(wud_context* context) {
+    if (context->store == NULL) {
+        context->store = store_open();
+    }
+    return context->store;
+}
+
+int wud_set_store(wud_context* context, const char* path) {
+    if (context_store(context) == NULL) {
+        return -1;
+    }
+    return store_set_root(context->store, path);
+}
+
+int wud_add_previous(wud_context* context, const char* path) {
+    if (context_store(context) == NULL) {
+        return -1;
+    }
+    return store_load_index(context->store, path);
+}
+
+int wud_write_index(wud_context* context) {
+    return (context_store(context) != NULL) ? 0 : -1;
+}
+
+void wud_store_stats(wud_context* context, uint64_t* reused, uint64_t* reused_bytes, uint64_t* added) {
+    *reused = (context->store != NULL) ? context->store->hits : 0;
+    *reused_bytes = (context->store != NULL) ? context->store->hit_bytes : 0;
+    *added = (context->store != NULL) ? context->store->added : 0;
+}
+
+int wud_verify_partition(wud_context* context, uint32_t partition, int level, uint32_t threads, FILE* report, uint64_t* bad_blocks) {
+    struct verify_result result;
+    uint64_t start;
+
+    if (wud_partition_root(context, partition) == NULL || !context->partitions[partition].has_key) {
+        return -1;
+    }
+    start = stats_start();
+    PROBE_PARTITION_START(context->partitions[partition].name, WIIU_DECRYPTED_AREA_OFFSET + context->partitions[partition].offset);
+    if (verify_partition(context->image, &(context->partitions[partition]), &(context->volumes[partition]), context->usage, level, threads, report, &result) != 0) {
+        return -1;
+    }
+    PROBE_PARTITION_END(context->partitions[partition].name, WIIU_DECRYPTED_AREA_OFFSET + context->partitions[partition].offset);
+    trace_span(context->partitions[partition].name, "partition", start, monotonic_nanoseconds(), 0, 0);
+    *bad_blocks = result.bad_blocks;
+    return 0;
+}
+
+// Partitions have no size of their own, each one ends where the next one starts
+static uint64_t partition_end(wud_context* context, uint32_t partition) {
+    uint64_t end = context->usage->image_size;
+    uint32_t i;
+
+    for (i = 0; i < context->partition_count; i++) {
+        if (context->partitions[i].offset > context->partitions[partition].offset && WIIU_DECRYPTED_AREA_OFFSET + context->partitions[i].offset < end) {
+            end = WIIU_DECRYPTED_AREA_OFFSET + context->partitions[i].offset;
+        }
+    }
+    return end;
+}
+
+int wud_build_usage(wud_context* context) {
+    uint32_t i;
+
+    if (context->usage != NULL) {
+        return 0;
+    }
+    if (image_size(context->image) == 0 || load_partitions(context, context->partition_count) != 0) {
+        return -1;
+    }
+    context->usage = usage_map_create(image_size(context->image));
+    if (context->usage == NULL) {
+        fprintf(stderr, "Could not allocate enough memory for the usage map\n");
+        return -1;
+    }
+    // The disc header and the partition table
+    usage_map_mark(context->usage, 0, WIIU_DECRYPTED_AREA_OFFSET + 0x8000);
+    for (i = 0; i < context->partition_count; i++) {
+        usage_map_mark_partition(context->usage, &(context->partitions[i]), &(context->volumes[i]), partition_end(context, i));
+    }
+    return 0;
+}
+
+void wud_usage_report(wud_context* context, FILE* output) {
+    struct usage_map* map = context->usage;
+    uint64_t start, used;
+    uint32_t i;
+
+    if (map == NULL) {
+        return;
+    }
+    for (i = 0; i < context->partition_count; i++) {
+        start = WIIU_DECRYPTED_AREA_OFFSET + context->partitions[i].offset;
+        used = usage_map_count(map, start, partition_end(context, i));
+        fprintf(output, "\t%-20s %8llu MiB used of %8llu MiB%s\n", context->partitions[i].name, (unsigned long long int)(used / (1024 * 1024)),
+            (unsigned long long int)((partition_end(context, i) - start) / (1024 * 1024)), context->partitions[i].has_key ? "" : " (no key, kept whole)");
+    }
+    fprintf(output, "Used: %llu of %llu MiB (%.1f%%)\n", (unsigned long long int)(map->used_sectors * USAGE_SECTOR_SIZE / (1024 * 1024)),
+        (unsigned long long int)(map->image_size / (1024 * 1024)), (map->sector_count > 0) ? (100.0 * map->used_sectors / map->sector_count) : 0.0);
+}
+
+int wud_write_trimmed(wud_context* context, const char* path, struct output_sink* sink) {
+    struct output_sink* filesystem = NULL;
+    int result;
+
+    if (wud_build_usage(context) != 0) {
+        return -1;
+    }
+    if (sink == NULL) {
+        filesystem = sink_create_filesystem(SINK_FILESYSTEM_SPARSE);
+        if (filesystem == NULL) {
+            return -1;
+        }
+        sink = filesystem;
+    }
+    result = usage_write_trimmed(context->image, context->usage, sink, path);
+    if (filesystem != NULL) {
+        if (sink_finish(filesystem) != 0) {
+            result = -1;
+        }
+        sink_free(filesystem);
+    }
+    return result;
+}
+
+int64_t wud_dump_partition(wud_context* context, uint32_t partition, const char* outputdir, struct output_sink* sink) {
+    char output[1024];
+    struct output_sink* filesystem = NULL;
+    int64_t result;
+
+    if (wud_partition_root(context, partition) == NULL) {
+        return -1;
+    }
+
+    strncpy(output, outputdir, 1023);
+    output[1023] = '\0';
+    if (strlen(output) > 1 && output[strlen(output) - 1] == '/') {
+        output[strlen(output) - 1] = '\0';
+    }
+
+    if (sink == NULL) {
+        filesystem = sink_create_filesystem(SINK_FILESYSTEM_SPARSE);
+        if (filesystem == NULL) {
+            return -1;
+        }
+        sink = filesystem;
+    }
+    PROBE_PARTITION_START(context->partitions[partition].name, WIIU_DECRYPTED_AREA_OFFSET + context->partitions[partition].offset);
+    result = dump_partition(context->image, sink, &(context->partitions[partition]), output);
+    PROBE_PARTITION_END(context->partitions[partition].name, WIIU_DECRYPTED_AREA_OFFSET + context->partitions[partition].offset);
+    if (filesystem != NULL) {
+        if (sink_finish(filesystem) != 0) {
+            result = -1;
+        }
+        sink_free(filesystem);
+    }
+    return result;
+}
+
+// Hashes length bytes of the image at offset as they are stored, returns 0 if all of them could be read
+static int identity_update(wud_context* context, mbedtls_sha1_context* sha1, uint64_t offset, uint64_t length, uint8_t* buffer) {
+    uint64_t chunk;
+
+    while (length > 0) {
+        chunk = (length > 0x100000) ? 0x100000 : length;
+        if (readFileOffsetBuffer(offset, buffer, (size_t)chunk, context->image) != chunk) {
+            return -1;
+        }
+        mbedtls_sha1_update(sha1, buffer, (size_t)chunk);
+        offset += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+int wud_image_identity(wud_context* context, uint8_t* sha1) {
+    mbedtls_sha1_context identity;
+    struct partition* partition;
+    struct partition_cluster* cluster;
+    uint8_t* buffer;
+    uint64_t start, cluster_offset, block;
+    uint32_t i, c;
+    int result = 0;
+
+    if (image_size(context->image) == 0 || load_partitions(context, context->partition_count) != 0) {
+        return -1;
+    }
+    buffer = (uint8_t*)malloc(0x100000);
+    if (buffer == NULL) {
+        return -1;
+    }
+    start = stats_start();
+    mbedtls_sha1_init(&identity);
+    mbedtls_sha1_starts(&identity);
+    // The disc header and the partition table, then what each keyed partition holds
+    result = identity_update(context, &identity, 0, WIIU_DECRYPTED_AREA_OFFSET + 0x8000, buffer);
+    for (i = 0; i < context->partition_count && result == 0; i++) {
+        partition = &(context->partitions[i]);
+        if (!partition->has_key) {
+            continue;
+        }
+        mbedtls_sha1_update(&identity, partition->key, 16);
+        for (c = 0; c < partition->cluster_count && result == 0; c++) {
+            cluster = &(partition->clusters[c]);
+            cluster_offset = WIIU_DECRYPTED_AREA_OFFSET + partition->offset + cluster->offset;
+            if (!cluster_is_hashed(partition, (uint16_t)c)) {
+                // Without hashes only the data itself tells two versions apart, these clusters are small
+                result = identity_update(context, &identity, cluster_offset, cluster->size, buffer);
+                continue;
+            }
+            // The header of the first block of each group of 4096 holds the H2 table covering all of them
+            for (block = 0; block < cluster->size / 0x10000 && result == 0; block += 4096) {
+                result = identity_update(context, &identity, cluster_offset + block * 0x10000, 0x400, buffer);
+            }
+        }
+    }
+    mbedtls_sha1_finish(&identity, sha1);
+    mbedtls_sha1_free(&identity);
+    stats_stop(STATS_METADATA, start, 0, 0);
+    free(buffer);
+    return result;
+}
+
+int wud_set_shard(wud_context* context, uint32_t shard, uint32_t count) {
+    UT_array* files;
+    struct file** file;
+    uint64_t total = 0, done = 0, size, offset;
+    uint32_t p, next = 1;
+
+    if (count == 0 || count > WUD_SHARD_MAX || shard >= count || image_size(context->image) == 0
+        || load_partitions(context, context->partition_count) != 0) {
+        return -1;
+    }
+    context->shard_start = 0;
+    context->shard_end = UINT64_MAX;
+    if (count == 1) {
+        return 0;
+    }
+    // Every worker parses the same file tables and sorts them the same way, so all agree on the boundaries
+    utarray_new(files, &file_ptr_icd);
+    for (p = 0; p < context->partition_count; p++) {
+        if (context->volumes[p].files != NULL) {
+            utarray_concat(files, context->volumes[p].files);
+        }
+    }
+    sort_files_by_offset(files);
+    for (file = (struct file**)utarray_front(files); file != NULL; file = (struct file**)utarray_next(files, file)) {
+        total += (uint64_t)(*file)->size;
+    }
+    // A file goes to the shard its middle byte falls into and shard k starts at its first file, so files at
+    // the same offset stay together and an empty shard starts where the next one does
+    for (file = (struct file**)utarray_front(files); file != NULL && next <= shard + 1; file = (struct file**)utarray_next(files, file)) {
+        size = (uint64_t)(*file)->size;
+        offset = (uint64_t)file_physical_offset(*file);
+        while (next < count && next <= shard + 1 && (2 * done + size) * count >= 2 * (uint64_t)next * total) {
+            if (next == shard) {
+                context->shard_start = offset;
+            } else if (next == shard + 1) {
+                context->shard_end = offset;
+            }
+            next++;
+        }
+        done += size;
+    }
+    // The shards past the last file are empty
+    if (next <= shard) {
+        context->shard_start = UINT64_MAX;
+    }
+    utarray_free(files);
+    return 0;
+}
+
+int wud_in_shard(wud_context* context, struct file* file) {
+    uint64_t offset = (uint64_t)file_physical_offset(file);
+
+    return offset >= context->shard_start && offset < context->shard_end;
+}
+
+int wud_extract_partition(wud_context* context, uint32_t partition, const char* outputdir, struct output_sink* sink) {
+    char output[1024];
+    struct output_sink* filesystem = NULL;
+    uint64_t start;
+    int result = 0;
+
+    if (wud_partition_root(context, partition) == NULL) {
+        return -1;
+    }
+
+    strncpy(output, outputdir, 1023);
+    output[1023] = '\0';
+    if (strlen(output) > 1 && output[strlen(output) - 1] == '/') {
+        output[strlen(output) - 1] = '\0';
+    }
+
+    if (sink == NULL) {
+        filesystem = sink_create_filesystem(0);
+        if (filesystem == NULL) {
+            return -1;
+        }
+        sink = filesystem;
+    }
+    start = stats_start();
+    PROBE_PARTITION_START(context->partitions[partition].name, WIIU_DECRYPTED_AREA_OFFSET + context->partitions[partition].offset);
+    extract_all(context->image, sink, context->store, &(context->volumes[partition]), output, context->shard_start, context->shard_end);
+    PROBE_PARTITION_END(context->partitions[partition].name, WIIU_DECRYPTED_AREA_OFFSET + context->partitions[partition].offset);
+    trace_span(context->partitions[partition].name, "partition", start, monotonic_nanoseconds(), 0, 0);
+    if (filesystem != NULL) {
+        result = sink_finish(filesystem);
+        sink_free(filesystem);
+    }
+    return result;
+}
@@ -0,0 +1,105 @@
+#ifndef _WUDECRYPT_H_
+#define _WUDECRYPT_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "sink.h"
+
+// libwudecrypt: opens a WUD image with its keys and gives random access to the decrypted files.
+// All functions taking a context may be called from several threads once wud_open() returned.
+
+typedef struct wud_context wud_context;
+
+// Most workers wud_set_shard() splits an image between
+#define WUD_SHARD_MAX 65536
+
+struct directory;
+struct file;
+struct image_source;
+
+wud_context* wud_open(const char* image_path, const uint8_t* commonkey, const uint8_t* disckey);
+// Reads the image strictly front to back, e.g. from a pipe. File tables are read when a partition is
+// first used, so partitions have to be visited in order and files extracted with wud_extract_partition().
+// Such a context must only be used from one thread and wud_read()/wud_lookup() are not supported.
+wud_context* wud_open_stream(FILE* input, const uint8_t* commonkey, const uint8_t* disckey);
+// Opens any image source (image.h), e.g. one wrapped by image_record(). The context owns image afterwards.
+// A source of unknown size is treated as a stream, like wud_open_stream().
+wud_context* wud_open_source(struct image_source* image, const uint8_t* commonkey, const uint8_t* disckey);
+void wud_close(wud_context* context);
+
+const char* wud_game_serial(wud_context* context);
+const char* wud_game_revision(wud_context* context);
+const char* wud_system_version(wud_context* context);
+const char* wud_game_region(wud_context* context);
+
+uint32_t wud_partition_count(wud_context* context);
+const char* wud_partition_name(wud_context* context, uint32_t partition);
+uint64_t wud_partition_offset(wud_context* context, uint32_t partition);
+// NULL if no key for the partition was found, which also means it has no directory tree
+const uint8_t* wud_partition_key(wud_context* context, uint32_t partition);
+struct directory* wud_partition_root(wud_context* context, uint32_t partition);
+
+uint32_t wud_file_count(wud_context* context, uint32_t partition);
+struct file* wud_file(wud_context* context, uint32_t partition, uint32_t index);
+const char* wud_file_name(struct file* file);
+const char* wud_file_parent(struct file* file);
+uint64_t wud_file_size(struct file* file);
+
+// Resolves "<partition name>/<path>", returns the partition index or -1 if nothing matches.
+// dir or file is set depending on what the path names, both stay NULL for the top level.
+int wud_lookup(wud_context* context, const char* path, struct directory** dir, struct file** file);
+
+// Reads up to length bytes starting at offset of a decrypted file, returns the bytes read or -1.
+// Thread-safe and allocation-free: scratch buffers live on the calling thread's stack.
+int64_t wud_read(wud_context* context, struct file* file, uint64_t offset, size_t length, uint8_t* buffer);
+
+// Shares extracted files between discs through a content-addressed store in path, NULL turns it off.
+// Files already in the store are linked or copied from there instead of being decrypted, new ones are
+// added to it. Returns 0 on success.
+int wud_set_store(wud_context* context, const char* path);
+// Reuses the files of an earlier extraction (for example of a previous revision) whose content did
+// not change. path is its index or the output directory holding it. Returns 0 on success.
+int wud_add_previous(wud_context* context, const char* path);
+// Writes an index of content keys into every output directory, implied by the two functions above.
+// Extracting to a sink without real files writes no index. Returns 0 on success.
+int wud_write_index(wud_context* context);
+// Files reused from the store or earlier extractions, their total size and files added to the store
+void wud_store_stats(wud_context* context, uint64_t* reused, uint64_t* reused_bytes, uint64_t* added);
+
+// Checks every hashed block of a partition against its hashes with threads workers, without extracting.
+// level is how far up the hash tree to check, from 0 (only H0) to 3 (all of it, see verify.h).
+// Bad blocks and the files they affect are written to report as JSON lines, ending with a summary line.
+// Needs a context from wud_open(). Returns 0 if the partition could be checked, bad_blocks holds the result.
+int wud_verify_partition(wud_context* context, uint32_t partition, int level, uint32_t threads, FILE* report, uint64_t* bad_blocks);
+
+// Maps which sectors of the image are used: the disc header, file tables and file extents of every
+// partition. Afterwards wud_verify_partition() skips the padding. Needs a context from wud_open() on an
+// image of known size. Returns 0 on success.
+int wud_build_usage(wud_context* context);
+// Prints the used space of each partition and the whole image, nothing before wud_build_usage()
+void wud_usage_report(wud_context* context, FILE* output);
+// Writes a copy of the image to path through sink with only the used sectors, the rest becomes holes.
+// NULL writes a sparse file. Builds the usage map if needed. Returns 0 on success.
+int wud_write_trimmed(wud_context* context, const char* path, struct output_sink* sink);
+
+// SHA-1 of everything the extracted files depend on: the disc header and partition table, the partition
+// keys, the hash tables of hashed clusters and the data of unhashed ones, which are read in full. Images
+// with the same identity extract to the same files. Needs a context from wud_open(). Returns 0 on success.
+int wud_image_identity(wud_context* context, uint8_t* sha1);
+
+// Splits the files of all partitions, ordered by where they are stored, into count ranges of about the same
+// size and leaves only range shard (from 0) to wud_extract_partition(). Every worker calling this with the
+// same image and count gets the same boundaries, so count processes or machines can share one extraction
+// without talking to each other. Needs a context from wud_open(), count is at most WUD_SHARD_MAX. Returns 0 on success.
+int wud_set_shard(wud_context* context, uint32_t shard, uint32_t count);
+// 1 if file is in the range set by wud_set_shard(), which is every file until it is called
+int wud_in_shard(wud_context* context, struct file* file);
+
+// Extracts a partition below outputdir through sink, NULL writes plain files to the filesystem.
+// Only the files of the current shard are written, the directories all are.
+int wud_extract_partition(wud_context* context, uint32_t partition, const char* outputdir, struct output_sink* sink);
+// Writes the decrypted partition as one image, <name>.img, plus its layout, <name>.layout.json, into outputdir
+// through sink (see dump.h). NULL writes a sparse file. Works on streamed images too. Returns the number of
+// blocks failing their hash check or -1 on error.
+int64_t wud_dump_partition(wud_context* context, uint32_t partition, const char* outputdir, struct output_sink* sink);
+#endif // _WUDECRYPT_H_
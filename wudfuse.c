@@ -0,0 +1,172 @@
+#define FUSE_USE_VERSION 26
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "utarray.h"
+#include "struct.h"
+#include "functions.h"
+#include "wudecrypt.h"
+
+static wud_context* context;
+
+static int is_root(const char* path) {
+    while (*path == '/') {
+        path++;
+    }
+    return *path == '\0';
+}
+
+static int wud_fuse_getattr(const char* path, struct stat* st) {
+    struct directory* dir;
+    struct file* file;
+
+    if (wud_lookup(context, path, &dir, &file) < 0 && !is_root(path)) {
+        return -ENOENT;
+    }
+
+    memset(st, 0, sizeof(struct stat));
+    if (file != NULL) {
+        st->st_mode = S_IFREG | 0444;
+        st->st_nlink = 1;
+        st->st_size = file->size;
+    } else {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+    }
+    return 0;
+}
+
+static int wud_fuse_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
+    struct directory* dir;
+    struct directory* subdir;
+    struct file* file;
+    uint32_t i;
+
+    if (is_root(path)) {
+        filler(buf, ".", NULL, 0);
+        filler(buf, "..", NULL, 0);
+        for (i = 0; i < wud_partition_count(context); i++) {
+            if (wud_partition_root(context, i) != NULL) {
+                filler(buf, wud_partition_name(context, i), NULL, 0);
+            }
+        }
+        return 0;
+    }
+
+    if (wud_lookup(context, path, &dir, &file) < 0) {
+        return -ENOENT;
+    }
+    if (file != NULL) {
+        return -ENOTDIR;
+    }
+
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+
+    for (subdir = (struct directory*)utarray_front(dir->subdirs); subdir != NULL; subdir = (struct directory*)utarray_next(dir->subdirs, subdir)) {
+        filler(buf, subdir->directory_name, NULL, 0);
+    }
+    for (file = (struct file*)utarray_front(dir->files); file != NULL; file = (struct file*)utarray_next(dir->files, file)) {
+        filler(buf, file->filename, NULL, 0);
+    }
+    return 0;
+}
+
+static int wud_fuse_open(const char* path, struct fuse_file_info* fi) {
+    struct directory* dir;
+    struct file* file;
+
+    if (wud_lookup(context, path, &dir, &file) < 0) {
+        return -ENOENT;
+    }
+    if (file == NULL) {
+        return -EISDIR;
+    }
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EROFS;
+    }
+
+    // Keep the file record so reads don't have to walk the tree again
+    fi->fh = (uint64_t)(uintptr_t)file;
+    fi->keep_cache = 1;
+    return 0;
+}
+
+static int wud_fuse_read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+    struct file* file = (struct file*)(uintptr_t)fi->fh;
+    int64_t done;
+
+    if (file == NULL) {
+        return -EBADF;
+    }
+
+    done = wud_read(context, file, (uint64_t)offset, size, (uint8_t*)buf);
+
+    return (done < 0) ? -EIO : (int)done;
+}
+
+static struct fuse_operations wud_operations = {
+    .getattr = wud_fuse_getattr,
+    .readdir = wud_fuse_readdir,
+    .open = wud_fuse_open,
+    .read = wud_fuse_read,
+};
+
+int main(int argc, char* argv[]) {
+    int i, fuse_argc;
+    uint8_t* commonkey;
+    uint8_t* disckey;
+    char** fuse_argv;
+
+    if (argc < 5) {
+        printf("Usage: %s <disc.wud> <commonkey.bin> <disckey.bin> <mountpoint> [<FUSE options>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    commonkey = loadKey(argv[2]);
+    if (commonkey == NULL) {
+        fprintf(stderr, "Error while loading common key\n");
+        exit(EXIT_FAILURE);
+    }
+
+    disckey = loadKey(argv[3]);
+    if (disckey == NULL) {
+        fprintf(stderr, "Error while loading disc key\n");
+        exit(EXIT_FAILURE);
+    }
+
+    context = wud_open(argv[1], commonkey, disckey);
+    if (context == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < wud_partition_count(context); i++) {
+        if (wud_partition_key(context, i) == NULL) {
+            fprintf(stderr, "WARNING: Partition %s has no matching key and cannot be decrypted\n", wud_partition_name(context, i));
+        }
+    }
+
+    // Hand the mountpoint and any remaining options to FUSE, always mounting read-only
+    fuse_argv = (char**)malloc((argc + 2) * sizeof(char*));
+    fuse_argc = 0;
+    fuse_argv[fuse_argc++] = argv[0];
+    fuse_argv[fuse_argc++] = argv[4];
+    fuse_argv[fuse_argc++] = "-oro";
+    for (i = 5; i < argc; i++) {
+        fuse_argv[fuse_argc++] = argv[i];
+    }
+
+    i = fuse_main(fuse_argc, fuse_argv, &wud_operations, NULL);
+
+    wud_close(context);
+    free(fuse_argv);
+    free(commonkey);
+    free(disckey);
+    return i;
+}
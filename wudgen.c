@@ -0,0 +1,44 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gen.h"
+
+static uint64_t parse_size(const char* arg) {
+    char* end;
+    uint64_t value = strtoull(arg, &end, 0);
+    if (*end == 'K' || *end == 'k') value <<= 10;
+    if (*end == 'M' || *end == 'm') value <<= 20;
+    if (*end == 'G' || *end == 'g') value <<= 30;
+    return value;
+}
+
+int main(int argc, char* argv[]) {
+    struct gen_options options;
+    char* plaindir = NULL;
+    int64_t size;
+    int a;
+
+    if (argc < 4) {
+        printf("Usage: %s <disc.wud> <commonkey.bin> <disckey.bin> [-n <files>] [-s <min size>] [-S <max size>] [-u <unhashed %%>] [-r <seed>] [-p <plaintext dir>] [-v <revision>] [-k <disc key seed>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    gen_default_options(&options);
+    for (a = 4; a + 1 < argc; a += 2) {
+        if (strcmp(argv[a], "-n") == 0) options.file_count = (uint32_t)strtoul(argv[a + 1], NULL, 0);
+        else if (strcmp(argv[a], "-s") == 0) options.min_size = parse_size(argv[a + 1]);
+        else if (strcmp(argv[a], "-S") == 0) options.max_size = parse_size(argv[a + 1]);
+        else if (strcmp(argv[a], "-u") == 0) options.unhashed_percent = (uint32_t)strtoul(argv[a + 1], NULL, 0);
+        else if (strcmp(argv[a], "-r") == 0) options.seed = strtoull(argv[a + 1], NULL, 0);
+        else if (strcmp(argv[a], "-p") == 0) plaindir = argv[a + 1];
+        else if (strcmp(argv[a], "-v") == 0) options.revision = (uint32_t)strtoul(argv[a + 1], NULL, 0);
+        else if (strcmp(argv[a], "-k") == 0) options.disc_seed = strtoull(argv[a + 1], NULL, 0);
+    }
+
+    size = gen_write_image(&options, argv[1], argv[2], argv[3], plaindir);
+    if (size < 0) {
+        exit(EXIT_FAILURE);
+    }
+    printf("Wrote %s: %u files, %llu bytes\n", argv[1], options.file_count, (unsigned long long int)size);
+    return EXIT_SUCCESS;
+}
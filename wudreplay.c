@@ -0,0 +1,439 @@
+#ifdef __linux__
+// For O_DIRECT
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
+#include "functions.h"
+#include "image.h"
+#include "record.h"
+
+// O_DIRECT reads have to start and end on this boundary, in memory as well
+#define REPLAY_ALIGNMENT 4096
+
+struct replay;
+
+// A way of reading the target, the image, fd and map fields of struct replay belong to it
+struct replay_backend {
+    const char* name;
+    int (*open)(struct replay* replay, const char* path);
+    // Reads size bytes at offset into buffer, which holds size + 2 * REPLAY_ALIGNMENT bytes and is aligned
+    size_t (*read)(struct replay* replay, uint64_t offset, uint8_t* buffer, size_t size);
+    // Hints and releases of the recording, may be NULL to ignore them
+    void (*apply)(struct replay* replay, const struct record_entry* entry);
+    void (*close)(struct replay* replay);
+};
+
+struct replay {
+    const struct replay_backend* backend;
+    struct image_source* image;
+    int fd;
+    uint8_t* map;
+    uint64_t map_size;
+
+    struct record_entry* entries;
+    uint64_t entry_count;
+    uint32_t max_length;
+    // Nanoseconds each read took, by entry
+    uint64_t* latencies;
+    // Keep the pauses of the recording instead of reading as fast as possible
+    int timed;
+    uint64_t started;
+
+    // Workers either share next_entry or each replay one recorded thread
+    pthread_mutex_t lock;
+    uint64_t next_entry;
+    int per_thread;
+    uint64_t bytes;
+    uint64_t short_reads;
+};
+
+struct replay_worker {
+    struct replay* replay;
+    uint16_t thread;
+};
+
+static int image_backend_open(struct replay* replay, const char* path) {
+    replay->image = image_open(path);
+    return (replay->image != NULL) ? 0 : -1;
+}
+
+static size_t image_backend_read(struct replay* replay, uint64_t offset, uint8_t* buffer, size_t size) {
+    return replay->image->read_at(replay->image, offset, buffer, size);
+}
+
+static void image_backend_apply(struct replay* replay, const struct record_entry* entry) {
+    if (entry->type == RECORD_HINT) {
+        image_hint(replay->image, entry->hint, entry->offset, entry->length);
+    } else if (entry->type == RECORD_RELEASE) {
+        image_release(replay->image, entry->offset);
+    }
+}
+
+static void image_backend_close(struct replay* replay) {
+    image_close(replay->image);
+}
+
+#ifndef _WIN32
+static int pread_backend_open(struct replay* replay, const char* path) {
+    replay->fd = open(path, O_RDONLY);
+    return (replay->fd >= 0) ? 0 : -1;
+}
+
+static size_t pread_all(int fd, uint64_t offset, uint8_t* buffer, size_t size) {
+    size_t done = 0;
+    ssize_t result;
+
+    while (done < size) {
+        result = pread(fd, buffer + done, size - done, (off_t)(offset + done));
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            break;
+        }
+        done += (size_t)result;
+    }
+    return done;
+}
+
+static size_t pread_backend_read(struct replay* replay, uint64_t offset, uint8_t* buffer, size_t size) {
+    return pread_all(replay->fd, offset, buffer, size);
+}
+
+static void pread_backend_close(struct replay* replay) {
+    close(replay->fd);
+}
+
+#ifdef O_DIRECT
+static int direct_backend_open(struct replay* replay, const char* path) {
+    replay->fd = open(path, O_RDONLY | O_DIRECT);
+    return (replay->fd >= 0) ? 0 : -1;
+}
+
+// Bypasses the page cache, so the range is widened to whole aligned blocks
+static size_t direct_backend_read(struct replay* replay, uint64_t offset, uint8_t* buffer, size_t size) {
+    uint64_t start = offset & ~(uint64_t)(REPLAY_ALIGNMENT - 1);
+    uint64_t end = (offset + size + REPLAY_ALIGNMENT - 1) & ~(uint64_t)(REPLAY_ALIGNMENT - 1);
+    size_t done = pread_all(replay->fd, start, buffer, (size_t)(end - start));
+
+    if (done <= offset - start) {
+        return 0;
+    }
+    return (done - (offset - start) > size) ? size : done - (size_t)(offset - start);
+}
+#endif
+
+static int mmap_backend_open(struct replay* replay, const char* path) {
+    struct stat info;
+
+    replay->fd = open(path, O_RDONLY);
+    if (replay->fd < 0 || fstat(replay->fd, &info) != 0 || info.st_size == 0) {
+        return -1;
+    }
+    replay->map_size = (uint64_t)info.st_size;
+    replay->map = (uint8_t*)mmap(NULL, (size_t)replay->map_size, PROT_READ, MAP_SHARED, replay->fd, 0);
+    return (replay->map != MAP_FAILED) ? 0 : -1;
+}
+
+static size_t mmap_backend_read(struct replay* replay, uint64_t offset, uint8_t* buffer, size_t size) {
+    if (offset >= replay->map_size) {
+        return 0;
+    }
+    if (size > replay->map_size - offset) {
+        size = (size_t)(replay->map_size - offset);
+    }
+    memcpy(buffer, replay->map + offset, size);
+    return size;
+}
+
+static void mmap_backend_close(struct replay* replay) {
+    munmap(replay->map, (size_t)replay->map_size);
+    close(replay->fd);
+}
+#endif
+
+static const struct replay_backend backends[] = {
+#ifndef _WIN32
+    { "pread", pread_backend_open, pread_backend_read, NULL, pread_backend_close },
+#endif
+    { "image", image_backend_open, image_backend_read, image_backend_apply, image_backend_close },
+#ifndef _WIN32
+    { "mmap", mmap_backend_open, mmap_backend_read, NULL, mmap_backend_close },
+#ifdef O_DIRECT
+    { "direct", direct_backend_open, direct_backend_read, NULL, pread_backend_close },
+#endif
+#endif
+};
+#define BACKEND_COUNT (sizeof(backends) / sizeof(backends[0]))
+
+// Waits until the entry is due, relative to the start of the replay
+static void wait_for(struct replay* replay, const struct record_entry* entry) {
+    uint64_t now = monotonic_nanoseconds() - replay->started;
+#ifndef _WIN32
+    struct timespec pause;
+
+    if (entry->nanoseconds > now) {
+        pause.tv_sec = (time_t)((entry->nanoseconds - now) / 1000000000ULL);
+        pause.tv_nsec = (long)((entry->nanoseconds - now) % 1000000000ULL);
+        while (nanosleep(&pause, &pause) != 0 && errno == EINTR) {
+        }
+    }
+#else
+    if (entry->nanoseconds > now) {
+        Sleep((DWORD)((entry->nanoseconds - now) / 1000000ULL));
+    }
+#endif
+}
+
+static void replay_entry(struct replay* replay, uint64_t index, uint8_t* buffer) {
+    const struct record_entry* entry = &(replay->entries[index]);
+    uint64_t start;
+    size_t done;
+
+    if (replay->timed) {
+        wait_for(replay, entry);
+    }
+    if (entry->type != RECORD_READ) {
+        if (replay->backend->apply != NULL) {
+            replay->backend->apply(replay, entry);
+        }
+        return;
+    }
+    start = monotonic_nanoseconds();
+    done = replay->backend->read(replay, entry->offset, buffer, entry->length);
+    replay->latencies[index] = monotonic_nanoseconds() - start;
+
+    pthread_mutex_lock(&(replay->lock));
+    replay->bytes += done;
+    if (done != entry->length) {
+        replay->short_reads++;
+    }
+    pthread_mutex_unlock(&(replay->lock));
+}
+
+static void* replay_worker(void* arg) {
+    struct replay_worker* worker = (struct replay_worker*)arg;
+    struct replay* replay = worker->replay;
+    uint8_t* buffer;
+    uint8_t* allocated;
+    uint64_t index;
+
+    // Room to widen a read to aligned blocks on either side
+    allocated = (uint8_t*)malloc((size_t)replay->max_length + 3 * REPLAY_ALIGNMENT);
+    if (allocated == NULL) {
+        fprintf(stderr, "Could not allocate enough memory for a replay buffer\n");
+        return NULL;
+    }
+    buffer = (uint8_t*)(((uintptr_t)allocated + REPLAY_ALIGNMENT - 1) & ~(uintptr_t)(REPLAY_ALIGNMENT - 1));
+
+    if (replay->per_thread) {
+        for (index = 0; index < replay->entry_count; index++) {
+            if (replay->entries[index].thread == worker->thread) {
+                replay_entry(replay, index, buffer);
+            }
+        }
+    } else {
+        for (;;) {
+            pthread_mutex_lock(&(replay->lock));
+            index = replay->next_entry++;
+            pthread_mutex_unlock(&(replay->lock));
+            if (index >= replay->entry_count) {
+                break;
+            }
+            replay_entry(replay, index, buffer);
+        }
+    }
+    free(allocated);
+    return NULL;
+}
+
+static int compare_latencies(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_usage(const char* program) {
+    uint32_t b;
+
+    printf("Usage: %s <recording> <image or device> [options]\n", program);
+    printf("Reads from the target what an extraction run with --record-io <recording> read, without keys or decryption.\n");
+    printf("  -b <backend>  How to read:");
+    for (b = 0; b < BACKEND_COUNT; b++) {
+        printf(" %s%s", backends[b].name, (b == 0) ? " (default)" : "");
+    }
+    printf("\n                image goes through libwudecrypt and applies the recorded hints and releases\n");
+    printf("  -j <threads>  Workers taking reads in recorded order from one queue, i.e. the queue depth.\n");
+    printf("                0 (default) replays each recorded thread on a thread of its own\n");
+    printf("  -t            Keep the pauses between reads of the recording instead of reading as fast as possible\n");
+    printf("  -c            Drop the target from the page cache first\n");
+    printf("  -o <file>     Also write the results as JSON to <file>, - for stdout\n");
+}
+
+int main(int argc, char* argv[]) {
+    struct replay replay;
+    struct replay_worker* workers;
+    pthread_t* threads;
+    const char* backend = NULL;
+    const char* json = NULL;
+    uint64_t image_size, reads = 0, i, k;
+    uint64_t* sorted;
+    uint32_t thread_count = 0, worker_count, started = 0, b;
+    int cold = 0, a;
+    double seconds, p50, p90, p99, max;
+    FILE* output;
+
+    memset(&replay, 0, sizeof(replay));
+    if (argc < 3) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    for (a = 3; a < argc; a++) {
+        if (strcmp(argv[a], "-b") == 0 && a + 1 < argc) backend = argv[++a];
+        else if (strcmp(argv[a], "-j") == 0 && a + 1 < argc) thread_count = (uint32_t)strtoul(argv[++a], NULL, 10);
+        else if (strcmp(argv[a], "-o") == 0 && a + 1 < argc) json = argv[++a];
+        else if (strcmp(argv[a], "-t") == 0) replay.timed = 1;
+        else if (strcmp(argv[a], "-c") == 0) cold = 1;
+        else {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    replay.backend = &backends[0];
+    for (b = 0; backend != NULL && b < BACKEND_COUNT && strcmp(backends[b].name, backend) != 0; b++) {
+    }
+    if (backend != NULL) {
+        if (b == BACKEND_COUNT) {
+            fprintf(stderr, "Unknown backend %s\n", backend);
+            exit(EXIT_FAILURE);
+        }
+        replay.backend = &backends[b];
+    }
+
+    replay.entries = record_load(argv[1], &(replay.entry_count), &image_size);
+    if (replay.entries == NULL) {
+        fprintf(stderr, "Error: %s is no I/O recording\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    replay.latencies = (uint64_t*)calloc((size_t)replay.entry_count + 1, sizeof(uint64_t));
+    sorted = (uint64_t*)malloc(((size_t)replay.entry_count + 1) * sizeof(uint64_t));
+    if (replay.latencies == NULL || sorted == NULL) {
+        fprintf(stderr, "Could not allocate enough memory for %llu entries\n", (unsigned long long int)replay.entry_count);
+        exit(EXIT_FAILURE);
+    }
+    worker_count = thread_count;
+    for (i = 0; i < replay.entry_count; i++) {
+        if (replay.entries[i].type == RECORD_READ) {
+            reads++;
+            if (replay.entries[i].length > replay.max_length) {
+                replay.max_length = replay.entries[i].length;
+            }
+        }
+        if (thread_count == 0 && replay.entries[i].thread + 1U > worker_count) {
+            worker_count = replay.entries[i].thread + 1U;
+        }
+    }
+    replay.per_thread = (thread_count == 0);
+    if (worker_count == 0) {
+        worker_count = 1;
+    }
+
+#if !defined(_WIN32) && defined(__linux__)
+    if (cold) {
+        // Only clean pages are dropped, which is all a read-only image has
+        replay.fd = open(argv[2], O_RDONLY);
+        if (replay.fd >= 0) {
+            posix_fadvise(replay.fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(replay.fd);
+        }
+    }
+#else
+    if (cold) {
+        fprintf(stderr, "WARNING: Dropping the page cache isn't supported here\n");
+    }
+#endif
+    if (replay.backend->open(&replay, argv[2]) != 0) {
+        fprintf(stderr, "Error: Could not open %s with the %s backend\n", argv[2], replay.backend->name);
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_init(&(replay.lock), NULL);
+    workers = (struct replay_worker*)calloc(worker_count, sizeof(struct replay_worker));
+    threads = (pthread_t*)calloc(worker_count, sizeof(pthread_t));
+    if (workers == NULL || threads == NULL) {
+        fprintf(stderr, "Could not allocate enough memory for %u workers\n", worker_count);
+        exit(EXIT_FAILURE);
+    }
+    replay.started = monotonic_nanoseconds();
+    for (started = 0; started < worker_count; started++) {
+        workers[started].replay = &replay;
+        workers[started].thread = (uint16_t)started;
+        if (pthread_create(&threads[started], NULL, replay_worker, &workers[started]) != 0) {
+            break;
+        }
+    }
+    if (started < worker_count && !replay.per_thread && started > 0) {
+        fprintf(stderr, "WARNING: Only %u of %u workers could be started\n", started, worker_count);
+    } else if (started < worker_count) {
+        fprintf(stderr, "Error: Could not start the workers\n");
+        exit(EXIT_FAILURE);
+    }
+    for (b = 0; b < started; b++) {
+        pthread_join(threads[b], NULL);
+    }
+    seconds = (monotonic_nanoseconds() - replay.started) / 1e9;
+    replay.backend->close(&replay);
+
+    for (i = 0, k = 0; i < replay.entry_count; i++) {
+        if (replay.entries[i].type == RECORD_READ) {
+            sorted[k++] = replay.latencies[i];
+        }
+    }
+    qsort(sorted, (size_t)k, sizeof(uint64_t), compare_latencies);
+    p50 = (k > 0) ? sorted[k / 2] / 1000.0 : 0.0;
+    p90 = (k > 0) ? sorted[k * 9 / 10] / 1000.0 : 0.0;
+    p99 = (k > 0) ? sorted[k * 99 / 100] / 1000.0 : 0.0;
+    max = (k > 0) ? sorted[k - 1] / 1000.0 : 0.0;
+
+    printf("%s: %llu reads, %.1f MiB in %.3f s (%.1f MiB/s, %.0f reads/s) on %u threads\n", replay.backend->name, (unsigned long long int)reads,
+        replay.bytes / (1024.0 * 1024.0), seconds, (seconds > 0) ? replay.bytes / seconds / (1024 * 1024) : 0.0, (seconds > 0) ? reads / seconds : 0.0, worker_count);
+    printf("latency: p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n", p50, p90, p99, max);
+    if (replay.short_reads > 0) {
+        printf("WARNING: %llu reads returned less than recorded, is this the recorded image?\n", (unsigned long long int)replay.short_reads);
+    }
+    if (json != NULL) {
+        output = (strcmp(json, "-") == 0) ? stdout : fopen(json, "w");
+        if (output == NULL) {
+            fprintf(stderr, "Error: Could not open %s for writing\n", json);
+            exit(EXIT_FAILURE);
+        }
+        fprintf(output, "{\"backend\":\"%s\",\"threads\":%u,\"per_recorded_thread\":%s,\"timed\":%s,\"cold\":%s,\"reads\":%llu,\"short_reads\":%llu,\"bytes\":%llu,"
+            "\"seconds\":%.6f,\"latency_us\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}}\n",
+            replay.backend->name, worker_count, replay.per_thread ? "true" : "false", replay.timed ? "true" : "false", cold ? "true" : "false",
+            (unsigned long long int)reads, (unsigned long long int)replay.short_reads, (unsigned long long int)replay.bytes, seconds, p50, p90, p99, max);
+        if (output != stdout) {
+            fclose(output);
+        }
+    }
+
+    pthread_mutex_destroy(&(replay.lock));
+    free(workers);
+    free(threads);
+    free(sorted);
+    free(replay.latencies);
+    free(replay.entries);
+    return (replay.short_reads > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}